@@ -0,0 +1,500 @@
+﻿// Benchmark.cpp : Measures throughput on a reproducible synthetic corpus.
+//
+// Generates JPEG and PNG images of random sizes (grayscale, color and, for PNG, alpha),
+// then runs every stage on them for each interpolation mode, output format and a range
+// of thread counts, and reports images/s, MB/s and the time spent in each stage.
+
+#include "ImageResizer.h"
+#include "FileIO.h"
+
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunused-parameter"
+#elif defined(__GNUC__) || defined(__GNUG__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+#elif defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable : 4244)
+#pragma warning(disable : 4018)
+#endif
+#define PROGRAMOPTIONS_NO_COLORS
+#include <ProgramOptions.hxx>
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#elif defined(__GNUC__) || defined(__GNUG__)
+#pragma GCC diagnostic pop
+#elif defined(_MSC_VER)
+#pragma warning(pop)
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+namespace
+{
+using StageFunction = bool (*)(SImageJob&, const SProgramOptions&);
+
+const StageFunction k_stages[] = {ReadStage, DecodeStage, ResizeStage, EncodeStage, WriteStage};
+const char* const k_stage_names[] = {"read", "decode", "resize", "encode", "write"};
+const size_t k_num_stages = std::size(k_stages);
+
+struct SInterpolationMode
+{
+	const char* name;
+	cv::InterpolationFlags interpolation;
+};
+
+const SInterpolationMode k_interpolation_modes[] = {
+    {"nn", cv::InterpolationFlags::INTER_NEAREST},
+    {"linear", cv::InterpolationFlags::INTER_LINEAR},
+    {"cubic", cv::InterpolationFlags::INTER_CUBIC},
+    {"area", cv::InterpolationFlags::INTER_AREA},
+    {"lanczos4", cv::InterpolationFlags::INTER_LANCZOS4}};
+
+struct SOutputFormatMode
+{
+	const char* name;
+	EOutputFormat output_format;
+};
+
+const SOutputFormatMode k_output_format_modes[] = {
+    {"inplace", EOutputFormat::INPLACE},
+    {"flat", EOutputFormat::FLAT_WITH_PREFIXES},
+    {"mirror", EOutputFormat::RECREATE_FOLDER_STRUCTURE}};
+
+// The corpus cycles through these, JPEG has no alpha channel
+struct SCorpusVariant
+{
+	const char* extension;
+	int channels;
+};
+
+const SCorpusVariant k_corpus_variants[] = {
+    {".jpg", 1}, {".jpg", 3}, {".png", 1}, {".png", 3}, {".png", 4}};
+
+struct SCorpusOptions
+{
+	std::string folder{""};
+	uint32_t num_images{50};
+	// Range of the longer side of the images, sampled log-uniformly
+	uint32_t min_size{256};
+	uint32_t max_size{4096};
+	uint32_t seed{1};
+};
+
+struct SBenchmarkResult
+{
+	const char* interpolation{""};
+	const char* output_format{""};
+	uint32_t num_threads{0};
+	uint32_t num_images{0};
+	uint32_t num_failed{0};
+	uint64_t input_bytes{0};
+	double wall_seconds{0.0};
+	// Summed over all threads
+	std::array<double, k_num_stages> stage_seconds{};
+};
+
+// Smooth shapes with some noise on top compress roughly like photos do,
+// flat colors or pure noise would make the codecs look much faster or slower
+cv::Mat MakeSyntheticImage(cv::RNG& rng, int width, int height, int channels)
+{
+	cv::Mat coarse(std::max(height / 32, 2), std::max(width / 32, 2), CV_8UC(channels));
+	rng.fill(coarse, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(256));
+
+	cv::Mat image;
+	cv::resize(coarse, image, cv::Size(width, height), 0, 0, cv::InterpolationFlags::INTER_CUBIC);
+
+	cv::Mat noise(height, width, CV_8UC(channels));
+	rng.fill(noise, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(24));
+	cv::add(image, noise, image);
+
+	return image;
+}
+
+// Writes the corpus, the same options always produce the same files
+bool GenerateCorpus(const SCorpusOptions& corpus_options, std::vector<std::string>& paths,
+                    uint64_t& total_bytes)
+{
+	std::error_code ec;
+	fs::remove_all(corpus_options.folder, ec);
+	fs::create_directories(corpus_options.folder, ec);
+	if (ec)
+	{
+		std::cout << "ERROR: cannot create the corpus folder \"" << corpus_options.folder
+		          << "\"\n";
+		return false;
+	}
+
+	cv::RNG rng(corpus_options.seed);
+	const double log_min_size = std::log((double)corpus_options.min_size);
+	const double log_max_size = std::log((double)corpus_options.max_size);
+	total_bytes = 0;
+
+	for (uint32_t i = 0; i < corpus_options.num_images; ++i)
+	{
+		const SCorpusVariant& variant = k_corpus_variants[i % std::size(k_corpus_variants)];
+
+		const int long_side = (int)std::lround(std::exp(rng.uniform(log_min_size, log_max_size)));
+		const int short_side = std::max((int)(long_side * rng.uniform(0.5, 1.0)), 1);
+		const bool landscape = rng.uniform(0, 2) == 0;
+		const int width = landscape ? long_side : short_side;
+		const int height = landscape ? short_side : long_side;
+
+		std::ostringstream name;
+		name << "image_" << std::setw(5) << std::setfill('0') << i << variant.extension;
+		const std::string path = (fs::path(corpus_options.folder) / name.str()).string();
+
+		const cv::Mat image = MakeSyntheticImage(rng, width, height, variant.channels);
+		if (!cv::imwrite(path, image))
+		{
+			std::cout << "ERROR: cannot write \"" << path << "\"\n";
+			return false;
+		}
+
+		paths.push_back(path);
+		total_bytes += fs::file_size(path, ec);
+	}
+
+	return true;
+}
+
+// Runs every stage on every input with num_threads threads
+SBenchmarkResult RunBenchmark(const std::vector<std::string>& inputs,
+                              const SProgramOptions& program_options, uint32_t num_threads)
+{
+	SBenchmarkResult result;
+	result.num_threads = num_threads;
+	result.num_images = (uint32_t)inputs.size();
+
+	std::error_code ec;
+	for (const std::string& input : inputs)
+	{
+		result.input_bytes += fs::file_size(input, ec);
+	}
+
+	std::vector<std::array<double, k_num_stages>> stage_seconds(num_threads);
+	std::vector<uint32_t> num_failed(num_threads, 0);
+	std::atomic<size_t> next_input{0};
+
+	const auto worker = [&](uint32_t thread_index) {
+		for (size_t i = next_input++; i < inputs.size(); i = next_input++)
+		{
+			SImageJob job;
+			job.path = inputs[i];
+
+			for (size_t stage = 0; stage < k_num_stages; ++stage)
+			{
+				const auto start = std::chrono::steady_clock::now();
+				const bool stage_success = k_stages[stage](job, program_options);
+				stage_seconds[thread_index][stage] +=
+				    std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+				        .count();
+
+				if (!stage_success)
+				{
+					num_failed[thread_index]++;
+					break;
+				}
+			}
+		}
+	};
+
+	const auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> threads;
+	for (uint32_t i = 1; i < num_threads; ++i)
+	{
+		threads.emplace_back(worker, i);
+	}
+	worker(0);
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+
+	result.wall_seconds =
+	    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	for (uint32_t i = 0; i < num_threads; ++i)
+	{
+		result.num_failed += num_failed[i];
+		for (size_t stage = 0; stage < k_num_stages; ++stage)
+		{
+			result.stage_seconds[stage] += stage_seconds[i][stage];
+		}
+	}
+
+	return result;
+}
+
+void PrintResultHeader(std::ostream& stream)
+{
+	stream << std::left << std::setw(10) << "interp" << std::setw(9) << "format" << std::right
+	       << std::setw(8) << "threads" << std::setw(10) << "images/s" << std::setw(9) << "MB/s";
+	for (const char* stage_name : k_stage_names)
+	{
+		stream << std::setw(9) << stage_name;
+	}
+	stream << "  (ms/image per stage)\n";
+}
+
+void PrintResult(std::ostream& stream, const SBenchmarkResult& result)
+{
+	const double num_images = std::max(result.num_images, 1u);
+
+	stream << std::left << std::setw(10) << result.interpolation << std::setw(9)
+	       << result.output_format << std::right << std::setw(8) << result.num_threads
+	       << std::fixed << std::setprecision(1) << std::setw(10)
+	       << result.num_images / result.wall_seconds << std::setw(9)
+	       << result.input_bytes / 1e6 / result.wall_seconds << std::setprecision(2);
+	for (double seconds : result.stage_seconds)
+	{
+		stream << std::setw(9) << 1000.0 * seconds / num_images;
+	}
+	if (result.num_failed)
+	{
+		stream << "  " << result.num_failed << " failed";
+	}
+	stream << '\n' << std::defaultfloat;
+}
+
+void WriteCsv(std::ostream& stream, const std::vector<SBenchmarkResult>& results)
+{
+	stream << "interpolation,output_format,threads,images,failed,input_bytes,wall_seconds,"
+	          "images_per_second,mb_per_second";
+	for (const char* stage_name : k_stage_names)
+	{
+		stream << ',' << stage_name << "_ms_per_image";
+	}
+	stream << '\n';
+
+	for (const SBenchmarkResult& result : results)
+	{
+		const double num_images = std::max(result.num_images, 1u);
+
+		stream << result.interpolation << ',' << result.output_format << ','
+		       << result.num_threads << ',' << result.num_images << ',' << result.num_failed
+		       << ',' << result.input_bytes << ',' << result.wall_seconds << ','
+		       << result.num_images / result.wall_seconds << ','
+		       << result.input_bytes / 1e6 / result.wall_seconds;
+		for (double seconds : result.stage_seconds)
+		{
+			stream << ',' << 1000.0 * seconds / num_images;
+		}
+		stream << '\n';
+	}
+}
+
+// 1, 2, 4, ... up to and including max_threads
+std::vector<uint32_t> ThreadCounts(uint32_t max_threads)
+{
+	std::vector<uint32_t> thread_counts;
+	for (uint32_t num_threads = 1; num_threads < max_threads; num_threads *= 2)
+	{
+		thread_counts.push_back(num_threads);
+	}
+	thread_counts.push_back(max_threads);
+	return thread_counts;
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+	po::parser parser;
+	SCorpusOptions corpus_options{};
+	SProgramOptions program_options{};
+
+	std::string work_folder = (fs::temp_directory_path() / "ImageResizerBenchmark").string();
+	parser["folder"]
+	    .description("(Default = \"ImageResizerBenchmark\" in the temporary folder)\n"
+	                 "Where the corpus is generated and the outputs are written. "
+	                 "Its contents are deleted.")
+	    .bind(work_folder);
+
+	parser["images"]
+	    .description("(Default = 50)\nNumber of images in the corpus.")
+	    .bind(corpus_options.num_images);
+
+	parser["min-size"]
+	    .description("(Default = 256)\nSmallest longer side of the corpus images.")
+	    .bind(corpus_options.min_size);
+
+	parser["max-size"]
+	    .description("(Default = 4096)\nLargest longer side of the corpus images, sizes in "
+	                 "between are picked log-uniformly.")
+	    .bind(corpus_options.max_size);
+
+	parser["seed"]
+	    .description("(Default = 1)\nSeed of the corpus, the same seed gives the same corpus.")
+	    .bind(corpus_options.seed);
+
+	uint32_t target_width{256};
+	parser["target_width"]
+	    .abbreviation('W')
+	    .description("(Default = 256)\nTarget width.")
+	    .bind(target_width);
+
+	uint32_t target_height{256};
+	parser["target_height"]
+	    .abbreviation('H')
+	    .description("(Default = 256)\nTarget height.")
+	    .bind(target_height);
+
+	parser["keep-aspect-ratio"]
+	    .abbreviation('K')
+	    .description("(Default = off)\nKeep the aspect ratio and pad the outputs.")
+	    .callback([&program_options]() { program_options.keep_aspect_ratio = 1; });
+
+	uint32_t max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	parser["num_threads"]
+	    .abbreviation('T')
+	    .description("(Default = All available threads on CPU)\nLargest number of worker "
+	                 "threads, every power of two below it is measured as well.")
+	    .bind(max_threads);
+
+	std::string io_backend_str;
+	po::option& option_io_backend =
+	    parser["io-backend"]
+	        .description("(Default = same as ImageResizer)\n"
+	                     "\"stdio\", \"pread\", \"mmap\" or \"uring\".")
+	        .bind(io_backend_str);
+
+	std::string csv_path;
+	parser["csv"]
+	    .description("(Optional)\nAlso write the results to this CSV file, e.g. to compare "
+	                 "two builds.")
+	    .bind(csv_path);
+
+	po::option& help = parser["help"].abbreviation('?').description("Print this help screen");
+
+	if (!parser(argc, argv))
+		return -1;
+
+	if (help.was_set())
+	{
+		std::cout << parser << '\n';
+		return 0;
+	}
+
+	if (!corpus_options.num_images || !corpus_options.min_size ||
+	    corpus_options.min_size > corpus_options.max_size || !target_width || !target_height ||
+	    !max_threads)
+	{
+		std::cout << po::error() << "image count, sizes and thread count must be larger than "
+		          << "zero and min-size can't be larger than max-size.\n";
+		return -1;
+	}
+
+	if (option_io_backend.available())
+	{
+		if (!ParseIoBackend(io_backend_str, program_options.io_backend))
+		{
+			std::cout << po::error() << "\'" << po::blue << "io-backend";
+			std::cout << "\' must be one of \"stdio\", \"pread\", \"mmap\" or \"uring\".\n";
+			return -1;
+		}
+	}
+	program_options.io_backend = ResolveIoBackend(program_options.io_backend);
+
+	SOutputSpec output_spec;
+	output_spec.target_width = target_width;
+	output_spec.target_height = target_height;
+	program_options.outputs.push_back(output_spec);
+	program_options.number_of_input_entries = 1;
+	program_options.verbose = 0;
+
+	const fs::path work_path(work_folder);
+	corpus_options.folder = (work_path / "corpus").string();
+	const fs::path inplace_folder = work_path / "inplace";
+	const fs::path output_folder = work_path / "output";
+
+	std::cout << "Generating " << corpus_options.num_images << " images in "
+	          << corpus_options.folder << "...\n";
+	std::vector<std::string> corpus;
+	uint64_t corpus_bytes = 0;
+	if (!GenerateCorpus(corpus_options, corpus, corpus_bytes))
+	{
+		return -1;
+	}
+
+	std::cout << "Corpus: " << corpus.size() << " images, " << corpus_bytes / 1e6
+	          << " MB, seed " << corpus_options.seed << ". Outputs: " << target_width << "x"
+	          << target_height << ", I/O backend \"" << IoBackendName(program_options.io_backend)
+	          << "\", OpenCV " << CV_VERSION << ".\n\n";
+
+	PrintResultHeader(std::cout);
+
+	std::vector<SBenchmarkResult> results;
+	for (const SInterpolationMode& interpolation_mode : k_interpolation_modes)
+	{
+		program_options.interpolation = interpolation_mode.interpolation;
+
+		for (const SOutputFormatMode& output_format_mode : k_output_format_modes)
+		{
+			program_options.output_format = output_format_mode.output_format;
+			program_options.output_folder = output_folder.string();
+
+			for (uint32_t num_threads : ThreadCounts(max_threads))
+			{
+				// Start every run from the same state, this isn't timed
+				std::error_code ec;
+				fs::remove_all(output_folder, ec);
+				fs::create_directories(output_folder, ec);
+
+				std::vector<std::string> inputs = corpus;
+				if (program_options.output_format == EOutputFormat::INPLACE)
+				{
+					// Inplace overwrites its inputs, give it a fresh copy of the corpus
+					fs::remove_all(inplace_folder, ec);
+					fs::create_directories(inplace_folder, ec);
+					for (std::string& input : inputs)
+					{
+						const fs::path copy = inplace_folder / fs::path(input).filename();
+						fs::copy_file(input, copy, ec);
+						input = copy.string();
+					}
+				}
+
+				SBenchmarkResult result = RunBenchmark(inputs, program_options, num_threads);
+				result.interpolation = interpolation_mode.name;
+				result.output_format = output_format_mode.name;
+
+				PrintResult(std::cout, result);
+				results.push_back(result);
+			}
+		}
+	}
+
+	std::error_code ec;
+	fs::remove_all(inplace_folder, ec);
+	fs::remove_all(output_folder, ec);
+
+	if (!csv_path.empty())
+	{
+		std::ofstream csv(csv_path);
+		WriteCsv(csv, results);
+		if (!csv)
+		{
+			std::cout << "ERROR: cannot write \"" << csv_path << "\"\n";
+			return -1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,259 @@
+﻿#include "BufferPool.h"
+
+#include <algorithm>
+#include <atomic>
+
+namespace
+{
+// Beyond these, free buffers are released instead of kept around
+const size_t k_max_buffers_per_pool = 32;
+
+bool IsFree(const cv::Mat& mat)
+{
+	// The pool's own reference is the only one left. Other threads can only drop
+	// references at this point, never add them, so the answer can't go stale.
+	return mat.u && CV_XADD(&mat.u->refcount, 0) == 1;
+}
+
+bool IsFree(const ByteBufferPtr& buffer)
+{
+	return buffer.use_count() == 1;
+}
+
+uint64_t MatBytes(const cv::Mat& mat)
+{
+	return (uint64_t)mat.total() * mat.elemSize();
+}
+
+template <typename T>
+void MoveToBack(std::vector<T>& items, typename std::vector<T>::iterator it)
+{
+	std::rotate(it, it + 1, items.end());
+}
+} // namespace
+
+CBufferPoolSet::CBufferPoolSet(uint64_t max_reserved_bytes_per_pool)
+    : m_max_reserved_bytes_per_pool(max_reserved_bytes_per_pool)
+{
+}
+
+CBufferPoolSet::~CBufferPoolSet()
+{
+	// Buffers still held by someone stay alive on their own references
+	m_pools.clear();
+}
+
+CBufferPool& CBufferPoolSet::Local()
+{
+	// Pools of the calling thread by set. The pools of a set that is gone have expired, so a
+	// new set at the same address doesn't pick them up, and they are dropped whenever a pool
+	// is added.
+	using LocalPool = std::pair<const CBufferPoolSet*, std::weak_ptr<CBufferPool>>;
+	thread_local std::vector<LocalPool> local_pools;
+	for (const LocalPool& local_pool : local_pools)
+	{
+		if (local_pool.first == this)
+		{
+			if (std::shared_ptr<CBufferPool> pool = local_pool.second.lock())
+			{
+				// The set keeps it alive from here on
+				return *pool;
+			}
+		}
+	}
+
+	local_pools.erase(std::remove_if(local_pools.begin(), local_pools.end(),
+	                                 [](const LocalPool& entry) { return entry.second.expired(); }),
+	                  local_pools.end());
+
+	std::shared_ptr<CBufferPool> pool = std::make_shared<CBufferPool>(*this);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_pools.push_back(pool);
+	}
+	local_pools.emplace_back(this, pool);
+	return *pool;
+}
+
+SBufferPoolStats CBufferPoolSet::Stats() const
+{
+	SBufferPoolStats stats;
+	stats.hits = m_hits;
+	stats.misses = m_misses;
+	stats.reserved_bytes = m_reserved_bytes;
+	stats.peak_reserved_bytes = m_peak_reserved_bytes;
+	return stats;
+}
+
+cv::Mat AcquirePooledMat(CBufferPoolSet* buffer_pools, int rows, int cols, int type)
+{
+	return buffer_pools ? buffer_pools->Local().AcquireMat(rows, cols, type)
+	                    : cv::Mat(rows, cols, type);
+}
+
+ByteBufferPtr AcquirePooledBytes(CBufferPoolSet* buffer_pools, size_t expected_size)
+{
+	if (buffer_pools)
+	{
+		return buffer_pools->Local().AcquireBytes(expected_size);
+	}
+
+	ByteBufferPtr buffer = std::make_shared<ByteBuffer>();
+	buffer->reserve(expected_size);
+	return buffer;
+}
+
+CBufferPool::CBufferPool(CBufferPoolSet& pool_set) : m_pool_set(pool_set)
+{
+}
+
+CBufferPool::~CBufferPool()
+{
+	m_pool_set.m_reserved_bytes -= m_reserved_bytes;
+}
+
+cv::Mat CBufferPool::AcquireMat(int rows, int cols, int type)
+{
+	for (std::vector<cv::Mat>::iterator it = m_mats.begin(); it != m_mats.end(); ++it)
+	{
+		if (it->rows == rows && it->cols == cols && it->type() == type && IsFree(*it))
+		{
+			m_pool_set.m_hits.fetch_add(1, std::memory_order_relaxed);
+			MoveToBack(m_mats, it);
+			return m_mats.back();
+		}
+	}
+
+	m_pool_set.m_misses.fetch_add(1, std::memory_order_relaxed);
+	m_mats.emplace_back(rows, cols, type);
+	cv::Mat mat = m_mats.back();
+
+	Trim();
+	UpdateReservedBytes();
+	return mat;
+}
+
+ByteBufferPtr CBufferPool::AcquireBytes(size_t expected_size)
+{
+	// Free buffer with the smallest capacity that still fits, or the largest one otherwise
+	std::vector<ByteBufferPtr>::iterator best = m_byte_buffers.end();
+	for (std::vector<ByteBufferPtr>::iterator it = m_byte_buffers.begin();
+	     it != m_byte_buffers.end(); ++it)
+	{
+		if (!IsFree(*it))
+		{
+			continue;
+		}
+
+		if (best == m_byte_buffers.end())
+		{
+			best = it;
+			continue;
+		}
+
+		const size_t capacity = (*it)->capacity();
+		const size_t best_capacity = (*best)->capacity();
+		const bool fits = capacity >= expected_size;
+		const bool best_fits = best_capacity >= expected_size;
+		if ((fits && (!best_fits || capacity < best_capacity)) ||
+		    (!fits && !best_fits && capacity > best_capacity))
+		{
+			best = it;
+		}
+	}
+
+	if (best != m_byte_buffers.end() && (*best)->capacity() >= expected_size)
+	{
+		m_pool_set.m_hits.fetch_add(1, std::memory_order_relaxed);
+		MoveToBack(m_byte_buffers, best);
+	}
+	else
+	{
+		m_pool_set.m_misses.fetch_add(1, std::memory_order_relaxed);
+		if (best != m_byte_buffers.end())
+		{
+			// Grow a free buffer rather than adding another one
+			MoveToBack(m_byte_buffers, best);
+		}
+		else
+		{
+			m_byte_buffers.push_back(std::make_shared<ByteBuffer>());
+		}
+		m_byte_buffers.back()->reserve(expected_size);
+	}
+
+	ByteBufferPtr buffer = m_byte_buffers.back();
+	buffer->clear();
+
+	Trim();
+	UpdateReservedBytes();
+	return buffer;
+}
+
+uint64_t CBufferPool::CountReservedBytes() const
+{
+	// Byte buffers grow while they're in use, so the total is recounted instead of tracked
+	uint64_t reserved_bytes = 0;
+	for (const cv::Mat& mat : m_mats)
+	{
+		reserved_bytes += MatBytes(mat);
+	}
+	for (const ByteBufferPtr& buffer : m_byte_buffers)
+	{
+		reserved_bytes += buffer->capacity();
+	}
+	return reserved_bytes;
+}
+
+void CBufferPool::Trim()
+{
+	uint64_t reserved_bytes = CountReservedBytes();
+	const uint64_t max_reserved_bytes = m_pool_set.m_max_reserved_bytes_per_pool;
+	const auto over_limit = [this, &reserved_bytes, max_reserved_bytes]() {
+		return m_mats.size() + m_byte_buffers.size() > k_max_buffers_per_pool ||
+		       reserved_bytes > max_reserved_bytes;
+	};
+
+	for (std::vector<cv::Mat>::iterator it = m_mats.begin(); it != m_mats.end() && over_limit();)
+	{
+		if (IsFree(*it))
+		{
+			reserved_bytes -= MatBytes(*it);
+			it = m_mats.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	for (std::vector<ByteBufferPtr>::iterator it = m_byte_buffers.begin();
+	     it != m_byte_buffers.end() && over_limit();)
+	{
+		if (IsFree(*it))
+		{
+			reserved_bytes -= (*it)->capacity();
+			it = m_byte_buffers.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+void CBufferPool::UpdateReservedBytes()
+{
+	const uint64_t reserved_bytes = CountReservedBytes();
+	const uint64_t total_reserved_bytes =
+	    (m_pool_set.m_reserved_bytes += reserved_bytes - m_reserved_bytes);
+	m_reserved_bytes = reserved_bytes;
+
+	std::atomic<uint64_t>& peak_reserved_bytes = m_pool_set.m_peak_reserved_bytes;
+	uint64_t peak = peak_reserved_bytes.load(std::memory_order_relaxed);
+	while (total_reserved_bytes > peak &&
+	       !peak_reserved_bytes.compare_exchange_weak(peak, total_reserved_bytes,
+	                                                  std::memory_order_relaxed))
+	{
+	}
+}
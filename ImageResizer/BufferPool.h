@@ -0,0 +1,104 @@
+﻿// BufferPool.h : Per-thread reuse of pixel and byte buffers.
+
+#pragma once
+
+#include "ImageResizerTypes.h"
+
+#include <atomic>
+#include <mutex>
+
+class CBufferPoolSet;
+
+struct SBufferPoolStats
+{
+	uint64_t hits{0};
+	uint64_t misses{0};
+	// Bytes held by all the pools right now, and the most they ever held at once
+	uint64_t reserved_bytes{0};
+	uint64_t peak_reserved_bytes{0};
+};
+
+// Keeps the buffers a worker allocates around for the next image, so in steady state
+// processing doesn't allocate pixel memory at all. Every pool belongs to a CBufferPoolSet,
+// which holds the limit and the stats of all of its threads' pools.
+//
+// Buffers are never returned explicitly: the pool holds one reference to each buffer and
+// hands out shared references, a buffer is free again once the pool's reference is the
+// only one left. Jobs can therefore carry pooled buffers to other threads, and a buffer
+// goes back to the pool it came from when the last of them is done with it.
+class CBufferPool
+{
+public:
+	explicit CBufferPool(CBufferPoolSet& pool_set);
+	~CBufferPool();
+
+	CBufferPool(const CBufferPool&) = delete;
+	CBufferPool& operator=(const CBufferPool&) = delete;
+
+	// A rows x cols matrix of the given type, contents are undefined
+	cv::Mat AcquireMat(int rows, int cols, int type);
+
+	// An empty byte buffer, preferably with at least expected_size bytes of capacity
+	ByteBufferPtr AcquireBytes(size_t expected_size);
+
+private:
+	// Drops free buffers, least recently used first, until the pool is within its limits
+	void Trim();
+	uint64_t CountReservedBytes() const;
+	// Publishes this pool's size to the totals of its set
+	void UpdateReservedBytes();
+
+	CBufferPoolSet& m_pool_set;
+	// Least recently used first
+	std::vector<cv::Mat> m_mats;
+	std::vector<ByteBufferPtr> m_byte_buffers;
+	uint64_t m_reserved_bytes{0};
+};
+
+// The buffer pools of one user of the library, e.g. one run of the command line tool: a
+// CBufferPool for each thread that works for it, all with the same limit. Sets are
+// independent of each other, so several users in one process don't share limits or stats.
+// Handed to the library through SResizeOptions::buffer_pools.
+class CBufferPoolSet
+{
+public:
+	static constexpr uint64_t k_default_max_reserved_bytes_per_pool = 512ull << 20;
+
+	// Each pool keeps at most max_reserved_bytes_per_pool bytes. Only free buffers are
+	// released to stay within it, so this bounds the memory the pools hold on to outside of
+	// any job.
+	explicit CBufferPoolSet(
+	    uint64_t max_reserved_bytes_per_pool = k_default_max_reserved_bytes_per_pool);
+	~CBufferPoolSet();
+
+	CBufferPoolSet(const CBufferPoolSet&) = delete;
+	CBufferPoolSet& operator=(const CBufferPoolSet&) = delete;
+
+	// Pool of the calling thread, created on its first call. The set has to outlive every
+	// use of the pools.
+	CBufferPool& Local();
+
+	// Totals over the pools of all threads
+	SBufferPoolStats Stats() const;
+
+	uint64_t MaxReservedBytesPerPool() const { return m_max_reserved_bytes_per_pool; }
+
+private:
+	friend class CBufferPool;
+
+	const uint64_t m_max_reserved_bytes_per_pool;
+
+	std::atomic<uint64_t> m_hits{0};
+	std::atomic<uint64_t> m_misses{0};
+	std::atomic<uint64_t> m_reserved_bytes{0};
+	std::atomic<uint64_t> m_peak_reserved_bytes{0};
+
+	// Owns the pools, the threads only keep weak references to theirs
+	std::mutex m_mutex;
+	std::vector<std::shared_ptr<CBufferPool>> m_pools;
+};
+
+// A buffer from the calling thread's pool in buffer_pools, or a newly allocated one if
+// buffer_pools is null
+cv::Mat AcquirePooledMat(CBufferPoolSet* buffer_pools, int rows, int cols, int type);
+ByteBufferPtr AcquirePooledBytes(CBufferPoolSet* buffer_pools, size_t expected_size);
@@ -0,0 +1,84 @@
+﻿#include "Dedup.h"
+
+CDedupIndex::CDedupIndex(ECloneMethod clone_method) : m_clone_method(clone_method)
+{
+}
+
+EDedupClaim CDedupIndex::Claim(uint64_t hash, uint64_t size,
+                              std::shared_ptr<const SDedupResult>& result, WaiterFn waiter)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::pair<std::unordered_map<Key, SEntry, SKeyHash>::iterator, bool> inserted =
+	    m_entries.try_emplace(Key(hash, size));
+	if (inserted.second)
+	{
+		m_stats.num_unique++;
+		return EDedupClaim::FIRST;
+	}
+
+	SEntry& entry = inserted.first->second;
+	if (entry.result)
+	{
+		result = entry.result;
+		return EDedupClaim::PUBLISHED;
+	}
+
+	entry.waiters.push_back(std::move(waiter));
+	return EDedupClaim::WAITING;
+}
+
+void CDedupIndex::Publish(uint64_t hash, uint64_t size, std::shared_ptr<const SDedupResult> result)
+{
+	std::vector<WaiterFn> waiters;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		std::unordered_map<Key, SEntry, SKeyHash>::iterator it = m_entries.find(Key(hash, size));
+		if (it == m_entries.end())
+		{
+			return;
+		}
+		it->second.result = result;
+		waiters.swap(it->second.waiters);
+	}
+
+	// Later duplicates see the result in Claim, no new waiters can come
+	for (const WaiterFn& waiter : waiters)
+	{
+		waiter(result);
+	}
+}
+
+bool CDedupIndex::CloneOutput(const std::string& source, const std::string& destination)
+{
+	const ECloneMethod clone_method = CloneFile(source, destination, m_clone_method);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	switch (clone_method)
+	{
+	case ECloneMethod::HARDLINK:
+		m_stats.num_hardlinked++;
+		return true;
+	case ECloneMethod::REFLINK:
+		m_stats.num_reflinked++;
+		return true;
+	case ECloneMethod::COPY:
+		m_stats.num_copied++;
+		return true;
+	default:
+		return false;
+	}
+}
+
+void CDedupIndex::RecordDuplicate(uint64_t input_bytes, double seconds_saved)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_stats.num_duplicates++;
+	m_stats.bytes_saved += input_bytes;
+	m_stats.seconds_saved += seconds_saved;
+}
+
+SDedupStats CDedupIndex::Stats() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_stats;
+}
@@ -0,0 +1,99 @@
+﻿// Dedup.h : Processes byte-identical inputs only once (--dedup).
+
+#pragma once
+
+#include "ImageResizer.h"
+#include "FileIO.h"
+
+#include <functional>
+#include <mutex>
+
+// Outcome of the first job with a given content, shared with its duplicates
+struct SDedupResult
+{
+	bool success{false};
+	// Result of the first job, duplicates that waited for it fail the same way
+	SReturnStatus status{};
+	std::string input_path;
+	// One for each SProgramOptions::outputs
+	std::vector<std::string> output_paths;
+	std::vector<cv::Size> output_sizes;
+	// Time the first job spent in the stages, i.e. what each duplicate saves
+	double processing_seconds{0.0};
+};
+
+struct SDedupStats
+{
+	uint64_t num_unique{0};
+	uint64_t num_duplicates{0};
+	uint64_t bytes_saved{0};
+	double seconds_saved{0.0};
+	uint64_t num_hardlinked{0};
+	uint64_t num_reflinked{0};
+	uint64_t num_copied{0};
+};
+
+enum class EDedupClaim
+{
+	// Nobody had the content yet, the caller has to Publish its result eventually
+	FIRST,
+	// The first job is done, its result is returned
+	PUBLISHED,
+	// The first job is still going, the waiter was kept and runs once it publishes
+	WAITING
+};
+
+// Index of the input contents seen so far, keyed by HashBytes and size of the encoded file.
+// The hash also covers the output formats, so only outputs of the same format are shared.
+//
+// The first job with some content claims it and is processed as usual, and publishes its
+// outputs when it's done. Later jobs with the same content clone the first job's outputs
+// instead of decoding, resizing and encoding again. Those that come while the first job is
+// still going leave a waiter behind instead of blocking their worker, and are completed by
+// whoever publishes.
+class CDedupIndex
+{
+public:
+	using WaiterFn = std::function<void(const std::shared_ptr<const SDedupResult>&)>;
+
+	explicit CDedupIndex(ECloneMethod clone_method);
+
+	CDedupIndex(const CDedupIndex&) = delete;
+	CDedupIndex& operator=(const CDedupIndex&) = delete;
+
+	// result receives the first job's result if the claim is PUBLISHED. waiter is only
+	// kept, and called from Publish, if it is WAITING.
+	EDedupClaim Claim(uint64_t hash, uint64_t size, std::shared_ptr<const SDedupResult>& result,
+	                  WaiterFn waiter);
+	// Stores the result and runs the waiters of the content on the calling thread
+	void Publish(uint64_t hash, uint64_t size, std::shared_ptr<const SDedupResult> result);
+
+	// Gives destination the contents of one of the first job's outputs
+	bool CloneOutput(const std::string& source, const std::string& destination);
+	// A duplicate that was completed by cloning
+	void RecordDuplicate(uint64_t input_bytes, double seconds_saved);
+
+	SDedupStats Stats() const;
+
+private:
+	using Key = std::pair<uint64_t, uint64_t>;
+
+	struct SKeyHash
+	{
+		// The content hash is already well mixed
+		size_t operator()(const Key& key) const { return (size_t)(key.first ^ key.second); }
+	};
+
+	struct SEntry
+	{
+		// Null until the first job publishes
+		std::shared_ptr<const SDedupResult> result;
+		std::vector<WaiterFn> waiters;
+	};
+
+	const ECloneMethod m_clone_method;
+
+	mutable std::mutex m_mutex;
+	std::unordered_map<Key, SEntry, SKeyHash> m_entries;
+	SDedupStats m_stats;
+};
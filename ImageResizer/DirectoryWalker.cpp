@@ -0,0 +1,116 @@
+﻿#include "DirectoryWalker.h"
+
+#include <thread>
+
+CDirectoryWalker::CDirectoryWalker(uint32_t num_threads, bool recursive, FileCallback on_file,
+                                   ErrorCallback on_error)
+    : m_num_threads(num_threads > 0 ? num_threads : 1), m_recursive(recursive),
+      m_on_file(std::move(on_file)), m_on_error(std::move(on_error))
+{
+}
+
+void CDirectoryWalker::Walk(const std::vector<fs::path>& folders)
+{
+	if (folders.empty())
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (size_t root = 0; root < folders.size(); ++root)
+		{
+			m_folder_queue.push_back({folders[root], root});
+		}
+		m_pending_folders += (uint32_t)folders.size();
+	}
+
+	std::vector<std::thread> threads;
+	for (uint32_t i = 1; i < m_num_threads; ++i)
+	{
+		threads.emplace_back([this]() { WalkerThread(); });
+	}
+
+	WalkerThread();
+
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+}
+
+void CDirectoryWalker::WalkerThread()
+{
+	while (true)
+	{
+		SQueuedFolder folder;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cv.wait(lock, [this]() { return !m_folder_queue.empty() || !m_pending_folders; });
+
+			if (m_folder_queue.empty())
+			{
+				// Nothing queued and nothing being scanned, so no more folders can show up
+				return;
+			}
+
+			folder = std::move(m_folder_queue.front());
+			m_folder_queue.pop_front();
+		}
+
+		ScanFolder(folder);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (--m_pending_folders == 0)
+		{
+			m_cv.notify_all();
+		}
+	}
+}
+
+void CDirectoryWalker::ScanFolder(const SQueuedFolder& folder)
+{
+	std::error_code ec;
+	fs::directory_iterator it(folder.path, ec);
+	if (ec)
+	{
+		m_on_error(folder.path);
+		return;
+	}
+
+	std::vector<SQueuedFolder> sub_folders;
+
+	for (; it != fs::directory_iterator(); it.increment(ec))
+	{
+		const fs::directory_entry& entry = *it;
+
+		// Both only stat if the listing didn't provide the type (or for symlinks)
+		std::error_code type_ec;
+		if (entry.is_regular_file(type_ec))
+		{
+			m_on_file(entry, folder.root);
+		}
+		else if (m_recursive && entry.is_directory(type_ec))
+		{
+			sub_folders.push_back({entry.path(), folder.root});
+		}
+	}
+
+	if (ec)
+	{
+		// Listing failed part way through, keep whatever was found until then
+		m_on_error(folder.path);
+	}
+
+	if (!sub_folders.empty())
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_folder_queue.insert(m_folder_queue.end(),
+			                      std::make_move_iterator(sub_folders.begin()),
+			                      std::make_move_iterator(sub_folders.end()));
+			m_pending_folders += (uint32_t)sub_folders.size();
+		}
+		m_cv.notify_all();
+	}
+}
@@ -0,0 +1,51 @@
+﻿// DirectoryWalker.h : Parallel, streaming traversal of the input folders.
+
+#pragma once
+
+#include "ImageResizer.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+// Scans folders on several threads and hands every regular file to a callback as soon
+// as it's found, so processing can start while the rest of the tree is still being listed.
+// File types come from the cached directory_entry type, which on most platforms is filled
+// in by the directory listing itself and doesn't cost an extra stat per entry.
+class CDirectoryWalker
+{
+public:
+	// Called concurrently from the walker threads, must be thread-safe. root is the index of
+	// the folder given to Walk that the file was found in.
+	using FileCallback = std::function<void(const fs::directory_entry&, size_t root)>;
+	using ErrorCallback = std::function<void(const fs::path&)>;
+
+	CDirectoryWalker(uint32_t num_threads, bool recursive, FileCallback on_file,
+	                 ErrorCallback on_error);
+
+	// Walks the given folders and returns once every file has been handed to on_file.
+	// The calling thread takes part in the walk, so num_threads == 1 spawns no threads.
+	void Walk(const std::vector<fs::path>& folders);
+
+private:
+	struct SQueuedFolder
+	{
+		fs::path path;
+		size_t root{0};
+	};
+
+	void WalkerThread();
+	void ScanFolder(const SQueuedFolder& folder);
+
+	const uint32_t m_num_threads;
+	const bool m_recursive;
+	FileCallback m_on_file;
+	ErrorCallback m_on_error;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	std::deque<SQueuedFolder> m_folder_queue;
+	// Folders that are either queued or being scanned, the walk is over when it hits 0
+	uint32_t m_pending_folders{0};
+};
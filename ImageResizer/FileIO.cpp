@@ -0,0 +1,623 @@
+﻿#include "FileIO.h"
+#include "BufferPool.h"
+
+#include <algorithm>
+#include <fstream>
+
+#if IMAGERESIZER_HAVE_POSIX_IO
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if IMAGERESIZER_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+// macOS has no posix_fadvise, the page cache is left alone there
+#if IMAGERESIZER_HAVE_POSIX_IO && defined(POSIX_FADV_DONTNEED)
+#define IMAGERESIZER_HAVE_FADVISE 1
+#endif
+
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+namespace
+{
+bool ReadInputFileStdio(const std::string& path, CBufferPoolSet* buffer_pools,
+                        SFileData& file_data)
+{
+	std::ifstream stream(path, std::ios::binary | std::ios::ate);
+	const std::streamsize file_size = stream.tellg();
+	if (!stream || file_size <= 0)
+	{
+		return false;
+	}
+
+	ByteBufferPtr buffer = AcquirePooledBytes(buffer_pools, (size_t)file_size);
+	buffer->resize((size_t)file_size);
+	stream.seekg(0);
+	if (!stream.read((char*)buffer->data(), file_size))
+	{
+		return false;
+	}
+
+	file_data.data = buffer->data();
+	file_data.size = buffer->size();
+	file_data.owner = std::move(buffer);
+	return true;
+}
+
+bool WriteOutputFileStdio(const std::string& path, const ByteBuffer& bytes)
+{
+	std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+	stream.write((const char*)bytes.data(), (std::streamsize)bytes.size());
+	stream.close();
+	return (bool)stream;
+}
+
+#if IMAGERESIZER_HAVE_LIBURING
+// Transfers are split into requests of this size, and this many of them are kept in flight
+constexpr size_t k_ring_chunk_bytes = 1 << 20;
+constexpr unsigned k_ring_depth = 32;
+
+// One ring per thread, so submissions never need to be synchronized. A ring that failed is
+// retired, the thread goes on with pread() and pwrite() after that.
+struct SThreadRing
+{
+	io_uring ring{};
+	int init_result{io_uring_queue_init(k_ring_depth, &ring, 0)};
+
+	~SThreadRing() { Retire(); }
+
+	void Retire()
+	{
+		if (init_result == 0)
+		{
+			io_uring_queue_exit(&ring);
+			init_result = -1;
+		}
+	}
+};
+
+SThreadRing& ThreadRing()
+{
+	thread_local SThreadRing ring;
+	return ring;
+}
+
+io_uring* ThreadLocalRing()
+{
+	SThreadRing& ring = ThreadRing();
+	return ring.init_result == 0 ? &ring.ring : nullptr;
+}
+
+// Waits for the completions of num_requests requests the kernel already has, so none of them
+// can still touch their buffers afterwards. Stops early if the ring can't be waited on at all.
+void DrainRing(io_uring* ring, unsigned num_requests)
+{
+	while (num_requests)
+	{
+		io_uring_cqe* cqe = nullptr;
+		const int wait_result = io_uring_wait_cqe(ring, &cqe);
+		if (wait_result == -EINTR)
+		{
+			continue;
+		}
+		if (wait_result < 0)
+		{
+			return;
+		}
+		io_uring_cqe_seen(ring, cqe);
+		num_requests--;
+	}
+}
+
+// Moves all size bytes as chunks that are read or written concurrently, so that network
+// filesystems and disks with deep queues work on several of them at once instead of one
+// request at a time. Short transfers are resubmitted for the rest of their chunk. Sets
+// ring_failed if the ring itself stopped working, rather than one of the transfers.
+bool RingTransferAll(io_uring* ring, bool write, int fd, unsigned char* bytes, size_t size,
+                     bool& ring_failed)
+{
+	struct SRequest
+	{
+		size_t offset;
+		size_t length;
+	};
+
+	SRequest requests[k_ring_depth];
+	size_t next_offset = 0;
+	unsigned in_flight = 0;
+	bool failed = false;
+
+	const auto prepare = [&](unsigned slot) {
+		io_uring_sqe* sqe = io_uring_get_sqe(ring);
+		const SRequest& request = requests[slot];
+		if (write)
+		{
+			io_uring_prep_write(sqe, fd, bytes + request.offset, (unsigned)request.length,
+			                    request.offset);
+		}
+		else
+		{
+			io_uring_prep_read(sqe, fd, bytes + request.offset, (unsigned)request.length,
+			                   request.offset);
+		}
+		io_uring_sqe_set_data(sqe, (void*)(uintptr_t)slot);
+	};
+
+	// Fills a free slot with the next chunk, returns false once all of them were submitted
+	const auto prepare_next_chunk = [&](unsigned slot) {
+		if (failed || next_offset >= size)
+		{
+			return false;
+		}
+		requests[slot] = {next_offset, std::min(size - next_offset, k_ring_chunk_bytes)};
+		next_offset += requests[slot].length;
+		prepare(slot);
+		in_flight++;
+		return true;
+	};
+
+	for (unsigned slot = 0; slot < k_ring_depth; ++slot)
+	{
+		if (!prepare_next_chunk(slot))
+		{
+			break;
+		}
+	}
+
+	// The buffer must outlive every submitted request, so even after an error all of them
+	// are waited for
+	while (in_flight)
+	{
+		io_uring_cqe* cqe = nullptr;
+		int wait_result;
+		do
+		{
+			wait_result = io_uring_submit_and_wait(ring, 1);
+		} while (wait_result == -EINTR);
+		if (wait_result >= 0)
+		{
+			wait_result = io_uring_peek_cqe(ring, &cqe);
+		}
+		if (wait_result < 0)
+		{
+			// E.g. the submission failed. Requests that never left the submission queue are
+			// dropped with the ring, those the kernel has are waited for, then the caller
+			// retires the ring.
+			errno = -wait_result;
+			ring_failed = true;
+			DrainRing(ring, in_flight - io_uring_sq_ready(ring));
+			return false;
+		}
+
+		const unsigned slot = (unsigned)(uintptr_t)io_uring_cqe_get_data(cqe);
+		const int result = cqe->res;
+		io_uring_cqe_seen(ring, cqe);
+		in_flight--;
+
+		SRequest& request = requests[slot];
+		if (result == -EINTR || result == -EAGAIN)
+		{
+			prepare(slot);
+			in_flight++;
+			continue;
+		}
+		if (result <= 0)
+		{
+			// 0 means the file ended before size bytes
+			errno = result < 0 ? -result : EIO;
+			failed = true;
+			continue;
+		}
+
+		request.offset += (size_t)result;
+		request.length -= (size_t)result;
+		if (request.length && !failed)
+		{
+			prepare(slot);
+			in_flight++;
+		}
+		else
+		{
+			prepare_next_chunk(slot);
+		}
+	}
+
+	return !failed;
+}
+#endif
+
+bool ReflinkFile(const std::string& source, const std::string& destination)
+{
+#if defined(__linux__) && defined(FICLONE)
+	const int source_fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+	if (source_fd < 0)
+	{
+		return false;
+	}
+
+	const int destination_fd =
+	    open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (destination_fd < 0)
+	{
+		close(source_fd);
+		return false;
+	}
+
+	const bool clone_success = ioctl(destination_fd, FICLONE, source_fd) == 0;
+	close(source_fd);
+	const bool close_success = close(destination_fd) == 0;
+
+	if (!clone_success)
+	{
+		// Don't leave an empty file behind for the copy to trip over
+		unlink(destination.c_str());
+	}
+	return clone_success && close_success;
+#else
+	(void)source;
+	(void)destination;
+	return false;
+#endif
+}
+
+// Copies in the kernel, or on the server for network filesystems that support it, without
+// the bytes ever passing through this process
+bool CopyFileRange(const std::string& source, const std::string& destination)
+{
+#if defined(__linux__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+	const int source_fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+	if (source_fd < 0)
+	{
+		return false;
+	}
+
+	struct stat source_stat;
+	if (fstat(source_fd, &source_stat) != 0)
+	{
+		close(source_fd);
+		return false;
+	}
+
+	const int destination_fd =
+	    open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (destination_fd < 0)
+	{
+		close(source_fd);
+		return false;
+	}
+
+	off_t remaining = source_stat.st_size;
+	bool copy_success = true;
+	while (remaining > 0)
+	{
+		const ssize_t result = copy_file_range(source_fd, nullptr, destination_fd, nullptr,
+		                                       (size_t)std::min<off_t>(remaining, 1 << 30), 0);
+		if (result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (result <= 0)
+		{
+			copy_success = false;
+			break;
+		}
+		remaining -= result;
+	}
+
+	close(source_fd);
+	const bool close_success = close(destination_fd) == 0;
+
+	if (!copy_success)
+	{
+		// E.g. EXDEV on older kernels, the fallback copy starts over
+		unlink(destination.c_str());
+	}
+	return copy_success && close_success;
+#else
+	(void)source;
+	(void)destination;
+	return false;
+#endif
+}
+
+#if IMAGERESIZER_HAVE_POSIX_IO
+// Moves all size bytes, retrying short transfers and interrupted calls
+bool TransferAll(bool write, EIoBackend io_backend, int fd, unsigned char* bytes, size_t size)
+{
+#if IMAGERESIZER_HAVE_LIBURING
+	io_uring* ring = io_backend == EIoBackend::IO_URING ? ThreadLocalRing() : nullptr;
+	if (ring)
+	{
+		bool ring_failed = false;
+		const bool transfer_success = RingTransferAll(ring, write, fd, bytes, size, ring_failed);
+		if (!ring_failed)
+		{
+			return transfer_success;
+		}
+
+		// The transfer starts over below, this thread doesn't use io_uring anymore
+		ThreadRing().Retire();
+	}
+#else
+	(void)io_backend;
+#endif
+
+	size_t done = 0;
+	while (done < size)
+	{
+		// Keep single requests below 1 GiB, some kernels cap them around 2 GiB
+		const size_t request = std::min<size_t>(size - done, 1u << 30);
+		const ssize_t result = write ? pwrite(fd, bytes + done, request, (off_t)done)
+		                             : pread(fd, bytes + done, request, (off_t)done);
+
+		if (result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (result <= 0)
+		{
+			return false;
+		}
+		done += (size_t)result;
+	}
+	return true;
+}
+
+// Closes fd, dropping the file's pages from the page cache first if asked to
+void CloseInput(int fd, bool drop_cache)
+{
+#if IMAGERESIZER_HAVE_FADVISE
+	if (drop_cache)
+	{
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+#else
+	(void)drop_cache;
+#endif
+	close(fd);
+}
+
+bool ReadInputFilePosix(const std::string& path, EIoBackend io_backend,
+                        CBufferPoolSet* buffer_pools, bool drop_cache, SFileData& file_data)
+{
+	const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || file_stat.st_size <= 0)
+	{
+		close(fd);
+		return false;
+	}
+	const size_t file_size = (size_t)file_stat.st_size;
+
+	if (io_backend == EIoBackend::MMAP)
+	{
+		void* mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (mapping != MAP_FAILED)
+		{
+			// Mapped pages can't be dropped, so the descriptor stays open until the mapping
+			// is released if the pages are dropped then
+			if (!drop_cache)
+			{
+				close(fd);
+			}
+
+			// The decoder goes through the file front to back exactly once
+			madvise(mapping, file_size, MADV_SEQUENTIAL);
+			madvise(mapping, file_size, MADV_WILLNEED);
+
+			file_data.data = (const unsigned char*)mapping;
+			file_data.size = file_size;
+			file_data.owner = std::shared_ptr<const void>(
+			    mapping, [file_size, fd, drop_cache](const void* ptr) {
+				    munmap((void*)ptr, file_size);
+				    if (drop_cache)
+				    {
+					    CloseInput(fd, true);
+				    }
+			    });
+			return true;
+		}
+		// Some filesystems can't be mapped, read those instead
+	}
+
+	ByteBufferPtr buffer = AcquirePooledBytes(buffer_pools, file_size);
+	buffer->resize(file_size);
+	const bool read_success = TransferAll(false, io_backend, fd, buffer->data(), file_size);
+	CloseInput(fd, drop_cache);
+
+	if (!read_success)
+	{
+		return false;
+	}
+
+	file_data.data = buffer->data();
+	file_data.size = buffer->size();
+	file_data.owner = std::move(buffer);
+	return true;
+}
+
+bool WriteOutputFilePosix(const std::string& path, const ByteBuffer& bytes, EIoBackend io_backend)
+{
+	const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	const bool write_success =
+	    TransferAll(true, io_backend, fd, (unsigned char*)bytes.data(), bytes.size());
+
+	// Network filesystems may only report write errors on close
+	const bool close_success = close(fd) == 0;
+	return write_success && close_success;
+}
+#endif
+} // namespace
+
+bool ParseIoBackend(const std::string& str, EIoBackend& io_backend)
+{
+	for (EIoBackend candidate :
+	     {EIoBackend::STDIO, EIoBackend::PREAD, EIoBackend::MMAP, EIoBackend::IO_URING})
+	{
+		if (str == IoBackendName(candidate))
+		{
+			io_backend = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char* IoBackendName(EIoBackend io_backend)
+{
+	switch (io_backend)
+	{
+	case EIoBackend::STDIO:
+		return "stdio";
+	case EIoBackend::PREAD:
+		return "pread";
+	case EIoBackend::MMAP:
+		return "mmap";
+	case EIoBackend::IO_URING:
+		return "uring";
+	default:
+		return "unknown";
+	}
+}
+
+EIoBackend ResolveIoBackend(EIoBackend io_backend)
+{
+#if !IMAGERESIZER_HAVE_POSIX_IO
+	return EIoBackend::STDIO;
+#else
+	if (io_backend == EIoBackend::IO_URING)
+	{
+#if IMAGERESIZER_HAVE_LIBURING
+		// Kernels older than 5.1, or with io_uring disabled, fail to set up a ring
+		if (ThreadLocalRing())
+		{
+			return EIoBackend::IO_URING;
+		}
+#endif
+		return EIoBackend::PREAD;
+	}
+	return io_backend;
+#endif
+}
+
+bool ReadInputFile(const std::string& path, EIoBackend io_backend, CBufferPoolSet* buffer_pools,
+                   bool drop_cache, SFileData& file_data)
+{
+#if IMAGERESIZER_HAVE_POSIX_IO
+	if (io_backend != EIoBackend::STDIO)
+	{
+		return ReadInputFilePosix(path, io_backend, buffer_pools, drop_cache, file_data);
+	}
+#endif
+	return ReadInputFileStdio(path, buffer_pools, file_data);
+}
+
+bool SyncPath(const std::string& path)
+{
+#if IMAGERESIZER_HAVE_POSIX_IO
+	// Directories can only be opened for reading, fsync() works through any descriptor
+	const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	int result;
+	do
+	{
+		result = fsync(fd);
+	} while (result != 0 && errno == EINTR);
+	close(fd);
+	return result == 0;
+#else
+	(void)path;
+	return true;
+#endif
+}
+
+bool ParseCloneMethod(const std::string& str, ECloneMethod& clone_method)
+{
+	if (str == "hardlink")
+	{
+		clone_method = ECloneMethod::HARDLINK;
+	}
+	else if (str == "reflink")
+	{
+		clone_method = ECloneMethod::REFLINK;
+	}
+	else if (str == "copy")
+	{
+		clone_method = ECloneMethod::COPY;
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+ECloneMethod CloneFile(const std::string& source, const std::string& destination,
+                       ECloneMethod first_method)
+{
+	// Already the same file, e.g. linked by an earlier run. Removing it would lose the source.
+	std::error_code ec;
+	if (fs::equivalent(source, destination, ec))
+	{
+		return ECloneMethod::HARDLINK;
+	}
+
+	// Outputs are overwritten like regular writes do, a link can't replace an existing file
+	fs::remove(destination, ec);
+
+	if (first_method == ECloneMethod::HARDLINK)
+	{
+		fs::create_hard_link(source, destination, ec);
+		if (!ec)
+		{
+			return ECloneMethod::HARDLINK;
+		}
+	}
+
+	if (first_method <= ECloneMethod::REFLINK && ReflinkFile(source, destination))
+	{
+		return ECloneMethod::REFLINK;
+	}
+
+	if (CopyFileRange(source, destination) ||
+	    (fs::copy_file(source, destination, fs::copy_options::overwrite_existing, ec) && !ec))
+	{
+		return ECloneMethod::COPY;
+	}
+
+	return ECloneMethod::FAILED;
+}
+
+bool WriteOutputFile(const std::string& path, const ByteBuffer& bytes, EIoBackend io_backend)
+{
+#if IMAGERESIZER_HAVE_POSIX_IO
+	if (io_backend != EIoBackend::STDIO)
+	{
+		return WriteOutputFilePosix(path, bytes, io_backend);
+	}
+#endif
+	return WriteOutputFileStdio(path, bytes);
+}
@@ -0,0 +1,39 @@
+﻿// FileIO.h : Whole-file reads and writes with a selectable I/O backend.
+
+#pragma once
+
+#include "ImageResizer.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define IMAGERESIZER_HAVE_POSIX_IO 1
+#endif
+
+// Parses "stdio", "pread", "mmap" or "uring"
+bool ParseIoBackend(const std::string& str, EIoBackend& io_backend);
+const char* IoBackendName(EIoBackend io_backend);
+
+// Falls back to the closest available backend if io_backend isn't supported
+// by this build or the running kernel, returns the backend that will be used
+EIoBackend ResolveIoBackend(EIoBackend io_backend);
+
+// Loads the whole file. Mapped or read into a buffer of buffer_pools depending on the
+// backend, either way file_data.data points at all file_data.size bytes of the file. With
+// drop_cache the file's pages are dropped from the page cache once it has been read, or once
+// the mapping is released, through the descriptor the read already has (see --prefetch).
+bool ReadInputFile(const std::string& path, EIoBackend io_backend, CBufferPoolSet* buffer_pools,
+                   bool drop_cache, SFileData& file_data);
+
+// Writes bytes as the entire contents of path, in a single write where the backend allows
+bool WriteOutputFile(const std::string& path, const ByteBuffer& bytes, EIoBackend io_backend);
+
+// Waits until the contents of the file or directory at path are on the storage device, for a
+// directory that includes which names it holds. Always succeeds where there is no fsync().
+bool SyncPath(const std::string& path);
+
+// Parses "hardlink", "reflink" or "copy"
+bool ParseCloneMethod(const std::string& str, ECloneMethod& clone_method);
+
+// Replaces destination with the contents of source. Tries first_method, then each of the
+// methods after it in turn, returns the method that worked.
+ECloneMethod CloneFile(const std::string& source, const std::string& destination,
+                       ECloneMethod first_method);
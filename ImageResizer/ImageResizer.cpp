@@ -1,5 +1,20 @@
 ﻿#define _ALLOW_COMPILER_AND_STL_VERSION_MISMATCH 1
 #include "ImageResizer.h"
+#include "BufferPool.h"
+#include "Dedup.h"
+#include "DirectoryWalker.h"
+#include "FileIO.h"
+#include "ImageResizerLib.h"
+#include "Manifest.h"
+#include "OutputPlan.h"
+#include "MemoryBudget.h"
+#include "Pipeline.h"
+#include "RunStats.h"
+#include "Prefetcher.h"
+#include "StatusLog.h"
+#include "TarShards.h"
+#include "TensorOutput.h"
+#include "WorkStealingPool.h"
 
 #if defined(__clang__)
 #pragma clang diagnostic push
@@ -22,28 +37,11 @@
 #pragma warning(pop)
 #endif
 
-#if defined(__clang__)
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wunused-parameter"
-#elif defined(__GNUC__) || defined(__GNUG__)
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-#elif defined(_MSC_VER)
-#pragma warning(push)
-#pragma warning(disable : 4244)
-#pragma warning(disable : 4267)
-#pragma warning(disable : 4018)
-#endif
-#include <CThreadPool.hpp>
-#if defined(__clang__)
-#pragma clang diagnostic pop
-#elif defined(__GNUC__) || defined(__GNUG__)
-#pragma GCC diagnostic pop
-#elif defined(_MSC_VER)
-#pragma warning(pop)
-#endif
-
 #include <cassert>
+#include <cctype>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <vector>
 #include <regex>
@@ -51,8 +49,12 @@
 #include <string_view>
 #include <filesystem>
 #include <chrono>
+#include <functional>
 #include <future>
 #include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <sstream>
 
 #include <opencv2/core.hpp>
 #include <opencv2/core/base.hpp>
@@ -61,76 +63,8 @@
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 
-namespace fs = std::filesystem;
-
-enum class EFileType
-{
-	IMAGE_JPEG,
-	IMAGE_PNG,
-	OTHER
-};
-
-using ExtLookup = std::unordered_map<std::string, EFileType>;
-ExtLookup g_ext_lookup_table;
-
-enum class EOutputFormat
-{
-	// Inplace, replace the images with the resized images
-	INPLACE,
-
-	// Given arguments folder1 folder2...
-	// prefixes become:
-	// folderK_X for X in folderK
-	// folderK_subfolderM_X for X in subfolderM in folderK
-	// If only 1 folder is given that folder is not added as a prefix
-	// since it would be common for all images in the output directory
-	FLAT_WITH_PREFIXES,
-
-	// Given arguments folder1 folder2...
-	// Recreate each folder and their subfolders in the output directory
-	// and each image goes to their respective folder
-	// If only 1 folder is given all the images are simply put inside the output
-	// directory.
-	RECREATE_FOLDER_STRUCTURE
-};
-
-struct SProgramOptions
-{
-	uint32_t number_of_input_entries{0};
-	EOutputFormat output_format{EOutputFormat::INPLACE};
-	std::string output_folder{""}; // Relevant only if output_format is not INPLACE
-	uint32_t recursive{0};
-	uint32_t verbose{1}; // 0: no logs, 1: errors, 2: errors, warnings and info
-	// keep_aspect_ratio: If 1, then original aspect ratios are kept and
-	// images are fit into the target frame with a black background
-	uint32_t keep_aspect_ratio{0};
-	uint32_t target_width{0};
-	uint32_t target_height{0};
-	cv::InterpolationFlags interpolation{};
-	int32_t num_threads{0};
-};
-
-enum class EReturnCode
-{
-	OK,
-	FILE_UNKNOWN_EXTENSION,
-	FILE_READ_ERROR,
-	FILE_WRITE_ERROR,
-	UNKNOWN_ERROR,
-};
-
-struct SReturnStatus
-{
-	EReturnCode return_code{EReturnCode::UNKNOWN_ERROR};
-	union
-	{
-		char write_fail_dest[1024]{};
-		char file_ext[1024];
-	};
-};
-
-void LogReturnStatus(const std::string_view entry, SReturnStatus status, uint32_t verbose,
-                     std::ostream& stream = std::cout)
+void LogReturnStatus(const std::string_view entry, const SReturnStatus& status,
+                     uint32_t verbose, std::ostream& stream)
 {
 	if (!verbose)
 	{
@@ -148,18 +82,26 @@ void LogReturnStatus(const std::string_view entry, SReturnStatus status, uint32_
 	case EReturnCode::FILE_UNKNOWN_EXTENSION:
 		if (verbose > 1)
 		{
-			stream << "File extension: \"" << status.file_ext << "\" is unknown, skipping file: \""
+			stream << "File extension: \"" << status.detail << "\" is unknown, skipping file: \""
 			       << entry << "\"\n";
 		}
 		break;
+	case EReturnCode::FILE_UP_TO_DATE:
+		if (verbose > 1)
+		{
+			stream << "Up to date, skipping file: \"" << entry << "\"\n";
+		}
+		break;
 	case EReturnCode::FILE_READ_ERROR:
 		stream << "ERROR: cannot read the file: \"" << entry << "\"\n";
 		break;
+	case EReturnCode::FOLDER_READ_ERROR:
+		stream << "ERROR: cannot read the folder: \"" << entry << "\"\n";
+		break;
 	case EReturnCode::FILE_WRITE_ERROR:
-		stream << "ERROR: cannot write the output to: \"" << status.write_fail_dest
+		stream << "ERROR: cannot write the output to: \"" << status.detail
 		       << "\", skipping file: \"" << entry << "\"\n";
 		break;
-		break;
 	case EReturnCode::UNKNOWN_ERROR:
 	default:
 		stream << "ERROR: unknown error at file: \"" << entry << "\"\n";
@@ -167,46 +109,104 @@ void LogReturnStatus(const std::string_view entry, SReturnStatus status, uint32_
 	}
 }
 
-cv::Size FitAspectRatio(int org_width, int org_height, int target_width, int target_height)
+// Logs through the status log while ProcessEntries runs, straight to stdout otherwise
+void ReportStatus(const std::string_view entry, const SReturnStatus& status,
+                  const SProgramOptions& program_options)
 {
-	cv::Size real_size;
+	if (program_options.status_log)
+	{
+		program_options.status_log->Record(entry, status);
+	}
+	else
+	{
+		LogReturnStatus(entry, status, program_options.verbose);
+	}
+}
+
+uint64_t HashProgramOptions(const SProgramOptions& program_options)
+{
+	// Any change here changes which outputs --incremental considers up to date
+	std::string key;
+	const auto append = [&key](uint64_t value) { key.append((const char*)&value, sizeof(value)); };
+
+	append((uint64_t)program_options.output_format);
+	append(program_options.output_folder.size());
+	key += program_options.output_folder;
+	append(program_options.number_of_input_entries);
+	append(program_options.keep_aspect_ratio);
+	append(program_options.native_layout);
+	append((uint64_t)program_options.interpolation);
+	// Streamed images go through a different resampler, whose pixels can differ slightly
+	append(program_options.stream_pixels);
+
+	for (const SOutputSpec& output_spec : program_options.outputs)
+	{
+		append(output_spec.target_width);
+		append(output_spec.target_height);
+		append(output_spec.suffix.size());
+		key += output_spec.suffix;
+		append(output_spec.output_folder.size());
+		key += output_spec.output_folder;
+	}
 
-	const int l = org_width * target_height;
-	const int r = org_height * target_width;
+	return HashBytes(key.data(), key.size());
+}
 
-	// Figure out the correct aspect ratio
-	float scale_factor;
-	if (l > r)
+bool IsInShard(const fs::path& relative_path, const SProgramOptions& program_options)
+{
+	if (program_options.shard_count <= 1)
 	{
-		// Wider
-		scale_factor = (float)target_width / org_width;
-		real_size.height = (int)(org_height * scale_factor);
-		real_size.width = target_width;
+		return true;
 	}
-	else if (l < r)
+
+	// Generic separators so that every machine agrees, whatever its platform
+	const std::string key = relative_path.generic_string();
+	return HashBytes(key.data(), key.size()) % program_options.shard_count ==
+	       program_options.shard_index;
+}
+
+std::string ShardSuffix(const SProgramOptions& program_options)
+{
+	if (program_options.shard_count <= 1)
 	{
-		// Taller
-		scale_factor = (float)target_height / org_height;
-		real_size.width = (int)(org_width * scale_factor);
-		real_size.height = target_height;
+		return "";
 	}
-	else
+
+	return "-" + std::to_string(program_options.shard_index) + "of" +
+	       std::to_string(program_options.shard_count);
+}
+
+bool ReadImageHeader(const std::string_view path, EFileType file_type, SImageHeader& header)
+{
+	std::ifstream stream(std::string(path), std::ios::binary);
+	if (!stream)
 	{
-		// Equal
-		scale_factor = (float)target_height / org_height;
-		real_size.width = target_width;
-		real_size.height = target_height;
+		return false;
 	}
 
-	return real_size;
+	return ReadImageHeader(stream, file_type, header);
 }
 
 std::string replace_str(std::string& str, const std::string& from, const std::string& to)
 {
-	while (str.find(from) != std::string::npos)
+	if (from.empty())
 	{
-		str.replace(str.find(from), from.length(), to);
+		return str;
 	}
+
+	// Single pass, each occurrence is searched for from where the last one ended
+	std::string replaced;
+	replaced.reserve(str.size());
+	size_t start = 0;
+	for (size_t pos = str.find(from); pos != std::string::npos; pos = str.find(from, start))
+	{
+		replaced.append(str, start, pos - start);
+		replaced += to;
+		start = pos + from.length();
+	}
+	replaced.append(str, start, std::string::npos);
+
+	str = std::move(replaced);
 	return str;
 }
 
@@ -253,198 +253,1103 @@ std::string MakeOutputPath(const std::string_view path, std::string output_folde
 			}
 		}
 
-		fs::path output_directory = output_folder / output_path.parent_path();
-		output_path = output_folder / output_path;
+		// The folder structure is created by COutputPlan before the file is processed
+		return (output_folder / output_path).string();
+	}
+	else if (output_format == EOutputFormat::INPLACE)
+	{
+		return std::string(path);
+	}
+	else if (output_format == EOutputFormat::TAR_SHARDS)
+	{
+		// Name of the member inside the shards, they all go to output_folder
+		return MakeArchiveMemberName(path, number_of_input_entries);
+	}
+
+	assert("MakeOutputPath: output_format is invalid!" && false);
+	return "";
+}
+
+// "folder/name.ext" -> "folder/name<suffix>.ext"
+std::string AppendSuffix(const std::string& path, const std::string& suffix)
+{
+	if (suffix.empty())
+	{
+		return path;
+	}
+
+	fs::path suffixed_path(path);
+	suffixed_path.replace_filename(suffixed_path.stem().string() + suffix +
+	                               suffixed_path.extension().string());
+	return suffixed_path.string();
+}
+
+std::string MakeOutputPath(const std::string_view path, const SOutputSpec& output_spec,
+                           const SProgramOptions& program_options)
+{
+	const std::string& output_folder = output_spec.output_folder.empty()
+	                                       ? program_options.output_folder
+	                                       : output_spec.output_folder;
+
+	const std::string output_path =
+	    MakeOutputPath(path, output_folder, program_options.output_format,
+	                   program_options.number_of_input_entries);
+
+	return AppendSuffix(output_path, output_spec.suffix);
+}
+
+// Path of the output_index-th output of job, its folder was created by COutputPlan
+std::string MakeOutputPath(const SImageJob& job, size_t output_index,
+                           const SProgramOptions& program_options)
+{
+	const SOutputSpec& output_spec = program_options.outputs[output_index];
+	if (job.output_path.empty())
+	{
+		return MakeOutputPath(job.path, output_spec, program_options);
+	}
+
+	const std::string output_path = AppendSuffix(job.output_path, output_spec.suffix);
+	if (program_options.tar_shards)
+	{
+		return MakeArchiveMemberName(output_path, 0);
+	}
+
+	return output_path;
+}
+
+// Completes job by cloning the outputs of the first job with the same contents
+void CompleteDuplicate(SImageJob& job, const SDedupResult& first,
+                       const SProgramOptions& program_options)
+{
+	CDedupIndex& dedup_index = *program_options.dedup_index;
+	job.outputs.resize(program_options.outputs.size());
+	for (size_t i = 0; i < job.outputs.size(); ++i)
+	{
+		SJobOutput& output = job.outputs[i];
+		output.output_path = MakeOutputPath(job, i, program_options);
+		output.size = first.output_sizes[i];
+
+		// Inplace or listed outputs may be the same file already
+		if (output.output_path != first.output_paths[i] &&
+		    !dedup_index.CloneOutput(first.output_paths[i], output.output_path))
+		{
+			job.status.return_code = EReturnCode::FILE_WRITE_ERROR;
+			job.status.detail = output.output_path;
+			return;
+		}
+	}
+
+	job.duplicate_of = first.input_path;
+	dedup_index.RecordDuplicate(job.input_size, first.processing_seconds);
+
+	if (program_options.manifest)
+	{
+		program_options.manifest->Record(job, program_options);
+	}
+
+	job.status.return_code = EReturnCode::OK;
+}
+
+// Checks whether an input with the same contents and output formats as job was seen before.
+// If it was, clones its outputs and returns false since job is complete. If that input is
+// still being processed, a copy of job is left to wait for it and job is deferred instead.
+// Otherwise job becomes the one the later duplicates wait for.
+bool DeduplicateJob(SImageJob& job, const SProgramOptions& program_options)
+{
+	// With --input-list every input can ask for other formats, whose outputs can't be shared
+	std::string extensions;
+	for (size_t i = 0; i < program_options.outputs.size(); ++i)
+	{
+		extensions += fs::path(MakeOutputPath(job, i, program_options)).extension().string();
+		extensions += '\n';
+	}
+	job.content_hash = HashBytes(job.file_data.data, job.file_data.size,
+	                             HashBytes(extensions.data(), extensions.size()));
+
+	// The waiting copy doesn't keep the input or its memory, cloning doesn't need them. It is
+	// made up front since the first job may publish as soon as the claim is made.
+	std::shared_ptr<SImageJob> waiting_job = std::make_shared<SImageJob>(job);
+	waiting_job->file_data = SFileData();
+	waiting_job->memory_reservation.reset();
+	const auto complete_waiting_job = [waiting_job, &program_options](
+	                                      const std::shared_ptr<const SDedupResult>& first) {
+		if (first->success)
+		{
+			CompleteDuplicate(*waiting_job, *first, program_options);
+		}
+		else
+		{
+			waiting_job->status = first->status;
+		}
+		FinishJob(*waiting_job, program_options);
+	};
+
+	std::shared_ptr<const SDedupResult> first;
+	switch (program_options.dedup_index->Claim(job.content_hash, job.input_size, first,
+	                                           complete_waiting_job))
+	{
+	case EDedupClaim::FIRST:
+		job.dedup_first = true;
+		return true;
+	case EDedupClaim::WAITING:
+		job.deferred = true;
+		return false;
+	default:
+		break;
+	}
+
+	if (!first->success)
+	{
+		// Whatever went wrong might not happen again, e.g. an unwritable output folder
+		return true;
+	}
+
+	job.file_data = SFileData();
+	CompleteDuplicate(job, *first, program_options);
+	return false;
+}
+
+// Inputs that already are what every output would be are copied as they are instead of being
+// decoded and encoded again, which would only cost time and quality. Only the header is needed
+// to find out. Returns false if job still has to be processed.
+bool PassThroughJob(SImageJob& job, const SProgramOptions& program_options)
+{
+	const SImageHeader& header = job.header;
+	if (!job.has_header || !IsPassThrough(header, program_options))
+	{
+		return false;
+	}
+
+	// An output path from the input list may ask for another format
+	std::vector<SJobOutput> outputs(program_options.outputs.size());
+	for (size_t i = 0; i < outputs.size(); ++i)
+	{
+		outputs[i].output_path = MakeOutputPath(job, i, program_options);
+		outputs[i].size = cv::Size((int)header.width, (int)header.height);
+		const std::string extension = fs::path(outputs[i].output_path).extension().string();
+		if (FileTypeFromExtension(extension) != job.file_type)
+		{
+			return false;
+		}
+	}
+
+	job.source_width = header.width;
+	job.source_height = header.height;
+	job.outputs = std::move(outputs);
+	job.passed_through = true;
+
+	for (const SJobOutput& output : job.outputs)
+	{
+		// Inplace outputs already are the input, there's nothing to do at all
+		if (output.output_path != job.path &&
+		    CloneFile(job.path, output.output_path, ECloneMethod::REFLINK) ==
+		        ECloneMethod::FAILED)
+		{
+			job.status.return_code = EReturnCode::FILE_WRITE_ERROR;
+			job.status.detail = output.output_path;
+			return true;
+		}
+	}
+
+	if (program_options.manifest)
+	{
+		program_options.manifest->Record(job, program_options);
+	}
+
+	job.status.return_code = EReturnCode::OK;
+	return true;
+}
+
+bool ReadStage(SImageJob& job, const SProgramOptions& program_options)
+{
+	const std::string extension = fs::path(job.path).extension().string();
+	job.file_type = FileTypeFromExtension(extension);
+	if (job.file_type == EFileType::OTHER)
+	{
+		job.status.return_code = EReturnCode::FILE_UNKNOWN_EXTENSION;
+		job.status.detail = extension;
+		return false;
+	}
+
+	// The encoded input and the decoded image are admitted together, before either is
+	// allocated, so a job never holds part of the budget while it waits for more. That takes
+	// the header before the file is read. Files without a readable header only count with
+	// their input, imdecode rejects most of them.
+	if (program_options.memory_budget)
+	{
+		job.has_header = ReadImageHeader(job.path, job.file_type, job.header);
+		std::error_code ec;
+		const uintmax_t file_size = fs::file_size(job.path, ec);
+		job.reserved_decode_bytes =
+		    job.has_header ? EstimateDecodeMemory(job.header, job.file_type, program_options) : 0;
+		job.memory_reservation = program_options.memory_budget->Acquire(
+		    (ec ? 0 : (uint64_t)file_size) + job.reserved_decode_bytes);
+	}
+
+	// With --prefetch the pages of the input are dropped once it is read, so that a large run
+	// doesn't push everything else out of the page cache
+	if (!ReadInputFile(job.path, program_options.io_backend, program_options.buffer_pools,
+	                   program_options.prefetch_window != 0, job.file_data))
+	{
+		job.status.return_code = EReturnCode::FILE_READ_ERROR;
+		return false;
+	}
+
+	job.input_size = (uint64_t)job.file_data.size;
+	if (program_options.manifest)
+	{
+		std::error_code ec;
+		job.input_mtime = fs::last_write_time(job.path, ec).time_since_epoch().count();
+	}
+
+	// Otherwise the header comes from the bytes just read, without opening the file again.
+	// The decode stage reuses it.
+	if (!job.has_header)
+	{
+		job.has_header =
+		    ReadImageHeader(job.file_data.data, job.file_data.size, job.file_type, job.header);
+	}
+
+	const bool can_pass_through = program_options.output_format != EOutputFormat::TAR_SHARDS &&
+	                              program_options.output_format != EOutputFormat::TENSOR;
+	if (can_pass_through && PassThroughJob(job, program_options))
+	{
+		return false;
+	}
+
+	if (program_options.dedup_index)
+	{
+		return DeduplicateJob(job, program_options);
+	}
+
+	return true;
+}
+
+void SetJobOutputs(SImageJob& job, const std::vector<cv::Mat>& images_final)
+{
+	job.outputs.resize(images_final.size());
+	for (size_t i = 0; i < images_final.size(); ++i)
+	{
+		job.outputs[i].image_final = images_final[i];
+		job.outputs[i].size = images_final[i].size();
+	}
+}
+
+bool DecodeStage(SImageJob& job, const SProgramOptions& program_options)
+{
+	// The read stage already reserved memory for decoding. If the decoder needs more, e.g.
+	// for a PNG that can't be decoded in strips after all, the rest is only counted.
+	const auto reserve_memory = [&job, &program_options](uint64_t bytes) {
+		if (bytes > job.reserved_decode_bytes)
+		{
+			job.memory_overrun =
+			    program_options.memory_budget->Charge(bytes - job.reserved_decode_bytes);
+		}
+	};
+
+	SImageHeader header;
+	std::vector<cv::Mat> images_final;
+	const EReturnCode return_code = DecodeImage(
+	    job.file_data.data, job.file_data.size, job.file_type, program_options,
+	    program_options.memory_budget ? ReserveMemoryFn(reserve_memory) : ReserveMemoryFn(),
+	    job.image, images_final, header, job.has_header ? &job.header : nullptr);
+	job.source_width = header.width;
+	job.source_height = header.height;
+
+	// The encoded bytes aren't needed anymore, don't hold onto them while the job is queued
+	job.file_data = SFileData();
+
+	if (return_code != EReturnCode::OK)
+	{
+		job.status.return_code = return_code;
+		return false;
+	}
+
+	// Inputs decoded in strips were already resized while decoding
+	SetJobOutputs(job, images_final);
+
+	return true;
+}
+
+bool ResizeStage(SImageJob& job, const SProgramOptions& program_options)
+{
+	// Inputs decoded in strips were already resized while decoding
+	if (!job.outputs.empty())
+	{
+		return true;
+	}
+
+	std::vector<cv::Mat> images_final;
+	ResizeImage(job.image, program_options, images_final);
+
+	SetJobOutputs(job, images_final);
+
+	job.image.release();
+	return true;
+}
+
+bool EncodeStage(SImageJob& job, const SProgramOptions& program_options)
+{
+	// Raw tensors are written as they are
+	if (program_options.tensor_outputs)
+	{
+		return true;
+	}
+
+	const auto encode_output = [&job, &program_options](size_t i) {
+		SJobOutput& output = job.outputs[i];
+		output.output_path = MakeOutputPath(job, i, program_options);
+
+		// Encode to the format implied by the output extension, same as imwrite would.
+		// The raw pixel size is a generous guess for the encoded size.
+		const std::string extension = fs::path(output.output_path).extension().string();
+		output.encoded_bytes = AcquirePooledBytes(
+		    program_options.buffer_pools, output.image_final.total() * output.image_final.elemSize());
+		const bool encode_success =
+		    EncodeImage(output.image_final, extension, *output.encoded_bytes);
+
+		output.image_final.release();
+		return encode_success;
+	};
+
+	// Encoders work on a whole image, only the outputs can be encoded in parallel
+	std::vector<char> encoded(job.outputs.size(), 0);
+	const auto encode_outputs = [&encoded, &encode_output](int begin, int end) {
+		for (int i = begin; i < end; ++i)
+		{
+			encoded[i] = encode_output((size_t)i);
+		}
+	};
+	if (program_options.parallel_for && job.outputs.size() > 1)
+	{
+		program_options.parallel_for((int)job.outputs.size(), 1, encode_outputs);
+	}
+	else
+	{
+		encode_outputs(0, (int)job.outputs.size());
+	}
+
+	for (size_t i = 0; i < job.outputs.size(); ++i)
+	{
+		if (!encoded[i])
+		{
+			job.status.return_code = EReturnCode::FILE_WRITE_ERROR;
+			job.status.detail = job.outputs[i].output_path;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool WriteStage(SImageJob& job, const SProgramOptions& program_options)
+{
+	if (program_options.tensor_outputs)
+	{
+		CTensorOutputSet& tensor_outputs = *program_options.tensor_outputs;
+		const uint64_t row = tensor_outputs.AcquireRow();
+		for (size_t i = 0; i < job.outputs.size(); ++i)
+		{
+			SJobOutput& output = job.outputs[i];
+			const bool write_success = tensor_outputs.Write(i, row, job.path, output.image_final);
+			output.image_final.release();
+
+			// Report outputs as "images.npy:row"
+			output.output_path = tensor_outputs.Path(i) + ':' + std::to_string(row);
+			if (!write_success)
+			{
+				tensor_outputs.ReleaseRow(row);
+				job.status.return_code = EReturnCode::FILE_WRITE_ERROR;
+				job.status.detail = output.output_path;
+				return false;
+			}
+		}
+
+		job.status.return_code = EReturnCode::OK;
+		return true;
+	}
+
+	if (program_options.tar_shards)
+	{
+		std::string shard_path;
+		if (!program_options.tar_shards->Append(job.outputs, shard_path))
+		{
+			job.status.return_code = EReturnCode::FILE_WRITE_ERROR;
+			job.status.detail = shard_path;
+			return false;
+		}
+
+		// Report outputs as "shard.tar:member"
+		for (SJobOutput& output : job.outputs)
+		{
+			output.output_path = shard_path + ':' + output.output_path;
+		}
+
+		job.status.return_code = EReturnCode::OK;
+		return true;
+	}
+
+	for (const SJobOutput& output : job.outputs)
+	{
+		if (!WriteOutputFile(output.output_path, *output.encoded_bytes,
+		                     program_options.io_backend))
+		{
+			job.status.return_code = EReturnCode::FILE_WRITE_ERROR;
+			job.status.detail = output.output_path;
+			return false;
+		}
+	}
+
+	if (program_options.manifest)
+	{
+		program_options.manifest->Record(job, program_options);
+	}
+
+	job.status.return_code = EReturnCode::OK;
+	return true;
+}
+
+void ProcessJob(SImageJob& job, const SProgramOptions& program_options)
+{
+	// Stop at the first stage that fails, it has already filled in job.status
+	CRunStats& run_stats = CRunStats::ThreadLocal();
+	run_stats.RunStage(ERunStage::READ, ReadStage, job, program_options) &&
+	    run_stats.RunStage(ERunStage::DECODE, DecodeStage, job, program_options) &&
+	    run_stats.RunStage(ERunStage::RESIZE, ResizeStage, job, program_options) &&
+	    run_stats.RunStage(ERunStage::ENCODE, EncodeStage, job, program_options) &&
+	    run_stats.RunStage(ERunStage::WRITE, WriteStage, job, program_options);
+}
+
+void FinishJob(const SImageJob& job, const SProgramOptions& program_options)
+{
+	// Finished by the job it waits for instead, see DeduplicateJob
+	if (job.deferred)
+	{
+		return;
+	}
+
+	CRunStats::ThreadLocal().RecordJob(job);
+
+	// Let the duplicates waiting for this job go on, whether it worked or not
+	if (job.dedup_first)
+	{
+		std::shared_ptr<SDedupResult> result = std::make_shared<SDedupResult>();
+		result->success = job.status.return_code == EReturnCode::OK;
+		result->status = job.status;
+		result->input_path = job.path;
+		for (const SJobOutput& output : job.outputs)
+		{
+			result->output_paths.push_back(output.output_path);
+			result->output_sizes.push_back(output.size);
+		}
+		result->processing_seconds = job.processing_seconds;
+		program_options.dedup_index->Publish(job.content_hash, job.input_size, std::move(result));
+	}
+
+	if (program_options.input_list.empty())
+	{
+		ReportStatus(job.path, job.status, program_options);
+	}
+	else
+	{
+		WriteJobRecordJson(std::cout, job);
+	}
+}
+
+SReturnStatus ProcessFile(const std::string_view path, const SProgramOptions& program_options)
+{
+	SImageJob job;
+	job.path = std::string(path);
+
+	COutputPlan output_plan(program_options);
+	output_plan.PrepareInput(job.path, job.output_path);
+	ProcessJob(job, program_options);
+	FinishJob(job, program_options);
+
+	return job.status;
+}
+
+// Reads "input[<tab>output]" lines and hands each one over as soon as it is read
+bool ReadInputList(const std::string& input_list,
+                   const std::function<void(std::string, std::string)>& submit)
+{
+	std::ifstream file;
+	std::istream* stream = &std::cin;
+	if (input_list != "-")
+	{
+		file.open(input_list);
+		if (!file)
+		{
+			return false;
+		}
+		stream = &file;
+	}
+
+	std::string line;
+	while (std::getline(*stream, line))
+	{
+		if (!line.empty() && line.back() == '\r')
+		{
+			line.pop_back();
+		}
+		if (line.empty())
+		{
+			continue;
+		}
+
+		const size_t tab_pos = line.find('\t');
+		if (tab_pos == std::string::npos)
+		{
+			submit(line, "");
+		}
+		else
+		{
+			submit(line.substr(0, tab_pos), line.substr(tab_pos + 1));
+		}
+	}
+
+	return true;
+}
+
+void ProcessEntries(const std::vector<std::string>& arg_entries,
+                    const SProgramOptions& program_options_in)
+{
+	SProgramOptions program_options = program_options_in;
+	const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+	// In --input-list mode stdout only carries the JSON records, everything else goes to stderr
+	const bool list_mode = !program_options.input_list.empty();
+	std::ostream& info_stream = list_mode ? std::cerr : std::cout;
+
+	std::unique_ptr<CManifest> manifest;
+	if (!program_options.manifest_path.empty())
+	{
+		manifest = std::make_unique<CManifest>(program_options.manifest_path,
+		                                       HashProgramOptions(program_options));
+		if (!manifest->Open())
+		{
+			info_stream << "ERROR: cannot open the manifest: \"" << program_options.manifest_path
+			            << "\"";
+			if (!manifest->Error().empty())
+			{
+				info_stream << ", " << manifest->Error();
+			}
+			info_stream << "\n";
+			return;
+		}
+
+		info_stream << "Loaded " << manifest->NumberOfLoadedEntries()
+		            << " entries from the manifest.\n";
+		program_options.manifest = manifest.get();
+	}
+	std::atomic<uint64_t> num_up_to_date{0};
+	std::atomic<uint64_t> num_other_shards{0};
+
+	std::unique_ptr<CTarShardSet> tar_shards;
+	if (program_options.output_format == EOutputFormat::TAR_SHARDS)
+	{
+		tar_shards = std::make_unique<CTarShardSet>(program_options.output_folder,
+		                                            ShardSuffix(program_options),
+		                                            program_options.shard_max_images,
+		                                            program_options.shard_max_bytes);
+		program_options.tar_shards = tar_shards.get();
+	}
+
+	std::unique_ptr<CTensorOutputSet> tensor_outputs;
+	if (program_options.output_format == EOutputFormat::TENSOR)
+	{
+		tensor_outputs = std::make_unique<CTensorOutputSet>(program_options);
+		std::string failed_path;
+		if (!tensor_outputs->Open(failed_path))
+		{
+			info_stream << "ERROR: cannot create the array \"" << failed_path << "\"\n";
+			return;
+		}
+		program_options.tensor_outputs = tensor_outputs.get();
+	}
+
+	std::unique_ptr<CDedupIndex> dedup_index;
+	if (program_options.dedup)
+	{
+		dedup_index = std::make_unique<CDedupIndex>(program_options.dedup_method);
+		program_options.dedup_index = dedup_index.get();
+	}
+
+	// Workers hand their results to a single writer instead of all locking stdout
+	std::unique_ptr<CStatusLog> status_log;
+	if (!list_mode && program_options.verbose)
+	{
+		status_log = std::make_unique<CStatusLog>(program_options.verbose, std::cout);
+		program_options.status_log = status_log.get();
+	}
+
+	std::vector<fs::directory_entry> arg_files;
+	std::vector<fs::path> arg_folders;
+
+	for (const std::string& entry : arg_entries)
+	{
+		const fs::directory_entry entry_path(entry);
+
+		if (entry_path.is_directory())
+		{
+			arg_folders.push_back(entry_path.path());
+		}
+		else if (entry_path.is_regular_file())
+		{
+			arg_files.push_back(entry_path);
+		}
+	}
+
+	const uint32_t num_threads =
+	    (program_options.num_threads > 0 && program_options.num_threads <= 64)
+	        ? program_options.num_threads
+	        : std::thread::hardware_concurrency();
+
+	uint32_t file_level_workers = program_options.num_threads == 1 ? 1 : num_threads;
+	if (program_options.pipeline)
+	{
+		// Only the CPU bound stages count, reads and writes mostly wait on the disk
+		const SPipelineOptions& pipeline_options = program_options.pipeline_options;
+		file_level_workers = pipeline_options.decode_threads + pipeline_options.resize_threads +
+		                     pipeline_options.encode_threads;
+	}
+	std::unique_ptr<CMemoryBudget> memory_budget;
+	uint64_t pool_budget = 0;
+	uint64_t max_reserved_bytes_per_pool = CBufferPoolSet::k_default_max_reserved_bytes_per_pool;
+	if (program_options.max_memory)
+	{
+		// Every thread that handles files keeps free buffers around in its CBufferPool. The
+		// pools get a quarter of the budget between them, the jobs get the rest.
+		uint32_t pool_threads = program_options.num_threads == 1 ? 1 : num_threads;
+		if (program_options.pipeline)
+		{
+			const SPipelineOptions& pipeline_options = program_options.pipeline_options;
+			pool_threads = pipeline_options.read_threads + file_level_workers +
+			               pipeline_options.write_threads;
+		}
+		pool_budget = program_options.max_memory / 4;
+		max_reserved_bytes_per_pool = pool_budget / std::max(pool_threads, 1u);
+
+		memory_budget =
+		    std::make_unique<CMemoryBudget>(program_options.max_memory - pool_budget);
+		program_options.memory_budget = memory_budget.get();
+	}
+	CBufferPoolSet buffer_pools(max_reserved_bytes_per_pool);
+	program_options.buffer_pools = &buffer_pools;
+
+	// OpenCV's own threads would compete with the workers for the cores. With the thread pool,
+	// whichever workers are idle at the time split large resizes and the encodes of single
+	// images between them instead (CWorkStealingPool::ParallelFor), so OpenCV stays on one
+	// thread however many workers there are. The pipeline has no idle workers to hand work
+	// to, there OpenCV keeps its threads as long as the CPU bound stages leave cores free.
+	const int opencv_threads = cv::getNumThreads();
+	const bool uses_pool = !program_options.pipeline && program_options.num_threads != 1;
+	if (uses_pool ||
+	    (program_options.pipeline &&
+	     file_level_workers >= std::max(std::thread::hardware_concurrency(), 1u)))
+	{
+		cv::setNumThreads(0);
+	}
+
+	// Receives the path of each input, and its output path if one was given in the input list
+	using SubmitFn = std::function<void(std::string, std::string)>;
+
+	// Files are handed out while the folders are still being scanned or the input list is
+	// still being read, so the workers start right away instead of waiting for all of them
+	bool input_list_success = true;
+	COutputPlan output_plan(program_options);
+	const auto enumerate_inputs = [&](uint32_t scan_threads, const SubmitFn& submit_job) {
+		std::unique_ptr<CPrefetcher> prefetcher;
+		if (program_options.prefetch_window)
+		{
+			prefetcher = std::make_unique<CPrefetcher>(program_options.prefetch_window,
+			                                           program_options.prefetch_order, submit_job);
+		}
+
+		// Output folders are created here, ahead of the workers, which then never touch the
+		// filesystem to work out where their outputs go
+		const auto submit = [&](std::string path, std::string output_path) {
+			output_plan.PrepareInput(path, output_path);
+			if (prefetcher)
+			{
+				prefetcher->Submit(std::move(path), std::move(output_path));
+			}
+			else
+			{
+				submit_job(std::move(path), std::move(output_path));
+			}
+		};
+
+		// With --shard the inputs of the other runs are dropped first, before they cost a stat
+		const auto in_shard = [&](const fs::path& relative_path) {
+			if (IsInShard(relative_path, program_options))
+			{
+				return true;
+			}
+			num_other_shards++;
+			return false;
+		};
+
+		// In incremental mode unchanged files are dropped here, before they're ever opened
+		const auto submit_if_changed = [&](const fs::directory_entry& entry,
+		                                   std::string output_path) {
+			if (manifest && manifest->IsUpToDate(entry))
+			{
+				num_up_to_date++;
+				SImageJob skipped_job;
+				skipped_job.path = entry.path().string();
+				skipped_job.status.return_code = EReturnCode::FILE_UP_TO_DATE;
+				CRunStats::ThreadLocal().RecordStatus(skipped_job.status.return_code);
+				if (list_mode)
+				{
+					WriteJobRecordJson(std::cout, skipped_job);
+				}
+				else
+				{
+					ReportStatus(skipped_job.path, skipped_job.status, program_options);
+				}
+				return;
+			}
+			submit(entry.path().string(), std::move(output_path));
+		};
+
+		if (list_mode)
+		{
+			input_list_success = ReadInputList(
+			    program_options.input_list, [&](std::string path, std::string output_path) {
+				    if (!in_shard(path))
+				    {
+					    return;
+				    }
+				    if (manifest)
+				    {
+					    std::error_code ec;
+					    submit_if_changed(fs::directory_entry(path, ec), std::move(output_path));
+				    }
+				    else
+				    {
+					    submit(std::move(path), std::move(output_path));
+				    }
+			    });
+			if (prefetcher)
+			{
+				prefetcher->Flush();
+			}
+			return;
+		}
+
+		for (const fs::directory_entry& file : arg_files)
+		{
+			if (in_shard(file.path()))
+			{
+				submit_if_changed(file, "");
+			}
+		}
 
-		// Create the folder structure if needed, otherwise writes will fail
-		fs::create_directories(output_directory);
+		// With --shard every file is sharded by its path relative to the folder argument it was
+		// found in. Each run still lists every folder, the files of a folder can belong to
+		// any shard.
+		const bool sharded = program_options.shard_count > 1;
+		std::vector<size_t> root_lengths;
+		for (const fs::path& folder : arg_folders)
+		{
+			root_lengths.push_back(folder.generic_string().size());
+		}
+		CDirectoryWalker walker(
+		    scan_threads, program_options.recursive,
+		    [&](const fs::directory_entry& entry, size_t root) {
+			    if (sharded)
+			    {
+				    // The walker appends to the folder as given, so it is a prefix of the path
+				    const std::string path = entry.path().generic_string();
+				    const size_t relative_pos = path.find_first_not_of('/', root_lengths[root]);
+				    if (!in_shard(path.substr(std::min(relative_pos, path.size()))))
+				    {
+					    return;
+				    }
+			    }
+			    submit_if_changed(entry, "");
+		    },
+		    [&program_options](const fs::path& folder) {
+			    SReturnStatus status{};
+			    status.return_code = EReturnCode::FOLDER_READ_ERROR;
+			    CRunStats::ThreadLocal().RecordStatus(status.return_code);
+			    ReportStatus(folder.string(), status, program_options);
+		    });
+		walker.Walk(arg_folders);
+
+		if (prefetcher)
+		{
+			prefetcher->Flush();
+		}
+	};
 
-		return output_path.string();
-	}
-	else if (output_format == EOutputFormat::INPLACE)
+	std::unique_ptr<CProgressReporter> progress_reporter;
+	if (program_options.progress_interval)
 	{
-		return std::string(path);
+		progress_reporter =
+		    std::make_unique<CProgressReporter>(program_options.progress_interval, info_stream);
 	}
 
-	assert("MakeOutputPath: output_format is invalid!" && false);
-	return "";
-}
+	if (program_options.pipeline)
+	{
+		CPipeline pipeline(program_options);
 
-SReturnStatus ProcessFileImpl(const std::string_view path, const SProgramOptions& program_options)
-{
-	SReturnStatus status;
+		info_stream << "Spawning " << pipeline.NumberOfWorkers() << " pipeline worker threads!\n";
 
-	// Read the file
-	cv::String path_ = cv::String(std::string(path));
-	const cv::Mat image = cv::imread(path_);
+		enumerate_inputs(program_options.scan_threads,
+		                 [&pipeline](std::string path, std::string output_path) {
+			                 pipeline.Submit(std::move(path), std::move(output_path));
+		                 });
 
-	if (!image.data)
+		pipeline.Finish();
+	}
+	else if (program_options.num_threads == 1)
 	{
-		status.return_code = EReturnCode::FILE_READ_ERROR;
-		return status;
+		// Don't spawn any threads if program_options.num_threads == 1,
+		// files are processed one by one as they are found
+		enumerate_inputs(1, [&program_options](std::string path, std::string output_path) {
+			SImageJob job;
+			job.path = std::move(path);
+			job.output_path = std::move(output_path);
+			ProcessJob(job, program_options);
+			FinishJob(job, program_options);
+		});
 	}
+	else
+	{
+		// Send jobs into the job queue and wait for thread pool to finish
+		int num_jobs = 0;
+		std::atomic<int> received_jobs{0};
+		std::atomic<int> finished_jobs{0};
+
+		CWorkStealingPool thread_pool(num_threads);
+		program_options.parallel_for = [&thread_pool](int count, int min_band_size,
+		                                              const std::function<void(int, int)>& body) {
+			thread_pool.ParallelFor(count, min_band_size, body);
+		};
+
+		info_stream << "Spawning " << num_threads << " worker threads!\n";
+
+		// Inputs can arrive much faster than they are processed, e.g. from a long input
+		// list, so submitting blocks while this many jobs are waiting for a worker. When the
+		// largest go first, more are kept waiting so that a large file found late in the
+		// scan still gets ahead of most of the small ones.
+		const int max_queued_jobs =
+		    (int)num_threads * (program_options.schedule_largest_first ? 256 : 16);
+		std::mutex queue_mutex;
+		std::condition_variable queue_not_full;
+
+		// Walker threads submit concurrently
+		std::mutex submit_mutex;
+
+		enumerate_inputs(program_options.scan_threads, [&](std::string path,
+		                                                   std::string output_path) {
+			// The file size stands in for the cost of a job, the decode and resize time
+			// mostly grow with it. Looked up before locking so the walker threads stat
+			// in parallel.
+			uint64_t cost = 0;
+			if (program_options.schedule_largest_first)
+			{
+				std::error_code ec;
+				const uintmax_t file_size = fs::file_size(path, ec);
+				cost = ec ? 0 : (uint64_t)file_size;
+			}
 
-	cv::Mat image_final;
+			std::lock_guard<std::mutex> lock(submit_mutex);
+			{
+				std::unique_lock<std::mutex> queue_lock(queue_mutex);
+				queue_not_full.wait(queue_lock, [&]() {
+					return num_jobs - received_jobs.load() < max_queued_jobs;
+				});
+			}
+			num_jobs++;
+			thread_pool.Submit(cost, [path = std::move(path),
+			                          output_path = std::move(output_path), &received_jobs,
+			                          &finished_jobs, &queue_mutex, &queue_not_full,
+			                          &program_options = std::as_const(program_options),
+			                          queued_time = std::chrono::steady_clock::now()]() {
+				{
+					std::lock_guard<std::mutex> queue_lock(queue_mutex);
+					received_jobs++;
+				}
+				queue_not_full.notify_one();
+
+				CRunStats::ThreadLocal().RecordLatency(
+				    ERunStage::QUEUE_WAIT,
+				    std::chrono::duration<double>(std::chrono::steady_clock::now() - queued_time)
+				        .count());
+
+				SImageJob job;
+				job.path = path;
+				job.output_path = output_path;
+				ProcessJob(job, program_options);
+				FinishJob(job, program_options);
+				finished_jobs++;
+			});
+		});
 
-	if (program_options.keep_aspect_ratio)
-	{
-		cv::Size real_size = FitAspectRatio(image.cols, image.rows, program_options.target_width,
-		                                    program_options.target_height);
+		thread_pool.Finish();
+		program_options.parallel_for = nullptr;
 
-		// Calculate padding
-		const int top_margin = (program_options.target_height - real_size.height) / 2;
-		const int bottom_margin = program_options.target_height - real_size.height - top_margin;
-		const int left_margin = (program_options.target_width - real_size.width) / 2;
-		const int right_margin = program_options.target_width - real_size.width - left_margin;
+		// The remaining results go out before the summaries
+		if (status_log)
+		{
+			status_log->Close();
+		}
 
-		// Resize the image
-		cv::Mat image_scaled;
-		cv::resize(image, image_scaled, cv::Size(real_size.width, real_size.height), 0, 0,
-		           program_options.interpolation);
+		info_stream << "Scheduler: " << thread_pool.NumberOfSteals() << " jobs stolen, "
+		            << thread_pool.NumberOfSplits() << " images split between workers, "
+		            << thread_pool.TailSeconds() << "s from the first idle worker to the end.\n";
 
-		// Add padding
-		cv::copyMakeBorder(image_scaled, image_final, top_margin, bottom_margin, left_margin,
-		                   right_margin, cv::BORDER_CONSTANT, cv::Scalar(0));
+		assert("Somethings wrong with the thread pool and job queue" &&
+		       finished_jobs == received_jobs && received_jobs == num_jobs);
 	}
-	else
+
+	if (status_log)
 	{
-		cv::resize(image, image_final,
-		           cv::Size(program_options.target_width, program_options.target_height), 0, 0,
-		           program_options.interpolation);
+		status_log->Close();
+		program_options.status_log = nullptr;
 	}
 
-	// Figure out the output path
-	const std::string output_path =
-	    MakeOutputPath(path, program_options.output_folder, program_options.output_format,
-	                   program_options.number_of_input_entries);
-
-	// Write the image
-	const bool write_success = cv::imwrite(output_path, image_final);
-
-	if (!write_success)
+	if (!input_list_success)
 	{
-		status.return_code = EReturnCode::FILE_WRITE_ERROR;
-		snprintf(status.write_fail_dest, sizeof(status.write_fail_dest), "%s",
-		         output_path.c_str());
-		return status;
+		info_stream << "ERROR: cannot read the input list: \"" << program_options.input_list
+		            << "\"\n";
 	}
 
-	status.return_code = EReturnCode::OK;
-	return status;
-}
+	progress_reporter.reset();
+	cv::setNumThreads(opencv_threads);
 
-SReturnStatus ProcessFile(const std::string_view path, const SProgramOptions& program_options)
-{
-	const std::string extension = fs::path(path).extension().string();
-	ExtLookup::iterator ext_lut_it = g_ext_lookup_table.find(extension);
+	const double wall_seconds =
+	    std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	SRunReport run_report = CRunStats::Collect(true);
+	run_report.shard_index = program_options.shard_index;
+	run_report.shard_count = program_options.shard_count;
+	run_report.num_other_shards = num_other_shards;
 
-	if (ext_lut_it == g_ext_lookup_table.end())
+	uint64_t num_errors = 0;
+	for (EReturnCode return_code : {EReturnCode::FILE_READ_ERROR, EReturnCode::FOLDER_READ_ERROR,
+	                                EReturnCode::FILE_WRITE_ERROR, EReturnCode::UNKNOWN_ERROR})
 	{
-		SReturnStatus status{};
-		status.return_code = EReturnCode::FILE_UNKNOWN_EXTENSION;
-		snprintf(status.write_fail_dest, sizeof(status.write_fail_dest), "%s", extension.c_str());
-		return status;
+		num_errors += run_report.return_codes[(size_t)return_code];
 	}
+	info_stream << "Processed " << run_report.num_files << " files in " << wall_seconds << " s ("
+	            << run_report.num_files / std::max(wall_seconds, 1e-9) << " files/s), "
+	            << num_errors << " errors.\n";
 
-	switch (ext_lut_it->second)
+	if (!program_options.report_path.empty())
 	{
-	// Fallthrough
-	case EFileType::IMAGE_JPEG:
-	case EFileType::IMAGE_PNG:
-		return ProcessFileImpl(path, program_options);
-		break;
-	case EFileType::OTHER:
-	default:
-		SReturnStatus status{};
-		status.return_code = EReturnCode::UNKNOWN_ERROR;
-		return status;
-		break;
+		if (program_options.report_path == "-")
+		{
+			WriteRunReportJson(std::cout, run_report, wall_seconds);
+		}
+		else
+		{
+			// Written under a temporary name and renamed, so a report that exists is complete
+			const std::string temp_path = program_options.report_path + ".tmp";
+			std::ofstream report_stream(temp_path);
+			WriteRunReportJson(report_stream, run_report, wall_seconds);
+			report_stream.close();
+
+			std::error_code ec;
+			if (report_stream)
+			{
+				fs::rename(temp_path, program_options.report_path, ec);
+			}
+			if (!report_stream || ec)
+			{
+				info_stream << "ERROR: cannot write the report: \"" << program_options.report_path
+				            << "\"\n";
+			}
+		}
 	}
 
-	return {};
-}
+	if (run_report.num_passed_through)
+	{
+		info_stream << "Passed " << run_report.num_passed_through
+		            << " files through, they already had the size of the outputs.\n";
+	}
 
-void ProcessEntries(const std::vector<std::string>& arg_entries,
-                    const SProgramOptions& program_options)
-{
-	std::vector<fs::path> all_files;
-	std::queue<fs::path> folder_queue;
+	if (program_options.shard_count > 1)
+	{
+		info_stream << "Shard " << program_options.shard_index << "/" << program_options.shard_count
+		            << ": " << num_other_shards << " inputs left to the other shards.\n";
+	}
 
-	for (const std::string& entry : arg_entries)
+	if (output_plan.NumberOfCreatedFolders())
 	{
-		const fs::path entry_path(entry);
+		info_stream << "Created " << output_plan.NumberOfCreatedFolders() << " output folders.\n";
+	}
 
-		if (fs::is_directory(entry_path))
-		{
-			folder_queue.push(entry_path);
-		}
-		else if (fs::is_regular_file(entry_path))
-		{
-			all_files.push_back(entry_path);
-		}
+	const SBufferPoolStats pool_stats = buffer_pools.Stats();
+	if (pool_stats.hits + pool_stats.misses)
+	{
+		info_stream << "Buffer pool: "
+		            << 100.0 * pool_stats.hits / (pool_stats.hits + pool_stats.misses)
+		            << "% hit rate (" << pool_stats.hits << " hits, " << pool_stats.misses
+		            << " misses), peak reserved " << pool_stats.peak_reserved_bytes / (1 << 20)
+		            << " MB.\n";
 	}
 
-	while (!folder_queue.empty())
+	if (memory_budget)
 	{
-		const fs::path& path = folder_queue.front();
+		info_stream << "Memory budget: peak " << memory_budget->PeakBytes() / (1 << 20) << " of "
+		            << memory_budget->Capacity() / (1 << 20) << " MB for the jobs and "
+		            << pool_budget / (1 << 20) << " MB for the buffer pools, "
+		            << memory_budget->NumberOfWaits() << " files waited for memory.\n";
+	}
 
-		for (const fs::path& entry : fs::directory_iterator(path))
+	if (tar_shards)
+	{
+		const bool close_success = tar_shards->Close();
+		const STarShardStats shard_stats = tar_shards->Stats();
+		info_stream << "Wrote " << shard_stats.num_images << " images (" << shard_stats.num_members
+		            << " files, " << shard_stats.num_bytes / (1 << 20) << " MB) into "
+		            << shard_stats.num_shards << " tar shards.\n";
+		if (!close_success)
 		{
-			if (fs::is_regular_file(entry))
-			{
-				all_files.push_back(entry);
-			}
-			else if (fs::is_directory(entry) && program_options.recursive)
-			{
-				folder_queue.push(entry);
-			}
+			info_stream << "ERROR: cannot write some of the tar shards in \""
+			            << program_options.output_folder << "\"\n";
 		}
-
-		folder_queue.pop();
 	}
 
-	if (program_options.num_threads == 1)
+	if (tensor_outputs)
 	{
-		// Don't spawn any threads if program_options.num_threads == 1
-		for (const fs::path& entry : all_files)
+		const bool close_success = tensor_outputs->Close();
+		for (size_t i = 0; i < program_options.outputs.size(); ++i)
+		{
+			const SOutputSpec& output_spec = program_options.outputs[i];
+			info_stream << "Wrote " << tensor_outputs->NumberOfRows() << "x"
+			            << output_spec.target_height << "x" << output_spec.target_width
+			            << "x3 array \"" << tensor_outputs->Path(i) << "\".\n";
+		}
+		if (!close_success)
 		{
-			const std::string entry_str = entry.string();
-			SReturnStatus status = ProcessFile(entry_str, program_options);
-			LogReturnStatus(entry_str, status, program_options.verbose);
+			info_stream << "ERROR: cannot finish some of the arrays or their path indexes.\n";
 		}
 	}
-	else
-	{
-		// Send jobs into the job queue and wait for thread pool to finish
-		const int num_jobs = (int)all_files.size();
-		std::atomic<int> received_jobs{0};
-		std::atomic<int> finished_jobs{0};
 
-		const uint32_t num_threads =
-		    (program_options.num_threads > 0 && program_options.num_threads <= 64)
-		        ? program_options.num_threads
-		        : std::thread::hardware_concurrency();
-		nThread::CThreadPool thread_pool(num_threads);
+	if (dedup_index)
+	{
+		const SDedupStats dedup_stats = dedup_index->Stats();
+		info_stream << "Dedup: " << dedup_stats.num_duplicates << " duplicates of "
+		            << dedup_stats.num_unique << " unique inputs, "
+		            << dedup_stats.bytes_saved / (1 << 20) << " MB not decoded, ~"
+		            << dedup_stats.seconds_saved << " s of processing saved ("
+		            << dedup_stats.num_hardlinked << " hardlinked, " << dedup_stats.num_reflinked
+		            << " reflinked, " << dedup_stats.num_copied << " copied).\n";
+	}
 
-		std::cout << "Spawning " << num_threads << " worker threads!\n";
+	if (manifest)
+	{
+		info_stream << "Skipped " << num_up_to_date << " up to date files.\n";
 
-		for (const fs::path& entry : all_files)
+		if (!manifest->Close())
 		{
-			thread_pool.add_and_detach([&entry, &received_jobs, &finished_jobs, num_jobs,
-			                            &program_options = std::as_const(program_options)]() {
-				received_jobs++;
-				const std::string entry_str = entry.string();
-				SReturnStatus status = ProcessFile(entry_str, program_options);
-				LogReturnStatus(entry_str, status, program_options.verbose);
-				finished_jobs++;
-			});
+			info_stream << "ERROR: cannot update the manifest: \"" << program_options.manifest_path
+			            << "\"\n";
 		}
-
-		thread_pool.wait_until_all_usable();
-		thread_pool.join_all();
-
-		assert("Somethings wrong with the thread pool and job queue" &&
-		       finished_jobs == received_jobs && received_jobs == num_jobs);
 	}
 }
 
@@ -459,30 +1364,132 @@ void TestLogReturnStatus()
 	status.return_code = EReturnCode::OK;
 	LogReturnStatus(entry, status, 2);
 
-	snprintf(status.file_ext, sizeof(status.file_ext), ".ext");
+	status.detail = ".ext";
 	status.return_code = EReturnCode::FILE_UNKNOWN_EXTENSION;
 	LogReturnStatus(entry, status, 2);
 
 	status.return_code = EReturnCode::FILE_READ_ERROR;
 	LogReturnStatus(entry, status, 2);
 
-	snprintf(status.write_fail_dest, sizeof(status.write_fail_dest), "failed_dest");
+	status.detail = "failed_dest";
 	status.return_code = EReturnCode::FILE_WRITE_ERROR;
 	LogReturnStatus(entry, status, 2);
 
+	status.return_code = EReturnCode::FOLDER_READ_ERROR;
+	LogReturnStatus(entry, status, 2);
+
 	status.return_code = EReturnCode::UNKNOWN_ERROR;
 	LogReturnStatus(entry, status, 2);
 }
 }; // namespace testf
 
-int main(int argc, char** argv)
+// Largest output width or height, the most OpenCV's codecs accept
+const uint32_t k_max_output_dimension = 1u << 20;
+
+// Parses "WxH[:suffix][@folder]"
+bool ParseOutputSpec(const std::string& str, SOutputSpec& output_spec)
+{
+	std::string size_str = str;
+
+	const size_t folder_pos = size_str.find('@');
+	if (folder_pos != std::string::npos)
+	{
+		output_spec.output_folder = size_str.substr(folder_pos + 1);
+		size_str.resize(folder_pos);
+		if (output_spec.output_folder.empty())
+		{
+			return false;
+		}
+	}
+
+	const size_t suffix_pos = size_str.find(':');
+	if (suffix_pos != std::string::npos)
+	{
+		output_spec.suffix = size_str.substr(suffix_pos + 1);
+		size_str.resize(suffix_pos);
+		if (output_spec.suffix.empty())
+		{
+			return false;
+		}
+	}
+
+	const size_t separator_pos = size_str.find('x');
+	if (separator_pos == std::string::npos || separator_pos == 0 ||
+	    separator_pos + 1 == size_str.size() ||
+	    size_str.find_first_not_of("0123456789x") != std::string::npos ||
+	    size_str.find('x', separator_pos + 1) != std::string::npos)
+	{
+		return false;
+	}
+
+	// Longer numbers can't be valid sizes, and would overflow stoul
+	if (separator_pos > 7 || size_str.size() - separator_pos - 1 > 7)
+	{
+		return false;
+	}
+	const unsigned long width = std::stoul(size_str.substr(0, separator_pos));
+	const unsigned long height = std::stoul(size_str.substr(separator_pos + 1));
+	if (width > k_max_output_dimension || height > k_max_output_dimension)
+	{
+		return false;
+	}
+
+	output_spec.target_width = (uint32_t)width;
+	output_spec.target_height = (uint32_t)height;
+	return true;
+}
+
+// The benchmark links this file too and brings its own main
+#ifndef IMAGERESIZER_NO_MAIN
+// Parses a byte count with an optional K, M, G or T suffix (powers of 1024), e.g. "24G"
+bool ParseByteSize(const std::string& str, uint64_t& bytes)
 {
-	// This should really be constexpr but for the lack of better tooling
-	// in C++, we'll populate this now.
-	g_ext_lookup_table[".jpg"] = EFileType::IMAGE_JPEG;
-	g_ext_lookup_table[".jpeg"] = EFileType::IMAGE_JPEG;
-	g_ext_lookup_table[".png"] = EFileType::IMAGE_PNG;
+	const size_t digits_end = str.find_first_not_of("0123456789");
+	// Longer numbers can overflow before the suffix is even applied
+	if (digits_end == 0 || str.empty() || std::min(digits_end, str.size()) > 19)
+	{
+		return false;
+	}
+
+	uint32_t shift = 0;
+	if (digits_end != std::string::npos)
+	{
+		if (digits_end + 1 != str.size())
+		{
+			return false;
+		}
+
+		switch (std::toupper((unsigned char)str[digits_end]))
+		{
+		case 'K':
+			shift = 10;
+			break;
+		case 'M':
+			shift = 20;
+			break;
+		case 'G':
+			shift = 30;
+			break;
+		case 'T':
+			shift = 40;
+			break;
+		default:
+			return false;
+		}
+	}
+
+	const uint64_t value = std::stoull(str.substr(0, digits_end));
+	if (value > (UINT64_MAX >> shift))
+	{
+		return false;
+	}
+
+	bytes = value << shift;
+	return true;
+}
 
+int main(int argc, char** argv)
+{
 	// Set-up the parser
 	po::parser parser;
 	SProgramOptions program_options{};
@@ -511,15 +1518,28 @@ int main(int argc, char** argv)
 	        "and adds black borders around the image to make it (target-width, target-height).")
 	    .callback([&program_options]() { program_options.keep_aspect_ratio = 1; });
 
+	uint32_t target_width_value{0};
 	po::option& target_width = parser["target_width"]
 	                               .abbreviation('W')
-	                               .description("(Required)\nTarget width.")
-	                               .bind(program_options.target_width);
+	                               .description("(Required unless --size is used)\nTarget width.")
+	                               .bind(target_width_value);
 
+	uint32_t target_height_value{0};
 	po::option& target_height = parser["target_height"]
 	                                .abbreviation('H')
-	                                .description("(Required)\nTarget height.")
-	                                .bind(program_options.target_height);
+	                                .description("(Required unless --size is used)\nTarget height.")
+	                                .bind(target_height_value);
+
+	std::vector<std::string> size_strs;
+	parser["size"]
+	    .abbreviation('S')
+	    .description("(Optional, can be repeated)\n"
+	                 "Adds an output size as \"WxH[:suffix][@folder]\". Every image is decoded "
+	                 "once and resized to all the sizes given with -S and -W/-H. The suffix is "
+	                 "appended to the output file name, the folder replaces --output-folder for "
+	                 "this size except with --output-format=\"tar\". "
+	                 "e.g. -S 256x256:_thumb -S 1024x768@large")
+	    .bind(size_strs);
 
 	std::string interpolation_str;
 	parser["interpolation"]
@@ -546,7 +1566,14 @@ int main(int argc, char** argv)
 	                     "specified by --output-folder with the naming schema: "
 	                     "%folder%_%image%."
 	                     "\n\"mirror\"  : input folder structure is recreated in the "
-	                     "output directory specified by --output-folder.")
+	                     "output directory specified by --output-folder."
+	                     "\n\"tar\"     : like \"mirror\", but inside tar archives of at most "
+	                     "--shard-images images or --shard-size bytes in the output directory, "
+	                     "each with an index of the offsets of its files."
+	                     "\n\"npy\"     : the pixels are written without encoding into a "
+	                     "(N, H, W, 3) RGB uint8 array per size in the output directory, "
+	                     "images<suffix>.npy, and line i of images<suffix>.txt is the input of "
+	                     "row i.")
 	        .bind(option_output_format_str)
 	        .callback(
 	            [&program_options, &valid_output_format_option](const std::string& output_format) {
@@ -565,6 +1592,18 @@ int main(int argc, char** argv)
 			            valid_output_format_option = true;
 			            program_options.output_format = EOutputFormat::RECREATE_FOLDER_STRUCTURE;
 		            }
+		            else if (output_format == "tar")
+		            {
+			            valid_output_format_option = true;
+			            program_options.output_format = EOutputFormat::TAR_SHARDS;
+		            }
+		            else if (output_format == "npy")
+		            {
+			            valid_output_format_option = true;
+			            program_options.output_format = EOutputFormat::TENSOR;
+			            // Every row of the arrays is 8-bit RGB
+			            program_options.native_layout = 0;
+		            }
 	            });
 
 	po::option& option_output_folder =
@@ -579,6 +1618,153 @@ int main(int argc, char** argv)
 	    .description("(Default = All available threads on CPU)\nSet the number of worker threads.")
 	    .bind(program_options.num_threads);
 
+	std::string schedule_str;
+	po::option& option_schedule =
+	    parser["schedule"]
+	        .description("(Default = \"size\")\n"
+	                     "Order in which the worker threads pick up the files,"
+	                     "\n\"size\" : the largest waiting files first, so that a few large "
+	                     "ones don't hold up the end of the run."
+	                     "\n\"fifo\" : in the order they are found.")
+	        .bind(schedule_str);
+
+	std::string io_backend_str;
+	po::option& option_io_backend =
+	    parser["io-backend"]
+	        .description("(Default = \"pread\", \"stdio\" on Windows)\n"
+	                     "Changes how files are read and written,"
+	                     "\n\"stdio\" : buffered C++ streams."
+	                     "\n\"pread\" : each file is read and written with a single system call."
+	                     "\n\"mmap\"  : inputs are memory mapped and decoded in place."
+	                     "\n\"uring\" : through io_uring, with up to 32 MiB of each file read or "
+	                     "written concurrently in 1 MiB requests. Falls back to \"pread\" if the "
+	                     "kernel or the build doesn't support it.")
+	        .bind(io_backend_str);
+
+	parser["scan-threads"]
+	    .description("(Default = 8)\nNumber of threads listing the input folders. Files are "
+	                 "processed as soon as they are found, while the scan is still running.")
+	    .bind(program_options.scan_threads);
+
+	po::option& option_prefetch =
+	    parser["prefetch"]
+	        .description("(Default = off)\nReads the inputs ahead of the workers in batches of "
+	                     "this many files (at most 4096), and drops them from the page cache once "
+	                     "they are read. Helps on cold disks and network filesystems. With "
+	                     "--schedule=\"size\" the workers don't keep to the order of the reads.")
+	        .bind(program_options.prefetch_window);
+
+	std::string prefetch_order_str;
+	po::option& option_prefetch_order =
+	    parser["prefetch-order"]
+	        .description("(Default = \"inode\")\n"
+	                     "Order in which each --prefetch batch is read and processed,"
+	                     "\n\"found\"  : in the order the files are found."
+	                     "\n\"inode\"  : by inode number, which most filesystems allocate close "
+	                     "to the data."
+	                     "\n\"extent\" : by the position of the data on the disk where the "
+	                     "filesystem reports it, otherwise by inode number.")
+	        .bind(prefetch_order_str);
+
+	parser["input-list"]
+	    .description("(Optional)\nReads the input paths from this file, or from stdin if it is "
+	                 "\"-\", instead of from the arguments. One path per line, optionally followed "
+	                 "by a tab and the output path, which replaces the one from --output-format. "
+	                 "Each line is processed as soon as it is read, and a JSON record with the "
+	                 "result, output paths, dimensions and timing is written to stdout for each.")
+	    .bind(program_options.input_list);
+
+	parser["incremental"]
+	    .description("(Default = off)\nTakes the path of a manifest file that remembers the "
+	                 "processed inputs. Inputs whose size and modification time haven't changed "
+	                 "since they were processed with the same options are skipped. The manifest "
+	                 "is created if it doesn't exist.")
+	    .bind(program_options.manifest_path);
+
+	std::string pipeline_str;
+	po::option& option_pipeline =
+	    parser["pipeline"]
+	        .abbreviation('P')
+	        .description("(Default = off)\n"
+	                     "Process files in separate read, decode, resize, encode and write "
+	                     "stages, each with its own worker threads. Takes the number of workers "
+	                     "per stage as \"read,decode,resize,encode,write\" (0 picks a default), "
+	                     "or \"auto\" to derive all of them from --num_threads.")
+	        .bind(pipeline_str);
+
+	std::string shard_str;
+	po::option& option_shard =
+	    parser["shard"]
+	        .description("(Default = off)\nProcesses only part i of N of the inputs, given as "
+	                     "\"i/N\" with i from 0 to N-1. Inputs are assigned by a hash of their path "
+	                     "relative to the folder argument they are in, or of the path as given, so "
+	                     "N runs with the same arguments on different machines process every input "
+	                     "exactly once. Each run writes its --report, by default to "
+	                     "\"report-iofN.json\" in the output folder, and names its archives and "
+	                     "arrays with the same suffix. Give each run its own --incremental "
+	                     "manifest.")
+	        .bind(shard_str);
+
+	parser["shard-images"]
+	    .description("(Default = 10000)\nMaximum number of images in each archive, only used "
+	                 "with --output-format=\"tar\".")
+	    .bind(program_options.shard_max_images);
+
+	std::string shard_size_str;
+	po::option& option_shard_size =
+	    parser["shard-size"]
+	        .description("(Default = 1G)\nSize after which an archive is closed, e.g. \"512M\", "
+	                     "only used with --output-format=\"tar\".")
+	        .bind(shard_size_str);
+
+	std::string max_memory_str;
+	po::option& option_max_memory =
+	    parser["max-memory"]
+	        .description("(Default = unlimited)\nLimits the memory used by the files being "
+	                     "processed and their decoded and resized images, e.g. \"24G\" or "
+	                     "\"512M\". Image sizes are read from the file headers and files wait "
+	                     "before they are read until they fit, smaller files keep going around a "
+	                     "large one that waits. A quarter of it is left to the buffers the "
+	                     "worker threads keep for reuse.")
+	        .bind(max_memory_str);
+
+	parser["stream-pixels"]
+	    .description("(Default = 268435456)\nInputs with more pixels than this are decoded a few "
+	                 "rows at a time and resized while decoding, so they never have to fit in "
+	                 "memory. Needs a build with libjpeg and libpng, 0 disables it.")
+	    .bind(program_options.stream_pixels);
+
+	std::string dedup_str;
+	po::option& option_dedup =
+	    parser["dedup"]
+	        .description("(Default = off)\nProcesses inputs with identical contents only once. "
+	                     "The outputs of the other copies are made from the outputs of the first "
+	                     "one in the same formats with the given method, or the next one if it "
+	                     "isn't supported,"
+	                     "\n\"hardlink\" : the outputs share the same file, not with "
+	                     "--output-format=\"inplace\"."
+	                     "\n\"reflink\"  : copy-on-write clones, where the filesystem supports "
+	                     "them."
+	                     "\n\"copy\"     : regular copies.")
+	        .bind(dedup_str);
+
+	parser["report"]
+	    .description("(Optional)\nWrites a JSON report to this file at the end of the run, or to "
+	                 "stdout if it is \"-\". It has the time spent in each stage and waiting in "
+	                 "queues (p50/p99/max), byte counts, the number of files per result and the "
+	                 "slowest files.")
+	    .bind(program_options.report_path);
+
+	parser["progress"]
+	    .description("(Default = 0, off)\nPrints a one line JSON progress summary every given "
+	                 "number of seconds.")
+	    .bind(program_options.progress_interval);
+
+	parser["queue-depth"]
+	    .description("(Default = 16)\nMaximum number of files waiting in front of each "
+	                 "pipeline stage, only used with --pipeline.")
+	    .bind(program_options.pipeline_options.queue_depth);
+
 	po::option& help = parser["help"].abbreviation('?').description("Print this help screen");
 
 	if (!parser(argc, argv))
@@ -590,8 +1776,19 @@ int main(int argc, char** argv)
 		return 0;
 	}
 
+	// Keep stdout for the JSON records in --input-list mode
+	std::ostream& info_stream = program_options.input_list.empty() ? std::cout : std::cerr;
+
+	if (!program_options.input_list.empty() && !arg_entries.empty())
+	{
+		std::cout << po::error() << "\'" << po::blue << "input-list";
+		std::cout << "\' can't be combined with input arguments.\n";
+		return -1;
+	}
+
 	// Check target_width & target_height arguments
-	if (!target_width.available() || !target_height.available())
+	if (target_width.available() != target_height.available() ||
+	    (!target_width.available() && size_strs.empty()))
 	{
 		std::cout << po::error() << "\'" << po::blue << "target-width";
 		std::cout << "\' and \'" << po::blue << "target_width";
@@ -599,6 +1796,44 @@ int main(int argc, char** argv)
 		return -1;
 	}
 
+	if (target_width.available())
+	{
+		SOutputSpec output_spec;
+		output_spec.target_width = target_width_value;
+		output_spec.target_height = target_height_value;
+		program_options.outputs.push_back(output_spec);
+	}
+
+	// Parse size arguments
+	for (const std::string& size_str : size_strs)
+	{
+		SOutputSpec output_spec;
+		if (!ParseOutputSpec(size_str, output_spec))
+		{
+			std::cout << po::error() << "\'" << po::blue << "size";
+			std::cout << "\' must look like \"WxH[:suffix][@folder]\" with sizes up to "
+			          << k_max_output_dimension << ", instead got \"" << size_str << "\"\n";
+			return -1;
+		}
+		program_options.outputs.push_back(output_spec);
+	}
+
+	for (const SOutputSpec& output_spec : program_options.outputs)
+	{
+		if (!output_spec.target_width || !output_spec.target_height)
+		{
+			std::cout << po::error() << "target sizes must be larger than zero.\n";
+			return -1;
+		}
+		if (output_spec.target_width > k_max_output_dimension ||
+		    output_spec.target_height > k_max_output_dimension)
+		{
+			std::cout << po::error() << "target sizes must be at most " << k_max_output_dimension
+			          << ".\n";
+			return -1;
+		}
+	}
+
 	// Parse interpolation argument
 	{
 		if (interpolation_str == "cubic")
@@ -634,8 +1869,8 @@ int main(int argc, char** argv)
 	if (!valid_output_format_option)
 	{
 		std::cout << po::error() << "\'" << po::blue << "output-format";
-		std::cout << "\' must be one of \"inplace\", \"flat\" or "
-		             "\"mirror\".\n";
+		std::cout << "\' must be one of \"inplace\", \"flat\", \"mirror\", \"tar\" or "
+		             "\"npy\".\n";
 		if (option_output_format.available())
 		{
 			std::cout << "Instead, got \"" << option_output_format_str << "\"\n";
@@ -659,19 +1894,251 @@ int main(int argc, char** argv)
 			// Make sure output folder exists
 			if (fs::is_directory(program_options.output_folder))
 			{
-				std::cout << "Output folder " << program_options.output_folder
-				          << " already exists.\n";
+				info_stream << "Output folder " << program_options.output_folder
+				            << " already exists.\n";
 			}
 			else
 			{
-				std::cout << "Creating output folder " << program_options.output_folder << "\n";
+				info_stream << "Creating output folder " << program_options.output_folder << "\n";
 				fs::create_directories(program_options.output_folder);
 			}
 		}
 	}
 
+	// Make sure the outputs of different sizes don't overwrite each other
+	for (size_t i = 0; i < program_options.outputs.size(); ++i)
+	{
+		const SOutputSpec& output_spec = program_options.outputs[i];
+		for (size_t j = 0; j < i; ++j)
+		{
+			const SOutputSpec& other_spec = program_options.outputs[j];
+			const bool same_folder =
+			    program_options.output_format == EOutputFormat::INPLACE ||
+			    program_options.output_format == EOutputFormat::TAR_SHARDS ||
+			    output_spec.output_folder == other_spec.output_folder;
+			if (same_folder && output_spec.suffix == other_spec.suffix)
+			{
+				std::cout << po::error() << "outputs of different sizes need a different "
+				          << "suffix or folder, otherwise they overwrite each other.\n";
+				return -1;
+			}
+		}
+
+		if (program_options.output_format != EOutputFormat::INPLACE &&
+		    program_options.output_format != EOutputFormat::TAR_SHARDS &&
+		    !output_spec.output_folder.empty() && !fs::is_directory(output_spec.output_folder))
+		{
+			info_stream << "Creating output folder " << output_spec.output_folder << "\n";
+			fs::create_directories(output_spec.output_folder);
+		}
+	}
+
+	// Parse io-backend argument
+	if (option_io_backend.available())
+	{
+		if (!ParseIoBackend(io_backend_str, program_options.io_backend))
+		{
+			std::cout << po::error() << "\'" << po::blue << "io-backend";
+			std::cout << "\' must be one of \"stdio\", \"pread\", \"mmap\" or \"uring\".\n";
+			return -1;
+		}
+
+		const EIoBackend requested_io_backend = program_options.io_backend;
+		program_options.io_backend = ResolveIoBackend(requested_io_backend);
+		if (program_options.io_backend != requested_io_backend)
+		{
+			info_stream << "I/O backend \"" << IoBackendName(requested_io_backend)
+			            << "\" is not supported here, using \""
+			            << IoBackendName(program_options.io_backend) << "\" instead.\n";
+		}
+	}
+
+	// Parse shard-size argument
+	if (option_shard_size.available())
+	{
+		if (!ParseByteSize(shard_size_str, program_options.shard_max_bytes) ||
+		    !program_options.shard_max_bytes)
+		{
+			std::cout << po::error() << "\'" << po::blue << "shard-size";
+			std::cout << "\' must be a size larger than zero like \"512M\" or \"1G\", instead "
+			          << "got \"" << shard_size_str << "\"\n";
+			return -1;
+		}
+	}
+
+	// Archives and arrays can't be checked or linked like loose output files
+	if ((program_options.output_format == EOutputFormat::TAR_SHARDS ||
+	     program_options.output_format == EOutputFormat::TENSOR) &&
+	    (!program_options.manifest_path.empty() || option_dedup.available()))
+	{
+		std::cout << po::error() << "\'" << po::blue << "incremental";
+		std::cout << "\' and \'" << po::blue << "dedup";
+		std::cout << "\' can't be used with --output-format=\"tar\" or \"npy\".\n";
+		return -1;
+	}
+
+	// Parse max-memory argument
+	if (option_max_memory.available())
+	{
+		if (!ParseByteSize(max_memory_str, program_options.max_memory) ||
+		    !program_options.max_memory)
+		{
+			std::cout << po::error() << "\'" << po::blue << "max-memory";
+			std::cout << "\' must be a size larger than zero like \"512M\" or \"24G\", instead "
+			          << "got \"" << max_memory_str << "\"\n";
+			return -1;
+		}
+	}
+
+	// Parse dedup argument
+	if (option_dedup.available())
+	{
+		if (!ParseCloneMethod(dedup_str, program_options.dedup_method))
+		{
+			std::cout << po::error() << "\'" << po::blue << "dedup";
+			std::cout << "\' must be one of \"hardlink\", \"reflink\" or \"copy\".\n";
+			return -1;
+		}
+
+		// The outputs of inplace runs are the inputs, hardlinking them would turn separate
+		// source files into one that changes everywhere once any of them is edited
+		if (program_options.dedup_method == ECloneMethod::HARDLINK &&
+		    program_options.output_format == EOutputFormat::INPLACE)
+		{
+			std::cout << po::error() << "\'" << po::blue << "dedup";
+			std::cout << "\' can't be \"hardlink\" with --output-format=\"inplace\", use "
+			          << "\"reflink\" or \"copy\".\n";
+			return -1;
+		}
+		program_options.dedup = 1;
+	}
+
+	// Parse schedule argument
+	if (option_schedule.available())
+	{
+		if (schedule_str != "size" && schedule_str != "fifo")
+		{
+			std::cout << po::error() << "\'" << po::blue << "schedule";
+			std::cout << "\' must be \"size\" or \"fifo\", instead got \"" << schedule_str
+			          << "\"\n";
+			return -1;
+		}
+		program_options.schedule_largest_first = schedule_str == "size";
+	}
+
+	// Parse prefetch arguments
+	if (option_prefetch.available() && program_options.prefetch_window > 4096)
+	{
+		std::cout << po::error() << "\'" << po::blue << "prefetch";
+		std::cout << "\' must be at most 4096, instead got " << program_options.prefetch_window
+		          << "\n";
+		return -1;
+	}
+	if (option_prefetch_order.available())
+	{
+		if (prefetch_order_str == "found")
+		{
+			program_options.prefetch_order = EPrefetchOrder::FOUND;
+		}
+		else if (prefetch_order_str == "inode")
+		{
+			program_options.prefetch_order = EPrefetchOrder::INODE;
+		}
+		else if (prefetch_order_str == "extent")
+		{
+			program_options.prefetch_order = EPrefetchOrder::EXTENT;
+		}
+		else
+		{
+			std::cout << po::error() << "\'" << po::blue << "prefetch-order";
+			std::cout << "\' must be \"found\", \"inode\" or \"extent\", instead got \""
+			          << prefetch_order_str << "\"\n";
+			return -1;
+		}
+	}
+
+	// Parse pipeline argument
+	if (option_pipeline.available())
+	{
+		program_options.pipeline = 1;
+
+		if (pipeline_str != "auto")
+		{
+			SPipelineOptions& pipeline_options = program_options.pipeline_options;
+			uint32_t* stage_threads[] = {
+			    &pipeline_options.read_threads, &pipeline_options.decode_threads,
+			    &pipeline_options.resize_threads, &pipeline_options.encode_threads,
+			    &pipeline_options.write_threads};
+
+			std::stringstream stream(pipeline_str);
+			std::string token;
+			size_t num_tokens = 0;
+			bool valid_pipeline_option = true;
+			while (std::getline(stream, token, ','))
+			{
+				if (num_tokens >= std::size(stage_threads) || token.empty() ||
+				    token.find_first_not_of("0123456789") != std::string::npos)
+				{
+					valid_pipeline_option = false;
+					break;
+				}
+				*stage_threads[num_tokens++] = (uint32_t)std::stoul(token);
+			}
+
+			if (!valid_pipeline_option || num_tokens != std::size(stage_threads))
+			{
+				std::cout << po::error() << "\'" << po::blue << "pipeline";
+				std::cout << "\' must be \"auto\" or five comma separated worker counts "
+				             "\"read,decode,resize,encode,write\".\n";
+				return -1;
+			}
+		}
+
+		const uint32_t num_threads = program_options.num_threads > 0
+		                                 ? program_options.num_threads
+		                                 : std::thread::hardware_concurrency();
+		program_options.pipeline_options =
+		    CPipeline::ResolveOptions(program_options.pipeline_options, num_threads);
+	}
+
+	// Parse shard argument
+	if (option_shard.available())
+	{
+		const size_t slash_pos = shard_str.find('/');
+		const std::string index_str = shard_str.substr(0, slash_pos);
+		const std::string count_str =
+		    slash_pos == std::string::npos ? "" : shard_str.substr(slash_pos + 1);
+		const auto is_number = [](const std::string& str) {
+			return !str.empty() && str.size() <= 9 &&
+			       str.find_first_not_of("0123456789") == std::string::npos;
+		};
+
+		if (!is_number(index_str) || !is_number(count_str) ||
+		    std::stoul(index_str) >= std::stoul(count_str))
+		{
+			std::cout << po::error() << "\'" << po::blue << "shard";
+			std::cout << "\' must be \"i/N\" with i from 0 to N-1, e.g. \"0/16\", instead got \""
+			          << shard_str << "\"\n";
+			return -1;
+		}
+		program_options.shard_index = (uint32_t)std::stoul(index_str);
+		program_options.shard_count = (uint32_t)std::stoul(count_str);
+
+		// The summary each run leaves behind, the runs' reports add up to the whole corpus
+		if (program_options.shard_count > 1 && program_options.report_path.empty())
+		{
+			const fs::path report_folder =
+			    program_options.output_format == EOutputFormat::INPLACE
+			        ? fs::path(".")
+			        : fs::path(program_options.output_folder);
+			program_options.report_path =
+			    (report_folder / ("report" + ShardSuffix(program_options) + ".json")).string();
+		}
+	}
+
 	program_options.number_of_input_entries = (uint32_t)arg_entries.size();
 
 	// Do the main processing
 	ProcessEntries(arg_entries, program_options);
 }
+#endif
@@ -3,6 +3,265 @@
 
 #pragma once
 
+#include "ImageResizerTypes.h"
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+class CManifest;
+class CMemoryBudget;
+class CDedupIndex;
+class CTarShardSet;
+class CTensorOutputSet;
+class CStatusLog;
+
+enum class EOutputFormat
+{
+	// Inplace, replace the images with the resized images
+	INPLACE,
+
+	// Given arguments folder1 folder2...
+	// prefixes become:
+	// folderK_X for X in folderK
+	// folderK_subfolderM_X for X in subfolderM in folderK
+	// If only 1 folder is given that folder is not added as a prefix
+	// since it would be common for all images in the output directory
+	FLAT_WITH_PREFIXES,
+
+	// Given arguments folder1 folder2...
+	// Recreate each folder and their subfolders in the output directory
+	// and each image goes to their respective folder
+	// If only 1 folder is given all the images are simply put inside the output
+	// directory.
+	RECREATE_FOLDER_STRUCTURE,
+
+	// Like RECREATE_FOLDER_STRUCTURE, but inside size-bounded tar archives
+	// in the output directory instead of as separate files
+	TAR_SHARDS,
+
+	// The resized pixels of all the images go unencoded into one .npy array
+	// per output size in the output directory, see CTensorOutputSet
+	TENSOR
+};
+
+// How input files are read and output files are written
+enum class EIoBackend
+{
+	// C++ streams, the only backend available everywhere
+	STDIO,
+	// One pread()/write() for the whole file into/from a pooled buffer
+	PREAD,
+	// Inputs are memory mapped and decoded in place, outputs are written like PREAD
+	MMAP,
+	// Like PREAD, but the transfers are submitted through io_uring
+	IO_URING
+};
+
+// Order in which the inputs of a batch are read ahead, see CPrefetcher
+enum class EPrefetchOrder
+{
+	// As they were found
+	FOUND,
+	// By inode number, which most filesystems allocate close to the data
+	INODE,
+	// By the physical position of the first block of data, where the filesystem reports it
+	// (FIEMAP on Linux), otherwise by inode
+	EXTENT
+};
+
+// Ways to give a file the contents of another, cheapest first
+enum class ECloneMethod
+{
+	// Both paths share the same inode
+	HARDLINK,
+	// Copy-on-write copy sharing the data blocks, where the filesystem supports it
+	REFLINK,
+	COPY,
+	FAILED
+};
+
+// Worker counts of each stage when running as a staged pipeline
+struct SPipelineOptions
+{
+	uint32_t read_threads{0};
+	uint32_t decode_threads{0};
+	uint32_t resize_threads{0};
+	uint32_t encode_threads{0};
+	uint32_t write_threads{0};
+	// Maximum number of jobs waiting between two consecutive stages
+	uint32_t queue_depth{16};
+};
+
+struct SProgramOptions : SResizeOptions
+{
+	uint32_t number_of_input_entries{0};
+	EOutputFormat output_format{EOutputFormat::INPLACE};
+	std::string output_folder{""}; // Relevant only if output_format is not INPLACE
+	uint32_t recursive{0};
+	uint32_t verbose{1}; // 0: no logs, 1: errors, 2: errors, warnings and info
+	int32_t num_threads{0};
+	// schedule_largest_first: If 1, the worker threads pick up the largest waiting files
+	// first instead of going in the order they were found (--schedule)
+	uint32_t schedule_largest_first{1};
+#if defined(_WIN32)
+	EIoBackend io_backend{EIoBackend::STDIO};
+#else
+	EIoBackend io_backend{EIoBackend::PREAD};
+#endif
+	// Number of threads listing the input folders
+	uint32_t scan_threads{8};
+	// prefetch_window: If not 0, inputs are read ahead in batches of this many files before
+	// the workers get them, and dropped from the page cache once done (--prefetch)
+	uint32_t prefetch_window{0};
+	EPrefetchOrder prefetch_order{EPrefetchOrder::INODE};
+	// pipeline: If 1, files are processed by CPipeline with a separate
+	// set of workers for each stage instead of one job per file
+	uint32_t pipeline{0};
+	SPipelineOptions pipeline_options{};
+	// manifest_path: If set, inputs that haven't changed since they were
+	// last processed with the same options are skipped (--incremental)
+	std::string manifest_path{""};
+	// Set while ProcessEntries runs if manifest_path is set
+	CManifest* manifest{nullptr};
+	// report_path: If set, a JSON report with timings and totals is written
+	// there at the end of the run, "-" writes it to stdout
+	std::string report_path{""};
+	// input_list: If set, input paths are read line by line from this file, or from stdin
+	// if it is "-", instead of from the arguments. Results are written to stdout as one
+	// JSON record per line.
+	std::string input_list{""};
+	// Seconds between progress lines, 0 disables them
+	uint32_t progress_interval{0};
+	// max_memory: Bytes the jobs and the buffer pools may hold at once, 0 is unlimited
+	uint64_t max_memory{0};
+	// Set while ProcessEntries runs if max_memory is set
+	CMemoryBudget* memory_budget{nullptr};
+	// dedup: If 1, inputs with the same contents are only processed once and the outputs
+	// of the others are cloned with dedup_method, or a cheaper method if it fails (--dedup)
+	uint32_t dedup{0};
+	ECloneMethod dedup_method{ECloneMethod::HARDLINK};
+	// Set while ProcessEntries runs if dedup is set
+	CDedupIndex* dedup_index{nullptr};
+	// Number of images and bytes after which a tar shard is closed, only used
+	// with EOutputFormat::TAR_SHARDS
+	uint32_t shard_max_images{10000};
+	uint64_t shard_max_bytes{1ull << 30};
+	// Set while ProcessEntries runs if output_format is TAR_SHARDS
+	CTarShardSet* tar_shards{nullptr};
+	// Set while ProcessEntries runs if output_format is TENSOR
+	CTensorOutputSet* tensor_outputs{nullptr};
+	// Set while ProcessEntries runs if results are logged, writes them from a single thread
+	CStatusLog* status_log{nullptr};
+	// shard_index, shard_count: Only the inputs whose path hashes to shard_index modulo
+	// shard_count are processed, so independent runs can split a corpus (--shard)
+	uint32_t shard_index{0};
+	uint32_t shard_count{1};
+};
+
+struct SReturnStatus
+{
+	EReturnCode return_code{EReturnCode::UNKNOWN_ERROR};
+	// The unknown extension for FILE_UNKNOWN_EXTENSION, the output that couldn't be
+	// written for FILE_WRITE_ERROR, empty otherwise
+	std::string detail;
+};
+
+struct SJobOutput
+{
+	cv::Mat image_final;
+	// Dimensions of image_final, which is released once it is encoded
+	cv::Size size;
+	std::string output_path;
+	// Encoded contents of the output file
+	ByteBufferPtr encoded_bytes;
+};
+
+// State of a single file as it moves through the processing stages
+struct SImageJob
+{
+	std::string path;
+	// Output path given along with the input in --input-list mode, replaces the one
+	// derived from --output-format
+	std::string output_path{""};
+	EFileType file_type{EFileType::OTHER};
+	// Size and modification time of the input when it was read, the time is only filled
+	// for --incremental
+	uint64_t input_size{0};
+	int64_t input_mtime{0};
+	// Encoded contents of the input file
+	SFileData file_data;
+	// Share of the --max-memory budget, held until the job is done, and the part of it that
+	// is meant for decoding. memory_overrun counts what decoding needed beyond that.
+	std::shared_ptr<void> memory_reservation;
+	uint64_t reserved_decode_bytes{0};
+	std::shared_ptr<void> memory_overrun;
+	// With --dedup: hash of the input contents, whether this job was the first one with
+	// them, and if it wasn't, the input whose outputs were cloned
+	uint64_t content_hash{0};
+	bool dedup_first{false};
+	std::string duplicate_of{""};
+	// Left to the first job with the same contents, which finishes it once it is done
+	bool deferred{false};
+	// The input already matched every output and was copied as it is, see IsPassThrough
+	bool passed_through{false};
+	// Header of the input, read once by the read stage for the stages after it
+	SImageHeader header;
+	bool has_header{false};
+	cv::Mat image;
+	// Dimensions of the input image, before any reduction while decoding
+	uint32_t source_width{0};
+	uint32_t source_height{0};
+	// One for each SProgramOptions::outputs, in the same order
+	std::vector<SJobOutput> outputs;
+	SReturnStatus status{};
+	// When the job was last put in a queue, and the time it spent in stages so far
+	std::chrono::steady_clock::time_point queued_time{};
+	double processing_seconds{0.0};
+};
+
+void LogReturnStatus(const std::string_view entry, const SReturnStatus& status,
+                     uint32_t verbose, std::ostream& stream = std::cout);
+
+// Hash of every option that affects the contents or location of the outputs
+uint64_t HashProgramOptions(const SProgramOptions& program_options);
+
+// Parses an --output value, "WxH[:suffix][@folder]". Sides above 2^20 are rejected.
+bool ParseOutputSpec(const std::string& str, SOutputSpec& output_spec);
+
+bool ReadImageHeader(const std::string_view path, EFileType file_type, SImageHeader& header);
+
+// Whether an input belongs to this run's --shard. relative_path is the input's path relative to
+// the folder argument it was found in, or the path as given for files and input lists.
+bool IsInShard(const fs::path& relative_path, const SProgramOptions& program_options);
+// Appended to the names of the files that each --shard run writes into the shared output
+// folder, e.g. "-3of16", empty without --shard
+std::string ShardSuffix(const SProgramOptions& program_options);
+
+std::string MakeOutputPath(const std::string_view path, std::string output_folder,
+                           EOutputFormat output_format, uint32_t number_of_input_entries);
+std::string MakeOutputPath(const std::string_view path, const SOutputSpec& output_spec,
+                           const SProgramOptions& program_options);
+
+// Processing stages of a single file, in order. Each stage returns false and
+// fills job.status if the job can't continue.
+bool ReadStage(SImageJob& job, const SProgramOptions& program_options);
+bool DecodeStage(SImageJob& job, const SProgramOptions& program_options);
+bool ResizeStage(SImageJob& job, const SProgramOptions& program_options);
+bool EncodeStage(SImageJob& job, const SProgramOptions& program_options);
+bool WriteStage(SImageJob& job, const SProgramOptions& program_options);
 
-// TODO: Reference additional headers your program requires here.
+// Runs all the stages on job, stopping at the first one that fails
+void ProcessJob(SImageJob& job, const SProgramOptions& program_options);
+// Records and reports a job that went through ProcessJob or the pipeline,
+// as a log line or, in --input-list mode, as a JSON record
+void FinishJob(const SImageJob& job, const SProgramOptions& program_options);
+SReturnStatus ProcessFile(const std::string_view path, const SProgramOptions& program_options);
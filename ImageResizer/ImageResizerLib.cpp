@@ -0,0 +1,977 @@
+﻿#include "ImageResizerLib.h"
+#include "BufferPool.h"
+#include "Resampler.h"
+#include "StripDecoder.h"
+
+#include <algorithm>
+#include <cstring>
+#include <istream>
+#include <numeric>
+
+#include <opencv2/imgcodecs.hpp>
+
+namespace
+{
+uint64_t HashMix(uint64_t value)
+{
+	// splitmix64 finalizer
+	value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+	value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+	return value ^ (value >> 31);
+}
+
+uint32_t ReadBigEndian16(const unsigned char* bytes)
+{
+	return ((uint32_t)bytes[0] << 8) | (uint32_t)bytes[1];
+}
+
+uint32_t ReadBigEndian32(const unsigned char* bytes)
+{
+	return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) |
+	       (uint32_t)bytes[3];
+}
+
+// Hashes have to match across platforms, e.g. for --shard, so words are always loaded as
+// little-endian. Compilers turn this into a single load where that is the native order.
+uint64_t ReadLittleEndian64(const unsigned char* bytes)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < 8; ++i)
+	{
+		value |= (uint64_t)bytes[i] << (8 * i);
+	}
+	return value;
+}
+
+bool ReadPngHeader(std::istream& stream, SImageHeader& header)
+{
+	// 8 byte signature, followed by the IHDR chunk which is required to come first
+	unsigned char bytes[8 + 8 + 13];
+	if (!stream.read((char*)bytes, sizeof(bytes)))
+	{
+		return false;
+	}
+
+	static const unsigned char png_signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	if (memcmp(bytes, png_signature, sizeof(png_signature)) != 0 ||
+	    memcmp(bytes + 12, "IHDR", 4) != 0)
+	{
+		return false;
+	}
+
+	header.width = ReadBigEndian32(bytes + 16);
+	header.height = ReadBigEndian32(bytes + 20);
+	header.bit_depth = bytes[24];
+
+	switch (bytes[25])
+	{
+	case 0: // Grayscale
+		header.channels = 1;
+		break;
+	case 4: // Grayscale + alpha
+		header.channels = 2;
+		break;
+	case 6: // RGBA
+		header.channels = 4;
+		break;
+	case 2: // RGB
+	case 3: // Palette
+	default:
+		header.channels = 3;
+		break;
+	}
+
+	return header.width > 0 && header.height > 0;
+}
+
+bool ReadJpegHeader(std::istream& stream, SImageHeader& header)
+{
+	unsigned char bytes[8];
+	if (!stream.read((char*)bytes, 2) || bytes[0] != 0xFF || bytes[1] != 0xD8)
+	{
+		return false;
+	}
+
+	// Walk the marker segments until we hit a start of frame (SOFn) marker,
+	// segments in between (ICC profiles, ...) are skipped without being read, except EXIF
+	while (stream)
+	{
+		int marker = stream.get();
+		if (marker != 0xFF)
+		{
+			return false;
+		}
+
+		// Any number of 0xFF fill bytes may precede the marker code
+		while (marker == 0xFF)
+		{
+			marker = stream.get();
+		}
+
+		if (marker == EOF || marker == 0xD9 || marker == 0xDA)
+		{
+			// End of image or start of scan before any frame header
+			return false;
+		}
+
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+		{
+			// Standalone markers without a length field
+			continue;
+		}
+
+		if (!stream.read((char*)bytes, 2))
+		{
+			return false;
+		}
+
+		const uint32_t segment_length = ReadBigEndian16(bytes);
+		if (segment_length < 2)
+		{
+			return false;
+		}
+
+		const bool is_sof = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+		                    marker != 0xC8 && marker != 0xCC;
+		if (marker == 0xE1 && segment_length > 2 + 6)
+		{
+			// APP1, EXIF if it starts with "Exif\0\0". imdecode rotates by its orientation.
+			std::vector<unsigned char> segment(segment_length - 2);
+			if (!stream.read((char*)segment.data(), segment.size()))
+			{
+				return false;
+			}
+			if (memcmp(segment.data(), "Exif\0\0", 6) == 0)
+			{
+				header.orientation =
+				    (uint32_t)ParseExifOrientation(segment.data() + 6, segment.size() - 6);
+			}
+			continue;
+		}
+
+		if (!is_sof)
+		{
+			stream.seekg(segment_length - 2, std::ios::cur);
+			continue;
+		}
+
+		// precision(1) height(2) width(2) components(1)
+		if (segment_length < 8 || !stream.read((char*)bytes, 6))
+		{
+			return false;
+		}
+
+		header.bit_depth = bytes[0];
+		header.height = ReadBigEndian16(bytes + 1);
+		header.width = ReadBigEndian16(bytes + 3);
+		header.channels = bytes[5];
+
+		return header.width > 0 && header.height > 0;
+	}
+
+	return false;
+}
+
+// Read-only, seekable std::streambuf over a memory block so the header
+// parsers can run on files that are already in memory
+class CMemoryStreamBuf : public std::streambuf
+{
+public:
+	CMemoryStreamBuf(const unsigned char* data, size_t size)
+	{
+		char* begin = (char*)data;
+		setg(begin, begin, begin + size);
+	}
+
+protected:
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+	                 std::ios_base::openmode which = std::ios_base::in) override
+	{
+		char* base = eback();
+		if (dir == std::ios_base::cur)
+		{
+			base = gptr();
+		}
+		else if (dir == std::ios_base::end)
+		{
+			base = egptr();
+		}
+
+		char* target = base + off;
+		if (!(which & std::ios_base::in) || target < eback() || target > egptr())
+		{
+			return pos_type(off_type(-1));
+		}
+
+		setg(eback(), target, egptr());
+		return pos_type(target - eback());
+	}
+
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which = std::ios_base::in) override
+	{
+		return seekoff(off_type(pos), std::ios_base::beg, which);
+	}
+};
+
+// Type imdecode gives an image with the flags of ImreadFlags. Palette PNGs with transparency
+// are guessed wrong, that costs a reallocation and a few bytes of the memory estimate.
+int DecodedType(EFileType file_type, const SImageHeader& header,
+                const SResizeOptions& resize_options)
+{
+	if (!resize_options.native_layout)
+	{
+		return CV_8UC3;
+	}
+
+	if (file_type == EFileType::IMAGE_JPEG)
+	{
+		return header.channels == 1 ? CV_8UC1 : CV_8UC3;
+	}
+
+	// Like IMREAD_UNCHANGED, which turns grayscale with alpha into BGRA
+	const int depth = header.bit_depth == 16 ? CV_16U : CV_8U;
+	switch (header.channels)
+	{
+	case 1:
+		return CV_MAKETYPE(depth, 1);
+	case 2:
+	case 4:
+		return CV_MAKETYPE(depth, 4);
+	default:
+		return CV_MAKETYPE(depth, 3);
+	}
+}
+
+// Estimated peak memory of a job: the decoded image, plus each output's final image and
+// encode buffer, which is reserved at the raw pixel size
+uint64_t EstimateJobMemory(const SImageHeader& header, int reduction, int type,
+                           const SResizeOptions& resize_options)
+{
+	const uint64_t decoded_width = (header.width + reduction - 1) / reduction;
+	const uint64_t decoded_height = (header.height + reduction - 1) / reduction;
+	const uint64_t pixel_size = CV_ELEM_SIZE(type);
+	uint64_t bytes = decoded_width * decoded_height * pixel_size;
+
+	for (const SOutputSpec& output_spec : resize_options.outputs)
+	{
+		bytes += 2 * (uint64_t)output_spec.target_width * output_spec.target_height * pixel_size;
+	}
+
+	return bytes;
+}
+
+// Rows decoded at once when an input is decoded in strips
+const int k_strip_rows = 16;
+
+// Peak memory of a job decoded in strips of 8-bit pixels: a strip, and each output's final
+// image and encode buffer. The resamplers' filtered rows are small enough to be left out.
+uint64_t EstimateStripJobMemory(int width, int channels, const SResizeOptions& resize_options)
+{
+	const uint64_t pixel_size = channels;
+	uint64_t bytes = (uint64_t)k_strip_rows * width * pixel_size;
+
+	for (const SOutputSpec& output_spec : resize_options.outputs)
+	{
+		bytes += 2 * (uint64_t)output_spec.target_width * output_spec.target_height * pixel_size;
+	}
+
+	return bytes;
+}
+
+// True if an image is too large to decode whole and has to be resized while it is decoded
+bool IsStreamed(const SImageHeader& header, int reduction, const SResizeOptions& resize_options)
+{
+	const uint64_t decoded_pixels = (uint64_t)((header.width + reduction - 1) / reduction) *
+	                                ((header.height + reduction - 1) / reduction);
+	return resize_options.stream_pixels && decoded_pixels > resize_options.stream_pixels;
+}
+
+// Flags that make imdecode keep the layout of the file if resize_options.native_layout is
+// set: grayscale JPEGs stay grayscale, PNGs keep their alpha and 16 bit depth. JPEGs are
+// reduced by 1/reduction while decoding.
+int ImreadFlags(EFileType file_type, const SImageHeader& header, int reduction,
+                const SResizeOptions& resize_options)
+{
+	if (resize_options.native_layout && file_type == EFileType::IMAGE_PNG)
+	{
+		return cv::IMREAD_UNCHANGED;
+	}
+
+	if (resize_options.native_layout && header.channels == 1)
+	{
+		switch (reduction)
+		{
+		case 2:
+			return cv::IMREAD_REDUCED_GRAYSCALE_2;
+		case 4:
+			return cv::IMREAD_REDUCED_GRAYSCALE_4;
+		case 8:
+			return cv::IMREAD_REDUCED_GRAYSCALE_8;
+		default:
+			return cv::IMREAD_GRAYSCALE;
+		}
+	}
+
+	switch (reduction)
+	{
+	case 2:
+		return cv::IMREAD_REDUCED_COLOR_2;
+	case 4:
+		return cv::IMREAD_REDUCED_COLOR_4;
+	case 8:
+		return cv::IMREAD_REDUCED_COLOR_8;
+	default:
+		// Files without a readable header: keep grayscale and color as they are, and still
+		// apply the EXIF orientation, which IMREAD_UNCHANGED wouldn't
+		return resize_options.native_layout && !header.channels ? cv::IMREAD_ANYCOLOR
+		                                                        : cv::IMREAD_COLOR;
+	}
+}
+
+// Black, and opaque if there is an alpha channel
+cv::Scalar BorderColor(int type)
+{
+	if (CV_MAT_CN(type) == 4)
+	{
+		return cv::Scalar(0, 0, 0, CV_MAT_DEPTH(type) == CV_16U ? 65535 : 255);
+	}
+	return cv::Scalar::all(0);
+}
+
+// Allocates the final image of one output and clears its padding if the aspect ratio is
+// kept. Returns the region of image_final the image resized to real_size goes into.
+cv::Mat PrepareOutput(cv::Size real_size, const SOutputSpec& output_spec,
+                      const SResizeOptions& resize_options, int type, cv::Mat& image_final)
+{
+	const int target_width = (int)output_spec.target_width;
+	const int target_height = (int)output_spec.target_height;
+
+	image_final = AcquirePooledMat(resize_options.buffer_pools, target_height, target_width, type);
+
+	if (resize_options.keep_aspect_ratio)
+	{
+		// Calculate padding
+		const int top_margin = (target_height - real_size.height) / 2;
+		const int bottom_margin = target_height - real_size.height - top_margin;
+		const int left_margin = (target_width - real_size.width) / 2;
+		const int right_margin = target_width - real_size.width - left_margin;
+
+		// Only clear the padding, the interior is overwritten by the resize anyway
+		const cv::Scalar border_color = BorderColor(type);
+		image_final.rowRange(0, top_margin).setTo(border_color);
+		image_final.rowRange(target_height - bottom_margin, target_height).setTo(border_color);
+		cv::Mat middle_rows = image_final.rowRange(top_margin, top_margin + real_size.height);
+		middle_rows.colRange(0, left_margin).setTo(border_color);
+		middle_rows.colRange(target_width - right_margin, target_width).setTo(border_color);
+
+		// Resize straight into the interior of the padded image
+		return middle_rows.colRange(left_margin, left_margin + real_size.width);
+	}
+
+	return image_final;
+}
+
+// Source rows the filter reads beyond those the destination row covers
+int FilterReach(int interpolation, bool downscale)
+{
+	switch (interpolation)
+	{
+	case cv::INTER_NEAREST:
+		return 0;
+	case cv::INTER_AREA:
+		// Averages whole cells when shrinking, interpolates linearly otherwise
+		return downscale ? 0 : 1;
+	case cv::INTER_LINEAR:
+		return 1;
+	case cv::INTER_CUBIC:
+		return 2;
+	default:
+		return 4;
+	}
+}
+
+// Resizes src into dst, split into bands of rows run through resize_options.parallel_for.
+// Band boundaries sit where a destination row boundary maps exactly onto a source row
+// boundary, i.e. on multiples of dst.rows / gcd(src.rows, dst.rows) rows, so every band
+// samples the source at the same positions as a single cv::resize would. Filters that read
+// past their rows get a margin of extra rows that is resized and thrown away.
+void ResizeInBands(const cv::Mat& src, cv::Mat& dst, const SResizeOptions& resize_options)
+{
+	// Splitting doesn't pay off for less than this many destination rows per band
+	const int k_min_band_rows = 32;
+
+	// The image is made of num_blocks blocks of block_dst_rows rows, each resized from
+	// block_src_rows rows
+	const int num_blocks = std::gcd(src.rows, dst.rows);
+	const int block_src_rows = src.rows / num_blocks;
+	const int block_dst_rows = dst.rows / num_blocks;
+	const int min_band_blocks = std::max(k_min_band_rows / block_dst_rows, 1);
+	if (!resize_options.parallel_for || num_blocks < 2 * min_band_blocks)
+	{
+		cv::resize(src, dst, dst.size(), 0, 0, resize_options.interpolation);
+		return;
+	}
+
+	const bool downscale = src.cols >= dst.cols && src.rows >= dst.rows;
+	const int reach = FilterReach(resize_options.interpolation, downscale);
+	const int margin_blocks = reach > 0 ? (reach + block_src_rows) / block_src_rows : 0;
+
+	resize_options.parallel_for(num_blocks, min_band_blocks, [&](int begin, int end) {
+		cv::Mat dst_band = dst.rowRange(begin * block_dst_rows, end * block_dst_rows);
+		const int margin_begin = std::max(begin - margin_blocks, 0);
+		const int margin_end = std::min(end + margin_blocks, num_blocks);
+		const cv::Mat src_band =
+		    src.rowRange(margin_begin * block_src_rows, margin_end * block_src_rows);
+		if (margin_begin == begin && margin_end == end)
+		{
+			// Written straight into the band, it already has the right size and type
+			cv::resize(src_band, dst_band, dst_band.size(), 0, 0, resize_options.interpolation);
+			return;
+		}
+
+		cv::Mat resized;
+		cv::resize(src_band, resized,
+		           cv::Size(dst.cols, (margin_end - margin_begin) * block_dst_rows), 0, 0,
+		           resize_options.interpolation);
+		resized
+		    .rowRange((begin - margin_begin) * block_dst_rows, (end - margin_begin) * block_dst_rows)
+		    .copyTo(dst_band);
+	});
+}
+
+// Resizes src to the size of one output, padding it if the aspect ratio is kept.
+// image_scaled receives the resized image before padding.
+void ResizeToOutput(const cv::Mat& src, cv::Size real_size, const SOutputSpec& output_spec,
+                    const SResizeOptions& resize_options, cv::Mat& image_scaled,
+                    cv::Mat& image_final)
+{
+	image_scaled = PrepareOutput(real_size, output_spec, resize_options, src.type(), image_final);
+
+	// cv::resize reuses image_scaled since it already has the requested size and type, so
+	// letterboxed outputs are written straight into the interior of the padded image
+	ResizeInBands(src, image_scaled, resize_options);
+}
+
+// Decodes an input strip by strip and feeds every row straight to a CStreamingResampler
+// for each output, so only a strip and the few rows the filters need are ever in memory
+bool DecodeAndResizeStrips(CStripDecoder& strip_decoder, const SResizeOptions& resize_options,
+                           std::vector<cv::Mat>& images_final)
+{
+	// Outputs are resized as the image is stored and oriented afterwards, like imdecode does
+	const int orientation = strip_decoder.Orientation();
+	const bool swap_axes = orientation >= 5;
+	const int oriented_width = swap_axes ? strip_decoder.Height() : strip_decoder.Width();
+	const int oriented_height = swap_axes ? strip_decoder.Width() : strip_decoder.Height();
+
+	const int type = CV_8UC(strip_decoder.Channels());
+	const size_t num_outputs = resize_options.outputs.size();
+	std::vector<cv::Mat> images_scaled(num_outputs);
+	std::vector<cv::Mat> images_stored(num_outputs);
+	std::vector<CStreamingResampler> resamplers;
+	resamplers.reserve(num_outputs);
+	images_final.resize(num_outputs);
+
+	for (size_t i = 0; i < num_outputs; ++i)
+	{
+		const SOutputSpec& output_spec = resize_options.outputs[i];
+		const cv::Size real_size =
+		    resize_options.keep_aspect_ratio
+		        ? FitAspectRatio(oriented_width, oriented_height, output_spec.target_width,
+		                         output_spec.target_height)
+		        : cv::Size(output_spec.target_width, output_spec.target_height);
+
+		images_scaled[i] =
+		    PrepareOutput(real_size, output_spec, resize_options, type, images_final[i]);
+
+		images_stored[i] = orientation == 1
+		                       ? images_scaled[i]
+		                       : AcquirePooledMat(resize_options.buffer_pools, 
+		                             swap_axes ? real_size.width : real_size.height,
+		                             swap_axes ? real_size.height : real_size.width, type);
+		resamplers.emplace_back(strip_decoder.Width(), strip_decoder.Height(), images_stored[i],
+		                        resize_options.interpolation);
+	}
+
+	cv::Mat strip =
+	    AcquirePooledMat(resize_options.buffer_pools, k_strip_rows, strip_decoder.Width(), type);
+	int num_rows = 0;
+	while ((num_rows = strip_decoder.ReadRows(strip)) > 0)
+	{
+		for (int y = 0; y < num_rows; ++y)
+		{
+			for (CStreamingResampler& resampler : resamplers)
+			{
+				resampler.PushRow(strip.ptr<uchar>(y));
+			}
+		}
+	}
+
+	for (const CStreamingResampler& resampler : resamplers)
+	{
+		if (!resampler.Finished())
+		{
+			images_final.clear();
+			return false;
+		}
+	}
+
+	if (orientation != 1)
+	{
+		for (size_t i = 0; i < num_outputs; ++i)
+		{
+			ApplyExifOrientation(images_stored[i], orientation, images_scaled[i]);
+		}
+	}
+
+	return true;
+}
+} // namespace
+
+uint64_t HashBytes(const void* data, size_t size, uint64_t seed)
+{
+	const uint64_t k_multiplier = 0x9E3779B97F4A7C15ull;
+	const unsigned char* bytes = (const unsigned char*)data;
+
+	// Four independent lanes so the multiplies of consecutive words can overlap
+	uint64_t lanes[4] = {seed, seed + k_multiplier, seed - k_multiplier, ~seed};
+	while (size >= sizeof(lanes))
+	{
+		for (uint64_t& lane : lanes)
+		{
+			const uint64_t word = ReadLittleEndian64(bytes);
+			lane = (lane ^ word) * k_multiplier;
+			lane ^= lane >> 29;
+			bytes += sizeof(word);
+		}
+		size -= sizeof(lanes);
+	}
+
+	uint64_t hash = HashMix(lanes[0]) ^ HashMix(lanes[1] + 1) ^ HashMix(lanes[2] + 2) ^
+	                HashMix(lanes[3] + 3);
+
+	for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), bytes += sizeof(uint64_t))
+	{
+		hash = HashMix(hash ^ ReadLittleEndian64(bytes));
+	}
+
+	uint64_t tail = 0;
+	for (size_t i = 0; i < size; ++i)
+	{
+		tail |= (uint64_t)bytes[i] << (8 * i);
+	}
+	return HashMix(hash ^ tail ^ ((uint64_t)size << 56));
+}
+
+cv::Size FitAspectRatio(int org_width, int org_height, int target_width, int target_height)
+{
+	cv::Size real_size;
+
+	const int l = org_width * target_height;
+	const int r = org_height * target_width;
+
+	// Figure out the correct aspect ratio
+	float scale_factor;
+	if (l > r)
+	{
+		// Wider
+		scale_factor = (float)target_width / org_width;
+		real_size.height = (int)(org_height * scale_factor);
+		real_size.width = target_width;
+	}
+	else if (l < r)
+	{
+		// Taller
+		scale_factor = (float)target_height / org_height;
+		real_size.width = (int)(org_width * scale_factor);
+		real_size.height = target_height;
+	}
+	else
+	{
+		// Equal
+		scale_factor = (float)target_height / org_height;
+		real_size.width = target_width;
+		real_size.height = target_height;
+	}
+
+	return real_size;
+}
+
+int ParseExifOrientation(const unsigned char* tiff, size_t size)
+{
+	if (size < 8 || (memcmp(tiff, "II", 2) != 0 && memcmp(tiff, "MM", 2) != 0))
+	{
+		return 1;
+	}
+
+	const bool little_endian = tiff[0] == 'I';
+	const auto read16 = [tiff, little_endian](size_t offset) {
+		return little_endian ? (uint32_t)(tiff[offset] | tiff[offset + 1] << 8)
+		                     : (uint32_t)(tiff[offset] << 8 | tiff[offset + 1]);
+	};
+	const auto read32 = [&read16, little_endian](size_t offset) {
+		return little_endian ? read16(offset) | read16(offset + 2) << 16
+		                     : read16(offset) << 16 | read16(offset + 2);
+	};
+
+	const size_t ifd_offset = read32(4);
+	if (ifd_offset + 2 > size)
+	{
+		return 1;
+	}
+
+	const uint32_t num_entries = read16(ifd_offset);
+	for (uint32_t i = 0; i < num_entries; ++i)
+	{
+		const size_t entry = ifd_offset + 2 + i * 12;
+		if (entry + 12 > size)
+		{
+			break;
+		}
+		if (read16(entry) == 0x0112)
+		{
+			const uint32_t orientation = read16(entry + 8);
+			return orientation >= 1 && orientation <= 8 ? (int)orientation : 1;
+		}
+	}
+
+	return 1;
+}
+
+bool ReadImageHeader(std::istream& stream, EFileType file_type, SImageHeader& header)
+{
+	switch (file_type)
+	{
+	case EFileType::IMAGE_JPEG:
+		return ReadJpegHeader(stream, header);
+	case EFileType::IMAGE_PNG:
+		return ReadPngHeader(stream, header);
+	case EFileType::OTHER:
+	default:
+		return false;
+	}
+}
+
+bool ReadImageHeader(const unsigned char* data, size_t size, EFileType file_type,
+                     SImageHeader& header)
+{
+	CMemoryStreamBuf stream_buf(data, size);
+	std::istream stream(&stream_buf);
+	return ReadImageHeader(stream, file_type, header);
+}
+
+// JPEG can be decoded directly at 1/2, 1/4 or 1/8 of its size by libjpeg's DCT scaling, which
+// is a lot cheaper than decoding the full image. Picks the largest such factor that still
+// leaves the decoded image at least as large as what the largest output needs, so the final
+// resize always downsamples from less than twice the target size.
+int ChooseJpegReduction(const SImageHeader& header, const SResizeOptions& resize_options)
+{
+	const auto largest_reduction = [&resize_options](uint32_t width, uint32_t height,
+	                                                 const SOutputSpec& output_spec) {
+		uint32_t needed_width = output_spec.target_width;
+		uint32_t needed_height = output_spec.target_height;
+
+		if (resize_options.keep_aspect_ratio)
+		{
+			const cv::Size real_size =
+			    FitAspectRatio(width, height, needed_width, needed_height);
+			needed_width = real_size.width;
+			needed_height = real_size.height;
+		}
+
+		for (int reduction : {8, 4, 2})
+		{
+			// libjpeg rounds the scaled dimensions up
+			const uint32_t reduced_width = (width + reduction - 1) / reduction;
+			const uint32_t reduced_height = (height + reduction - 1) / reduction;
+
+			if (reduced_width >= needed_width && reduced_height >= needed_height)
+			{
+				return reduction;
+			}
+		}
+
+		return 1;
+	};
+
+	int reduction = 8;
+	for (const SOutputSpec& output_spec : resize_options.outputs)
+	{
+		// EXIF orientation is applied after decoding and may swap the axes,
+		// so the reduction has to be safe for both orientations
+		reduction = std::min(reduction, largest_reduction(header.width, header.height, output_spec));
+		reduction = std::min(reduction, largest_reduction(header.height, header.width, output_spec));
+	}
+
+	return reduction;
+}
+
+bool IsPassThrough(const SImageHeader& header, const SResizeOptions& resize_options)
+{
+	if (!resize_options.native_layout || header.orientation != 1 ||
+	    resize_options.outputs.empty())
+	{
+		return false;
+	}
+
+	// Same size means no padding either, whether the aspect ratio is kept or not
+	for (const SOutputSpec& output_spec : resize_options.outputs)
+	{
+		if (output_spec.target_width != header.width ||
+		    output_spec.target_height != header.height)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+EFileType FileTypeFromExtension(const std::string& extension)
+{
+	if (extension == ".jpg" || extension == ".jpeg")
+	{
+		return EFileType::IMAGE_JPEG;
+	}
+	if (extension == ".png")
+	{
+		return EFileType::IMAGE_PNG;
+	}
+	return EFileType::OTHER;
+}
+
+EFileType DetectFileType(const unsigned char* data, size_t size)
+{
+	static const unsigned char k_png_signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+
+	if (size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF)
+	{
+		return EFileType::IMAGE_JPEG;
+	}
+	if (size >= sizeof(k_png_signature) &&
+	    memcmp(data, k_png_signature, sizeof(k_png_signature)) == 0)
+	{
+		return EFileType::IMAGE_PNG;
+	}
+	return EFileType::OTHER;
+}
+
+uint64_t EstimateDecodeMemory(const SImageHeader& header, EFileType file_type,
+                              const SResizeOptions& resize_options)
+{
+	const int reduction =
+	    file_type == EFileType::IMAGE_JPEG ? ChooseJpegReduction(header, resize_options) : 1;
+	const int decoded_type = DecodedType(file_type, header, resize_options);
+
+	// Same choice as DecodeImage, assuming the strip decoder accepts the file
+	if (CStripDecoder::IsAvailable(file_type) && IsStreamed(header, reduction, resize_options))
+	{
+		return EstimateStripJobMemory((int)((header.width + reduction - 1) / reduction),
+		                              CV_MAT_CN(decoded_type), resize_options);
+	}
+
+	return EstimateJobMemory(header, reduction, decoded_type, resize_options);
+}
+
+EReturnCode DecodeImage(const unsigned char* data, size_t size, EFileType file_type,
+                        const SResizeOptions& resize_options, const ReserveMemoryFn& reserve_memory,
+                        cv::Mat& image, std::vector<cv::Mat>& images_final, SImageHeader& header,
+                        const SImageHeader* file_header)
+{
+	cv::Mat decoded;
+	if (file_header)
+	{
+		header = *file_header;
+	}
+	const bool has_header = file_header || ReadImageHeader(data, size, file_type, header);
+	if (!has_header)
+	{
+		header = SImageHeader();
+	}
+
+	// Decode JPEGs at a reduced resolution if the target is much smaller than the source
+	int reduction = 1;
+	if (has_header && file_type == EFileType::IMAGE_JPEG)
+	{
+		reduction = ChooseJpegReduction(header, resize_options);
+	}
+	const int imread_flags = ImreadFlags(file_type, header, reduction, resize_options);
+
+	if (has_header)
+	{
+		// Images too large to hold in memory are resized while they are decoded, if the
+		// decoder can give out their rows one strip at a time
+		if (IsStreamed(header, reduction, resize_options))
+		{
+			SFileData file_data;
+			file_data.data = data;
+			file_data.size = size;
+			std::unique_ptr<CStripDecoder> strip_decoder = CStripDecoder::Create(
+			    file_data, file_type, reduction, resize_options.native_layout != 0);
+			if (strip_decoder)
+			{
+				if (reserve_memory)
+				{
+					reserve_memory(EstimateStripJobMemory(strip_decoder->Width(),
+					                                      strip_decoder->Channels(),
+					                                      resize_options));
+				}
+
+				return DecodeAndResizeStrips(*strip_decoder, resize_options, images_final)
+				           ? EReturnCode::OK
+				           : EReturnCode::FILE_READ_ERROR;
+			}
+		}
+
+		// Files without a readable header are decoded right away without a reservation,
+		// imdecode rejects most of them anyway
+		const int decoded_type = DecodedType(file_type, header, resize_options);
+		if (reserve_memory)
+		{
+			reserve_memory(EstimateJobMemory(header, reduction, decoded_type, resize_options));
+		}
+
+		// Decode straight into a pooled buffer, the header tells us what the decoder will
+		// allocate. If it turns out wrong (e.g. EXIF rotation) imdecode just reallocates.
+		decoded = AcquirePooledMat(resize_options.buffer_pools, 
+		    (int)((header.height + reduction - 1) / reduction),
+		    (int)((header.width + reduction - 1) / reduction), decoded_type);
+	}
+
+	// Decode straight from the caller's buffer, without copying it
+	const cv::Mat encoded(1, (int)size, CV_8U, (void*)data);
+	image = cv::imdecode(encoded, imread_flags, &decoded);
+	if (!header.width)
+	{
+		header.width = (uint32_t)image.cols;
+		header.height = (uint32_t)image.rows;
+	}
+
+	return image.data ? EReturnCode::OK : EReturnCode::FILE_READ_ERROR;
+}
+
+void ResizeImage(const cv::Mat& image, const SResizeOptions& resize_options,
+                 std::vector<cv::Mat>& images_final)
+{
+	const size_t num_outputs = resize_options.outputs.size();
+
+	// Size of each output before padding
+	std::vector<cv::Size> real_sizes(num_outputs);
+	for (size_t i = 0; i < num_outputs; ++i)
+	{
+		const SOutputSpec& output_spec = resize_options.outputs[i];
+		real_sizes[i] = resize_options.keep_aspect_ratio
+		                    ? FitAspectRatio(image.cols, image.rows, output_spec.target_width,
+		                                     output_spec.target_height)
+		                    : cv::Size(output_spec.target_width, output_spec.target_height);
+	}
+
+	// Produce the largest outputs first, so the smaller ones can be cascaded from them
+	std::vector<size_t> order(num_outputs);
+	for (size_t i = 0; i < num_outputs; ++i)
+	{
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [&real_sizes](size_t a, size_t b) {
+		return real_sizes[a].area() > real_sizes[b].area();
+	});
+
+	// Resizing from an already downscaled image is only indistinguishable from resizing the
+	// original if the intermediate has plenty of samples left. Nearest neighbour just picks
+	// pixels, so any intermediate that isn't smaller than the output will do.
+	const int min_cascade_ratio =
+	    resize_options.interpolation == cv::InterpolationFlags::INTER_NEAREST ? 1 : 2;
+
+	std::vector<cv::Mat> images_scaled(num_outputs);
+	images_final.resize(num_outputs);
+
+	for (size_t n = 0; n < num_outputs; ++n)
+	{
+		const size_t i = order[n];
+		const cv::Size real_size = real_sizes[i];
+
+		// Smallest already produced image that is still large enough to cascade from
+		const cv::Mat* src = &image;
+		for (size_t m = 0; m < n; ++m)
+		{
+			const cv::Mat& candidate = images_scaled[order[m]];
+			if (candidate.cols >= real_size.width * min_cascade_ratio &&
+			    candidate.rows >= real_size.height * min_cascade_ratio &&
+			    candidate.total() < src->total())
+			{
+				src = &candidate;
+			}
+		}
+
+		ResizeToOutput(*src, real_size, resize_options.outputs[i], resize_options,
+		               images_scaled[i], images_final[i]);
+	}
+}
+
+bool EncodeImage(const cv::Mat& image, const std::string& extension, ByteBuffer& encoded)
+{
+	try
+	{
+		// Other encoders would clip 16 bit images to 8 bit instead of scaling them
+		if (image.depth() == CV_16U && extension != ".png" && extension != ".tif" &&
+		    extension != ".tiff")
+		{
+			cv::Mat image_8bit;
+			image.convertTo(image_8bit, CV_8U, 1.0 / 257);
+			return cv::imencode(extension, image_8bit, encoded);
+		}
+
+		return cv::imencode(extension, image, encoded);
+	}
+	catch (const cv::Exception&)
+	{
+		return false;
+	}
+}
+
+EReturnCode ResizeEncodedImage(const unsigned char* data, size_t size,
+                               const SResizeOptions& resize_options,
+                               std::vector<cv::Mat>& images_final)
+{
+	images_final.clear();
+
+	cv::Mat image;
+	SImageHeader header;
+	const EReturnCode return_code = DecodeImage(data, size, DetectFileType(data, size),
+	                                            resize_options, nullptr, image, images_final,
+	                                            header);
+	if (return_code != EReturnCode::OK)
+	{
+		return return_code;
+	}
+
+	// Inputs decoded in strips were already resized while decoding
+	if (images_final.empty())
+	{
+		ResizeImage(image, resize_options, images_final);
+	}
+
+	return EReturnCode::OK;
+}
+
+EReturnCode ResizeEncodedImage(const unsigned char* data, size_t size,
+                               const SResizeOptions& resize_options, const std::string& extension,
+                               std::vector<ByteBuffer>& encoded_outputs)
+{
+	std::vector<cv::Mat> images_final;
+	const EReturnCode return_code = ResizeEncodedImage(data, size, resize_options, images_final);
+	if (return_code != EReturnCode::OK)
+	{
+		return return_code;
+	}
+
+	encoded_outputs.resize(images_final.size());
+	for (size_t i = 0; i < images_final.size(); ++i)
+	{
+		if (!EncodeImage(images_final[i], extension, encoded_outputs[i]))
+		{
+			return EReturnCode::FILE_WRITE_ERROR;
+		}
+	}
+
+	return EReturnCode::OK;
+}
@@ -0,0 +1,84 @@
+﻿// ImageResizerLib.h : Decoding, resizing and encoding of single images in memory.
+
+#pragma once
+
+#include "ImageResizerTypes.h"
+
+#include <functional>
+#include <istream>
+
+// Everything here works on buffers only: nothing is read from or written to disk, and no
+// state is shared between calls other than what the caller passes in SResizeOptions (e.g. a
+// CBufferPoolSet), so any number of threads may use it at once. This is the ImageResizerCore
+// library, the command line tool is built on top of it. E.g.
+//
+//   SResizeOptions resize_options;
+//   resize_options.outputs.push_back({256, 256});
+//   std::vector<ByteBuffer> thumbnails;
+//   ResizeEncodedImage(data, size, resize_options, ".jpg", thumbnails);
+
+// Called with the estimated peak memory of an image before its pixels are allocated, may
+// block until that much memory is available
+using ReserveMemoryFn = std::function<void(uint64_t bytes)>;
+
+// Fast non-cryptographic 64-bit hash
+uint64_t HashBytes(const void* data, size_t size, uint64_t seed = 0);
+
+cv::Size FitAspectRatio(int org_width, int org_height, int target_width, int target_height);
+
+// File type of an extension like ".jpg", OTHER if it isn't supported
+EFileType FileTypeFromExtension(const std::string& extension);
+// File type from the signature at the start of an encoded image
+EFileType DetectFileType(const unsigned char* data, size_t size);
+
+bool ReadImageHeader(std::istream& stream, EFileType file_type, SImageHeader& header);
+bool ReadImageHeader(const unsigned char* data, size_t size, EFileType file_type,
+                     SImageHeader& header);
+// Orientation tag (1-8) of the first IFD of an EXIF block, after its "Exif\0\0" header
+int ParseExifOrientation(const unsigned char* tiff, size_t size);
+
+// True if every output would have exactly the pixels of the image: the same size, without
+// padding, rotation or a change of layout. The encoded file can then be used as it is.
+bool IsPassThrough(const SImageHeader& header, const SResizeOptions& resize_options);
+
+// Largest factor a JPEG can be reduced by while decoding that still leaves enough
+// pixels for every output
+int ChooseJpegReduction(const SImageHeader& header, const SResizeOptions& resize_options);
+
+// Peak memory DecodeImage is going to ask reserve_memory for, for callers that want to
+// reserve it before the file is even read. Can be too low if the file turns out to need
+// another decoder than its header suggests.
+uint64_t EstimateDecodeMemory(const SImageHeader& header, EFileType file_type,
+                              const SResizeOptions& resize_options);
+
+// Decodes an encoded image into image, in the layout of the file unless
+// resize_options.native_layout is 0. Images with more than resize_options.stream_pixels
+// pixels are resized while they are decoded instead: images_final receives the outputs and
+// image stays empty. header receives the dimensions before any reduction while decoding.
+// reserve_memory may be empty. file_header is the header of the file if the caller already
+// read it, e.g. with ReadImageHeader, so it isn't parsed again.
+EReturnCode DecodeImage(const unsigned char* data, size_t size, EFileType file_type,
+                        const SResizeOptions& resize_options, const ReserveMemoryFn& reserve_memory,
+                        cv::Mat& image, std::vector<cv::Mat>& images_final, SImageHeader& header,
+                        const SImageHeader* file_header = nullptr);
+
+// Resizes image to each of resize_options.outputs, in the same order. image may wrap pixels
+// the caller already has, e.g. cv::Mat(height, width, CV_8UC3, pixels, stride).
+// Large outputs are resized in bands of rows through resize_options.parallel_for, if set,
+// with exactly the pixels a single cv::resize gives.
+void ResizeImage(const cv::Mat& image, const SResizeOptions& resize_options,
+                 std::vector<cv::Mat>& images_final);
+
+// Encodes image to the format implied by extension, same as imwrite would. 16 bit images are
+// scaled to 8 bit for formats other than PNG and TIFF.
+bool EncodeImage(const cv::Mat& image, const std::string& extension, ByteBuffer& encoded);
+
+// Decodes a JPEG or PNG image of any size and resizes it to each of resize_options.outputs
+EReturnCode ResizeEncodedImage(const unsigned char* data, size_t size,
+                               const SResizeOptions& resize_options,
+                               std::vector<cv::Mat>& images_final);
+// Same, and encodes each output to the format implied by extension. FILE_READ_ERROR if the
+// input can't be decoded, FILE_WRITE_ERROR if an output can't be encoded.
+EReturnCode ResizeEncodedImage(const unsigned char* data, size_t size,
+                               const SResizeOptions& resize_options, const std::string& extension,
+                               std::vector<ByteBuffer>& encoded_outputs);
@@ -0,0 +1,94 @@
+﻿// ImageResizerTypes.h : Types shared by ImageResizerCore and the command line tool.
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+class CBufferPoolSet;
+
+using ByteBuffer = std::vector<unsigned char>;
+using ByteBufferPtr = std::shared_ptr<ByteBuffer>;
+
+// Runs body(begin, end) on bands of [0, count) of at least min_band_size items, e.g. on the
+// idle threads of the caller's pool, and returns once every band is done
+using ParallelForFn =
+    std::function<void(int count, int min_band_size, const std::function<void(int, int)>& body)>;
+
+// Contents of an input file, either read into a pooled buffer or memory mapped
+struct SFileData
+{
+	const unsigned char* data{nullptr};
+	size_t size{0};
+	// Keeps data alive, the buffer it was read into or the mapping
+	std::shared_ptr<const void> owner;
+};
+
+enum class EFileType
+{
+	IMAGE_JPEG,
+	IMAGE_PNG,
+	OTHER
+};
+
+// One output that is produced for every input image
+struct SOutputSpec
+{
+	uint32_t target_width{0};
+	uint32_t target_height{0};
+	// Appended to the file name before the extension, e.g. "_thumb"
+	std::string suffix{""};
+	// If set, used instead of SProgramOptions::output_folder for this output
+	std::string output_folder{""};
+};
+
+// Everything that decides what the outputs of an image look like, see ImageResizerLib.h
+struct SResizeOptions
+{
+	// Sizes each input is resized to, all of them come out of a single decode
+	std::vector<SOutputSpec> outputs;
+	cv::InterpolationFlags interpolation{cv::InterpolationFlags::INTER_AREA};
+	// keep_aspect_ratio: If 1, then original aspect ratios are kept and
+	// images are fit into the target frame with a black background
+	uint32_t keep_aspect_ratio{0};
+	// native_layout: If 1, images keep the channels and depth of the file (grayscale, BGR or
+	// BGRA, 8 or 16 bit) through resizing and encoding, otherwise they become 8-bit BGR
+	uint32_t native_layout{1};
+	// stream_pixels: Inputs with more pixels than this are decoded in strips and resized
+	// while decoding, so they never have to fit in memory (--stream-pixels), 0 disables it
+	uint64_t stream_pixels{1ull << 28};
+	// If set, large resizes are split into bands of rows that are run through it, and the
+	// outputs of an image are encoded through it. Empty runs everything on the calling thread.
+	ParallelForFn parallel_for;
+	// If set, pixel buffers are taken from and kept in these pools, see CBufferPoolSet.
+	// Otherwise every image allocates its own.
+	CBufferPoolSet* buffer_pools{nullptr};
+};
+
+// Image properties that can be read from the file header without decoding the pixels
+struct SImageHeader
+{
+	uint32_t width{0};
+	uint32_t height{0};
+	uint32_t channels{0};
+	uint32_t bit_depth{0};
+	// EXIF orientation (1-8) of JPEGs, the decoded image is rotated or flipped by it
+	uint32_t orientation{1};
+};
+
+enum class EReturnCode
+{
+	OK,
+	FILE_UNKNOWN_EXTENSION,
+	FILE_UP_TO_DATE,
+	FILE_READ_ERROR,
+	FOLDER_READ_ERROR,
+	FILE_WRITE_ERROR,
+	UNKNOWN_ERROR,
+};
@@ -0,0 +1,359 @@
+﻿#include "Manifest.h"
+#include "FileIO.h"
+#include "ImageResizerLib.h"
+
+#include <cstring>
+
+namespace
+{
+const char k_manifest_magic[4] = {'I', 'R', 'M', 'F'};
+const uint32_t k_manifest_version = 2;
+
+// Flush and sync the log after this many records, bounds how much work a crash can lose
+const uint32_t k_records_per_flush = 64;
+
+template <typename T>
+void AppendPod(std::string& buffer, const T& value)
+{
+	buffer.append((const char*)&value, sizeof(value));
+}
+
+void AppendString(std::string& buffer, const std::string& str)
+{
+	AppendPod(buffer, (uint32_t)str.size());
+	buffer.append(str);
+}
+
+template <typename T>
+bool ReadPod(const char*& cursor, const char* end, T& value)
+{
+	if ((size_t)(end - cursor) < sizeof(value))
+	{
+		return false;
+	}
+	memcpy(&value, cursor, sizeof(value));
+	cursor += sizeof(value);
+	return true;
+}
+
+bool ReadString(const char*& cursor, const char* end, std::string& str)
+{
+	uint32_t size;
+	if (!ReadPod(cursor, end, size) || (size_t)(end - cursor) < size)
+	{
+		return false;
+	}
+	str.assign(cursor, size);
+	cursor += size;
+	return true;
+}
+
+// Record layout: payload size (u32), payload, HashBytes of the payload (u64)
+void AppendRecord(std::string& buffer, const std::string& path, const SManifestEntry& entry)
+{
+	std::string payload;
+	AppendPod(payload, entry.file_size);
+	AppendPod(payload, entry.mtime);
+	AppendPod(payload, entry.options_hash);
+	AppendString(payload, path);
+	AppendPod(payload, (uint32_t)entry.output_paths.size());
+	for (const std::string& output_path : entry.output_paths)
+	{
+		AppendString(payload, output_path);
+	}
+
+	AppendPod(buffer, (uint32_t)payload.size());
+	buffer.append(payload);
+	AppendPod(buffer, HashBytes(payload.data(), payload.size()));
+}
+
+std::string ManifestHeader()
+{
+	std::string header(k_manifest_magic, sizeof(k_manifest_magic));
+	AppendPod(header, k_manifest_version);
+	return header;
+}
+} // namespace
+
+CManifest::CManifest(std::string manifest_path, uint64_t options_hash)
+    : m_manifest_path(std::move(manifest_path)), m_options_hash(options_hash)
+{
+}
+
+CManifest::~CManifest()
+{
+	Close();
+}
+
+bool CManifest::Open()
+{
+	if (!Load())
+	{
+		return false;
+	}
+
+	m_log.open(m_manifest_path, std::ios::binary | std::ios::app);
+	if (!m_log)
+	{
+		return false;
+	}
+
+	if (m_log.tellp() == 0)
+	{
+		const std::string header = ManifestHeader();
+		m_log.write(header.data(), header.size());
+		m_log.flush();
+	}
+
+	m_open = true;
+	return (bool)m_log;
+}
+
+bool CManifest::Load()
+{
+	std::ifstream stream(m_manifest_path, std::ios::binary | std::ios::ate);
+	if (!stream)
+	{
+		// First run, nothing to load
+		return !fs::exists(m_manifest_path);
+	}
+
+	const std::streamsize file_size = stream.tellg();
+	if (file_size == 0)
+	{
+		return true;
+	}
+
+	std::string contents((size_t)file_size, '\0');
+	stream.seekg(0);
+	if (!stream.read(&contents[0], file_size))
+	{
+		return false;
+	}
+
+	const std::string header = ManifestHeader();
+	if (contents.compare(0, header.size(), header) != 0)
+	{
+		m_error = "not a manifest written by this version of ImageResizer";
+		return false;
+	}
+
+	const char* cursor = contents.data() + header.size();
+	const char* const end = contents.data() + contents.size();
+	const char* valid_end = cursor;
+
+	while (cursor < end)
+	{
+		uint32_t payload_size;
+		uint64_t checksum;
+		if (!ReadPod(cursor, end, payload_size) ||
+		    (size_t)(end - cursor) < (size_t)payload_size + sizeof(checksum))
+		{
+			break;
+		}
+
+		const char* payload = cursor;
+		const char* payload_end = cursor + payload_size;
+		cursor = payload_end;
+		ReadPod(cursor, end, checksum);
+		if (checksum != HashBytes(payload, payload_size))
+		{
+			break;
+		}
+
+		std::string path;
+		SManifestEntry entry;
+		uint32_t num_outputs = 0;
+		if (!ReadPod(payload, payload_end, entry.file_size) ||
+		    !ReadPod(payload, payload_end, entry.mtime) ||
+		    !ReadPod(payload, payload_end, entry.options_hash) ||
+		    !ReadString(payload, payload_end, path) ||
+		    !ReadPod(payload, payload_end, num_outputs))
+		{
+			break;
+		}
+
+		entry.output_paths.resize(num_outputs);
+		bool valid_outputs = true;
+		for (std::string& output_path : entry.output_paths)
+		{
+			valid_outputs = valid_outputs && ReadString(payload, payload_end, output_path);
+		}
+		if (!valid_outputs)
+		{
+			break;
+		}
+
+		// Later records supersede earlier ones for the same input
+		const bool inserted = m_entries.insert_or_assign(std::move(path), std::move(entry)).second;
+		m_needs_compaction |= !inserted;
+		valid_end = cursor;
+	}
+
+	stream.close();
+
+	if (valid_end != end)
+	{
+		// The previous run died in the middle of a write, cut the torn record
+		// off so that new records get appended after the last valid one
+		std::error_code ec;
+		fs::resize_file(m_manifest_path, (uintmax_t)(valid_end - contents.data()), ec);
+		if (ec)
+		{
+			return false;
+		}
+		m_needs_compaction = true;
+	}
+
+	return true;
+}
+
+bool CManifest::IsUpToDate(const fs::directory_entry& entry) const
+{
+	EntryMap::const_iterator it = m_entries.find(entry.path().string());
+	if (it == m_entries.end() || it->second.options_hash != m_options_hash)
+	{
+		return false;
+	}
+
+	std::error_code ec;
+	const uintmax_t file_size = entry.file_size(ec);
+	if (ec || file_size != it->second.file_size)
+	{
+		return false;
+	}
+
+	const fs::file_time_type mtime = entry.last_write_time(ec);
+	if (ec || mtime.time_since_epoch().count() != it->second.mtime)
+	{
+		return false;
+	}
+
+	// Someone may have cleaned up the outputs since the last run
+	const std::string input_path = entry.path().string();
+	for (const std::string& output_path : it->second.output_paths)
+	{
+		if (output_path != input_path && !fs::exists(output_path, ec))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void CManifest::Record(const SImageJob& job, const SProgramOptions& program_options)
+{
+	SManifestEntry entry;
+	entry.options_hash = m_options_hash;
+	for (const SJobOutput& output : job.outputs)
+	{
+		entry.output_paths.push_back(output.output_path);
+	}
+	entry.file_size = job.input_size;
+	entry.mtime = job.input_mtime;
+
+	if (program_options.output_format == EOutputFormat::INPLACE)
+	{
+		// The input was just overwritten, remember what it looks like now
+		// so that the next run doesn't process the output again
+		std::error_code size_ec, mtime_ec;
+		entry.file_size = (uint64_t)fs::file_size(job.path, size_ec);
+		entry.mtime = fs::last_write_time(job.path, mtime_ec).time_since_epoch().count();
+		if (size_ec || mtime_ec)
+		{
+			return;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_open)
+	{
+		return;
+	}
+
+	AppendRecord(m_pending_records, job.path, entry);
+	m_updated_entries.insert_or_assign(job.path, std::move(entry));
+
+	if (++m_num_pending_records >= k_records_per_flush)
+	{
+		FlushPendingRecords();
+	}
+}
+
+void CManifest::FlushPendingRecords()
+{
+	if (m_pending_records.empty())
+	{
+		return;
+	}
+
+	// Only records that reached the disk survive a power loss, not just a crash
+	m_log.write(m_pending_records.data(), m_pending_records.size());
+	m_log.flush();
+	SyncPath(m_manifest_path);
+	m_pending_records.clear();
+	m_num_pending_records = 0;
+}
+
+bool CManifest::Close()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_open)
+	{
+		return true;
+	}
+	m_open = false;
+
+	FlushPendingRecords();
+	m_log.close();
+
+	if (!m_needs_compaction && m_updated_entries.empty())
+	{
+		return true;
+	}
+
+	for (EntryMap::value_type& updated_entry : m_updated_entries)
+	{
+		m_entries.insert_or_assign(updated_entry.first, std::move(updated_entry.second));
+	}
+	m_updated_entries.clear();
+
+	// Write the compacted manifest next to the old one and swap them, if anything
+	// goes wrong the old manifest with the appended log is still there
+	const std::string temp_path = m_manifest_path + ".tmp";
+	{
+		std::ofstream stream(temp_path, std::ios::binary | std::ios::trunc);
+		std::string buffer = ManifestHeader();
+		for (const EntryMap::value_type& entry : m_entries)
+		{
+			AppendRecord(buffer, entry.first, entry.second);
+			if (buffer.size() >= (1 << 20))
+			{
+				stream.write(buffer.data(), buffer.size());
+				buffer.clear();
+			}
+		}
+		stream.write(buffer.data(), buffer.size());
+		stream.close();
+
+		// The contents have to be on disk before the rename is, otherwise a power loss can
+		// leave an empty or partial manifest in place of the old one
+		if (!stream || !SyncPath(temp_path))
+		{
+			return false;
+		}
+	}
+
+	std::error_code ec;
+	fs::rename(temp_path, m_manifest_path, ec);
+	if (ec)
+	{
+		return false;
+	}
+	m_needs_compaction = false;
+
+	// Persists the rename itself
+	const fs::path manifest_folder = fs::path(m_manifest_path).parent_path();
+	return SyncPath(manifest_folder.empty() ? "." : manifest_folder.string());
+}
@@ -0,0 +1,76 @@
+﻿// Manifest.h : Persistent index of processed files for --incremental runs.
+
+#pragma once
+
+#include "ImageResizer.h"
+
+#include <fstream>
+#include <mutex>
+
+struct SManifestEntry
+{
+	uint64_t file_size{0};
+	int64_t mtime{0};
+	// HashProgramOptions of the run that produced the output
+	uint64_t options_hash{0};
+	std::vector<std::string> output_paths;
+};
+
+// Maps input paths to what they looked like when they were last processed.
+//
+// On disk the manifest is an append-only log of checksummed records. Every finished file
+// is appended (and flushed and synced in small batches) as the run goes, so a run that
+// crashes loses at most the last batch and the next run resumes from there. A torn record
+// at the end is detected through its checksum and dropped. On a clean Close() the log is
+// compacted into one record per input, written and synced to a temporary file and renamed
+// over the old manifest.
+class CManifest
+{
+public:
+	CManifest(std::string manifest_path, uint64_t options_hash);
+	~CManifest();
+
+	CManifest(const CManifest&) = delete;
+	CManifest& operator=(const CManifest&) = delete;
+
+	// Loads the existing manifest (if any) and opens it for appending
+	bool Open();
+
+	// True if the input has the same size and modification time as when it was last
+	// processed with the same options, and its outputs still exist. Only stats the
+	// files, never opens them. Thread-safe.
+	bool IsUpToDate(const fs::directory_entry& entry) const;
+
+	// Records a successfully written job. Thread-safe.
+	void Record(const SImageJob& job, const SProgramOptions& program_options);
+
+	// Flushes the pending records and compacts the manifest
+	bool Close();
+
+	size_t NumberOfLoadedEntries() const { return m_entries.size(); }
+	// Why Open() failed, if it can tell
+	const std::string& Error() const { return m_error; }
+
+private:
+	using EntryMap = std::unordered_map<std::string, SManifestEntry>;
+
+	bool Load();
+	void FlushPendingRecords();
+
+	const std::string m_manifest_path;
+	const uint64_t m_options_hash;
+	std::string m_error;
+
+	// Entries loaded at Open(), read-only while the run is going on
+	EntryMap m_entries;
+
+	std::mutex m_mutex;
+	// Entries recorded by this run, merged into m_entries on Close()
+	EntryMap m_updated_entries;
+	std::ofstream m_log;
+	std::string m_pending_records;
+	uint32_t m_num_pending_records{0};
+	// Set when the log on disk has superseded or torn records worth compacting away
+	bool m_needs_compaction{false};
+	bool m_open{false};
+};
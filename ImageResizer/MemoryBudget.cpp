@@ -0,0 +1,87 @@
+﻿#include "MemoryBudget.h"
+
+#include <algorithm>
+
+namespace
+{
+// How many jobs may be admitted ahead of the oldest waiting one
+const uint32_t k_max_overtaken = 64;
+} // namespace
+
+CMemoryBudget::CMemoryBudget(uint64_t capacity) : m_capacity(capacity)
+{
+}
+
+std::shared_ptr<void> CMemoryBudget::Acquire(uint64_t bytes)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	const uint64_t ticket = m_next_ticket++;
+
+	bool was_oldest = false;
+	if (!CanAdmit(ticket, bytes))
+	{
+		m_num_waits++;
+		m_waiting.insert(ticket);
+		m_changed.wait(lock, [this, ticket, bytes]() { return CanAdmit(ticket, bytes); });
+		was_oldest = ticket == *m_waiting.begin();
+		m_waiting.erase(ticket);
+	}
+
+	if (was_oldest)
+	{
+		// The next oldest request starts counting from zero, and whoever was held back
+		// because of the old one may go now
+		m_num_overtaken = 0;
+		m_changed.notify_all();
+	}
+	else if (!m_waiting.empty())
+	{
+		m_num_overtaken++;
+	}
+
+	m_in_use += bytes;
+	m_peak = std::max(m_peak, m_in_use);
+
+	return std::shared_ptr<void>(this, [this, bytes](void*) { Release(bytes); });
+}
+
+std::shared_ptr<void> CMemoryBudget::Charge(uint64_t bytes)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_in_use += bytes;
+	m_peak = std::max(m_peak, m_in_use);
+	return std::shared_ptr<void>(this, [this, bytes](void*) { Release(bytes); });
+}
+
+uint64_t CMemoryBudget::PeakBytes() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_peak;
+}
+
+uint64_t CMemoryBudget::NumberOfWaits() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_num_waits;
+}
+
+bool CMemoryBudget::CanAdmit(uint64_t ticket, uint64_t bytes) const
+{
+	if (m_in_use && m_in_use + bytes > m_capacity)
+	{
+		return false;
+	}
+
+	// Too many have gone ahead of the oldest waiting request, it goes next
+	return m_waiting.empty() || ticket == *m_waiting.begin() ||
+	       m_num_overtaken < k_max_overtaken;
+}
+
+void CMemoryBudget::Release(uint64_t bytes)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_in_use -= bytes;
+	}
+	m_changed.notify_all();
+}
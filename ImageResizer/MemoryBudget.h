@@ -0,0 +1,57 @@
+﻿// MemoryBudget.h : Admission control for the memory of the jobs.
+
+#pragma once
+
+#include "ImageResizer.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <set>
+
+// Limits how many bytes the jobs hold at once (--max-memory): their encoded input, decoded
+// image and outputs.
+//
+// Jobs ask for their estimated footprint before reading the input and block until it fits.
+// Admission isn't first come first served: while a large image waits, smaller ones that still
+// fit keep going around it. To keep large images from starving, only a limited number of jobs may
+// overtake the oldest waiting one before everybody else has to wait for it.
+class CMemoryBudget
+{
+public:
+	explicit CMemoryBudget(uint64_t capacity);
+
+	CMemoryBudget(const CMemoryBudget&) = delete;
+	CMemoryBudget& operator=(const CMemoryBudget&) = delete;
+
+	// Blocks until bytes fit into the budget. A request larger than the whole budget is
+	// admitted once nothing else is in use. The bytes are given back when the last copy
+	// of the returned handle is dropped.
+	std::shared_ptr<void> Acquire(uint64_t bytes);
+
+	// Counts bytes that are needed right away, without waiting, e.g. when a job turns out to
+	// need more than it acquired. Waiting for them while holding the rest could deadlock.
+	std::shared_ptr<void> Charge(uint64_t bytes);
+
+	uint64_t Capacity() const { return m_capacity; }
+	uint64_t PeakBytes() const;
+	// Number of requests that had to wait
+	uint64_t NumberOfWaits() const;
+
+private:
+	bool CanAdmit(uint64_t ticket, uint64_t bytes) const;
+	void Release(uint64_t bytes);
+
+	const uint64_t m_capacity;
+	uint64_t m_in_use{0};
+	uint64_t m_peak{0};
+	uint64_t m_num_waits{0};
+
+	uint64_t m_next_ticket{0};
+	// Tickets of the waiting requests, the oldest first
+	std::set<uint64_t> m_waiting;
+	// Admissions since the oldest waiting request started waiting
+	uint32_t m_num_overtaken{0};
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_changed;
+};
@@ -0,0 +1,87 @@
+﻿#include "OutputPlan.h"
+#include "ImageResizerLib.h"
+
+COutputPlan::COutputPlan(const SProgramOptions& program_options)
+    : m_program_options(program_options)
+{
+}
+
+void COutputPlan::PrepareInput(const std::string& path, const std::string& output_path)
+{
+	const EOutputFormat output_format = m_program_options.output_format;
+	if (output_format == EOutputFormat::TAR_SHARDS || output_format == EOutputFormat::TENSOR)
+	{
+		// Everything goes into files directly in the output folder
+		return;
+	}
+
+	// Files the read stage rejects for their extension never get outputs, so they must not
+	// leave empty folders behind either
+	if (FileTypeFromExtension(fs::path(path).extension().string()) == EFileType::OTHER)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (!output_path.empty())
+	{
+		// Explicit outputs can point anywhere, the suffixes only change the file name
+		CreateFolder(fs::path(output_path).parent_path());
+		return;
+	}
+
+	if (output_format != EOutputFormat::RECREATE_FOLDER_STRUCTURE)
+	{
+		// Inplace outputs go next to the inputs, flat ones into the output folders, which
+		// were created on startup
+		return;
+	}
+
+	// The outputs of all the files of an input folder go to the same folders
+	const size_t separator = path.find_last_of("/\\");
+	const std::string input_folder =
+	    separator == std::string::npos ? std::string() : path.substr(0, separator);
+	if (!m_planned_input_folders.insert(input_folder).second)
+	{
+		return;
+	}
+
+	for (const SOutputSpec& output_spec : m_program_options.outputs)
+	{
+		CreateFolder(fs::path(MakeOutputPath(path, output_spec, m_program_options)).parent_path());
+	}
+}
+
+uint64_t COutputPlan::NumberOfCreatedFolders() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_num_created_folders;
+}
+
+void COutputPlan::CreateFolder(const fs::path& folder)
+{
+	if (folder.empty() || m_existing_folders.count(folder.string()))
+	{
+		return;
+	}
+
+	// Parents first, the root is its own parent
+	const fs::path parent = folder.parent_path();
+	if (parent != folder)
+	{
+		CreateFolder(parent);
+	}
+
+	// Folders that can't be created aren't remembered, the writes into them fail and
+	// are reported for each file
+	std::error_code ec;
+	if (fs::create_directory(folder, ec))
+	{
+		m_num_created_folders++;
+	}
+	if (!ec)
+	{
+		m_existing_folders.insert(folder.string());
+	}
+}
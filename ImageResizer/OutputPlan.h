@@ -0,0 +1,42 @@
+﻿// OutputPlan.h : Creates the output folders before the files are handed to the workers.
+
+#pragma once
+
+#include "ImageResizer.h"
+
+#include <mutex>
+#include <unordered_set>
+
+// Output paths are computed without touching the filesystem, so the folders they point
+// into have to exist before a file's outputs are written. Every input goes through
+// PrepareInput before it is submitted, and each output folder is created the first time
+// an input needs it. After that, the other files of the folder cost a set lookup instead
+// of the stat and mkdir calls create_directories makes for every one of them.
+class COutputPlan
+{
+public:
+	explicit COutputPlan(const SProgramOptions& program_options);
+
+	COutputPlan(const COutputPlan&) = delete;
+	COutputPlan& operator=(const COutputPlan&) = delete;
+
+	// Creates the folders the outputs of path go to, or those of output_path if it was
+	// given explicitly, unless an earlier input already did. Does nothing for files with an
+	// unsupported extension. Thread-safe.
+	void PrepareInput(const std::string& path, const std::string& output_path);
+
+	uint64_t NumberOfCreatedFolders() const;
+
+private:
+	// Creates folder and its missing parents, remembering which ones exist
+	void CreateFolder(const fs::path& folder);
+
+	const SProgramOptions& m_program_options;
+
+	mutable std::mutex m_mutex;
+	// Input folders whose outputs' folders were already created, for mirrored outputs
+	std::unordered_set<std::string> m_planned_input_folders;
+	// Output folders known to exist
+	std::unordered_set<std::string> m_existing_folders;
+	uint64_t m_num_created_folders{0};
+};
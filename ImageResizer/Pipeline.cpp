@@ -0,0 +1,141 @@
+﻿#include "Pipeline.h"
+#include "RunStats.h"
+
+#include <algorithm>
+
+CPipeline::CPipeline(const SProgramOptions& program_options) : m_program_options(program_options)
+{
+	const SPipelineOptions& pipeline_options = program_options.pipeline_options;
+
+	for (int stage = 0; stage < STAGE_COUNT; ++stage)
+	{
+		m_queues[stage] = std::make_unique<CBoundedQueue<JobPtr>>(pipeline_options.queue_depth);
+		m_active_workers[stage] = 0;
+	}
+
+	StartStage(STAGE_READ, ReadStage, pipeline_options.read_threads);
+	StartStage(STAGE_DECODE, DecodeStage, pipeline_options.decode_threads);
+	StartStage(STAGE_RESIZE, ResizeStage, pipeline_options.resize_threads);
+	StartStage(STAGE_ENCODE, EncodeStage, pipeline_options.encode_threads);
+	StartStage(STAGE_WRITE, WriteStage, pipeline_options.write_threads);
+}
+
+CPipeline::~CPipeline()
+{
+	Finish();
+}
+
+SPipelineOptions CPipeline::ResolveOptions(SPipelineOptions pipeline_options,
+                                           uint32_t num_threads)
+{
+	num_threads = std::max(num_threads, 1u);
+
+	// Reads and writes mostly wait on the disk, so they get a few threads regardless
+	// of the core count. CPU bound stages share the cores, weighted by their usual cost.
+	if (!pipeline_options.read_threads)
+	{
+		pipeline_options.read_threads = std::max(num_threads / 4, 2u);
+	}
+	if (!pipeline_options.decode_threads)
+	{
+		pipeline_options.decode_threads = std::max(num_threads / 2, 1u);
+	}
+	if (!pipeline_options.resize_threads)
+	{
+		pipeline_options.resize_threads = std::max(num_threads / 4, 1u);
+	}
+	if (!pipeline_options.encode_threads)
+	{
+		pipeline_options.encode_threads = std::max(num_threads / 4, 1u);
+	}
+	if (!pipeline_options.write_threads)
+	{
+		pipeline_options.write_threads = std::max(num_threads / 4, 2u);
+	}
+	if (!pipeline_options.queue_depth)
+	{
+		pipeline_options.queue_depth = 1;
+	}
+
+	return pipeline_options;
+}
+
+void CPipeline::Submit(std::string path, std::string output_path)
+{
+	JobPtr job = std::make_unique<SImageJob>();
+	job->path = std::move(path);
+	job->output_path = std::move(output_path);
+	job->queued_time = std::chrono::steady_clock::now();
+	m_queues[STAGE_READ]->Push(std::move(job));
+}
+
+void CPipeline::Finish()
+{
+	if (m_finished)
+	{
+		return;
+	}
+	m_finished = true;
+
+	// Closing the first queue lets the workers drain it, after which
+	// every stage closes the queue of the next one in turn
+	m_queues[STAGE_READ]->Close();
+
+	for (std::thread& worker : m_workers)
+	{
+		worker.join();
+	}
+	m_workers.clear();
+}
+
+void CPipeline::StartStage(EStage stage, StageFn stage_fn, uint32_t num_workers)
+{
+	num_workers = std::max(num_workers, 1u);
+	m_active_workers[stage] = num_workers;
+
+	for (uint32_t i = 0; i < num_workers; ++i)
+	{
+		m_workers.emplace_back([this, stage, stage_fn]() { StageWorker(stage, stage_fn); });
+	}
+}
+
+void CPipeline::StageWorker(EStage stage, StageFn stage_fn)
+{
+	CBoundedQueue<JobPtr>& input_queue = *m_queues[stage];
+	const bool is_last_stage = stage + 1 == STAGE_COUNT;
+
+	static_assert((int)ERunStage::WRITE == STAGE_WRITE, "Stages have to match ERunStage");
+	CRunStats& run_stats = CRunStats::ThreadLocal();
+
+	JobPtr job;
+	while (input_queue.Pop(job))
+	{
+		run_stats.RecordLatency(ERunStage::QUEUE_WAIT,
+		                        std::chrono::duration<double>(std::chrono::steady_clock::now() -
+		                                                      job->queued_time)
+		                            .count());
+
+		if (run_stats.RunStage((ERunStage)stage, stage_fn, *job, m_program_options) &&
+		    !is_last_stage)
+		{
+			job->queued_time = std::chrono::steady_clock::now();
+			m_queues[stage + 1]->Push(std::move(job));
+		}
+		else
+		{
+			// Either the job failed in this stage or it's done
+			CompleteJob(*job);
+			job.reset();
+		}
+	}
+
+	if (--m_active_workers[stage] == 0 && !is_last_stage)
+	{
+		m_queues[stage + 1]->Close();
+	}
+}
+
+void CPipeline::CompleteJob(const SImageJob& job)
+{
+	FinishJob(job, m_program_options);
+}
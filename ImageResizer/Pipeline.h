@@ -0,0 +1,128 @@
+﻿// Pipeline.h : Staged read -> decode -> resize -> encode -> write engine.
+
+#pragma once
+
+#include "ImageResizer.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Blocking FIFO with a fixed capacity. Push blocks while the queue is full,
+// Pop blocks while it is empty. Once closed, Push fails and Pop drains what's left.
+template <typename T>
+class CBoundedQueue
+{
+public:
+	explicit CBoundedQueue(size_t capacity) : m_capacity(capacity > 0 ? capacity : 1) {}
+
+	bool Push(T item)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_not_full.wait(lock, [this]() { return m_closed || m_items.size() < m_capacity; });
+
+		if (m_closed)
+		{
+			return false;
+		}
+
+		m_items.push_back(std::move(item));
+		lock.unlock();
+		m_not_empty.notify_one();
+		return true;
+	}
+
+	bool Pop(T& item)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_not_empty.wait(lock, [this]() { return m_closed || !m_items.empty(); });
+
+		if (m_items.empty())
+		{
+			// Closed and drained
+			return false;
+		}
+
+		item = std::move(m_items.front());
+		m_items.pop_front();
+		lock.unlock();
+		m_not_full.notify_one();
+		return true;
+	}
+
+	void Close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_closed = true;
+		}
+		m_not_full.notify_all();
+		m_not_empty.notify_all();
+	}
+
+private:
+	const size_t m_capacity;
+	std::deque<T> m_items;
+	bool m_closed{false};
+	std::mutex m_mutex;
+	std::condition_variable m_not_full;
+	std::condition_variable m_not_empty;
+};
+
+// Splits the processing of each file into read, decode, resize, encode and write stages.
+// Every stage has its own workers and a bounded queue in front of it, so I/O bound and
+// CPU bound stages of different files overlap instead of blocking each other.
+class CPipeline
+{
+public:
+	explicit CPipeline(const SProgramOptions& program_options);
+	~CPipeline();
+
+	CPipeline(const CPipeline&) = delete;
+	CPipeline& operator=(const CPipeline&) = delete;
+
+	// Queues a file for processing, blocks while the read stage is backed up.
+	// output_path replaces the derived output path if it isn't empty.
+	void Submit(std::string path, std::string output_path = "");
+
+	// Waits for all submitted files to go through the pipeline, then stops the workers
+	void Finish();
+
+	uint32_t NumberOfWorkers() const { return (uint32_t)m_workers.size(); }
+
+	// Fills the stage worker counts that weren't set by the user based on num_threads
+	static SPipelineOptions ResolveOptions(SPipelineOptions pipeline_options,
+	                                       uint32_t num_threads);
+
+private:
+	using JobPtr = std::unique_ptr<SImageJob>;
+	using StageFn = bool (*)(SImageJob&, const SProgramOptions&);
+
+	enum EStage
+	{
+		STAGE_READ,
+		STAGE_DECODE,
+		STAGE_RESIZE,
+		STAGE_ENCODE,
+		STAGE_WRITE,
+		STAGE_COUNT
+	};
+
+	void StartStage(EStage stage, StageFn stage_fn, uint32_t num_workers);
+	void StageWorker(EStage stage, StageFn stage_fn);
+	void CompleteJob(const SImageJob& job);
+
+	const SProgramOptions& m_program_options;
+
+	// m_queues[i] feeds stage i
+	std::unique_ptr<CBoundedQueue<JobPtr>> m_queues[STAGE_COUNT];
+	// Number of workers still running in each stage, the last one
+	// to exit closes the queue of the next stage
+	std::atomic<uint32_t> m_active_workers[STAGE_COUNT];
+	std::vector<std::thread> m_workers;
+	bool m_finished{false};
+};
@@ -0,0 +1,183 @@
+﻿#include "Prefetcher.h"
+#include "FileIO.h"
+#include "ImageResizerLib.h"
+
+#include <algorithm>
+#include <tuple>
+
+#if IMAGERESIZER_HAVE_POSIX_IO
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+// macOS and Windows have no posix_fadvise, the inputs are just handed over in batches there
+#if IMAGERESIZER_HAVE_POSIX_IO && defined(POSIX_FADV_WILLNEED)
+#define IMAGERESIZER_HAVE_FADVISE 1
+#endif
+
+namespace
+{
+#if IMAGERESIZER_HAVE_FADVISE
+// Descriptors a batch may keep open between looking at its files and advising them, a
+// quarter of the soft limit so the workers' reads and writes still have plenty
+size_t MaxOpenFiles()
+{
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY)
+	{
+		return 256;
+	}
+	return (size_t)limit.rlim_cur / 4;
+}
+
+// Physical byte offset of the first block of data, 0 if the filesystem doesn't say
+uint64_t FirstExtentOffset(int fd)
+{
+#if defined(__linux__)
+	// Room for the header and a single extent
+	alignas(fiemap) unsigned char request[sizeof(fiemap) + sizeof(fiemap_extent)]{};
+	fiemap* map = (fiemap*)request;
+	map->fm_start = 0;
+	map->fm_length = FIEMAP_MAX_OFFSET;
+	map->fm_extent_count = 1;
+	if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents == 1 &&
+	    !(map->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN))
+	{
+		return map->fm_extents[0].fe_physical;
+	}
+#else
+	(void)fd;
+#endif
+	return 0;
+}
+#endif
+} // namespace
+
+CPrefetcher::CPrefetcher(uint32_t window, EPrefetchOrder order, SubmitFn submit)
+    : m_window(std::max(window, 1u)), m_order(order), m_submit(std::move(submit))
+{
+	m_pending.reserve(m_window);
+	m_advised.reserve(m_window);
+}
+
+void CPrefetcher::Submit(std::string path, std::string output_path)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_pending.push_back({std::move(path), std::move(output_path)});
+	if (m_pending.size() < m_window)
+	{
+		return;
+	}
+
+	// The new batch starts loading before the workers get to the end of the previous one
+	AdviseBatch(m_pending);
+	SubmitBatch(m_advised);
+	std::swap(m_advised, m_pending);
+}
+
+void CPrefetcher::Flush()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	AdviseBatch(m_pending);
+	SubmitBatch(m_advised);
+	SubmitBatch(m_pending);
+}
+
+void CPrefetcher::AdviseBatch(std::vector<SEntry>& batch) const
+{
+#if IMAGERESIZER_HAVE_FADVISE
+	// Device first so the files of each disk stay together, then the position on it. Files
+	// that can't be opened go last, the read stage reports them, and so do files it rejects
+	// for their extension, they are never read. The descriptors opened for the sort keys are
+	// kept for the advice, up to MaxOpenFiles() of them, the rest are opened a second time.
+	static const size_t max_open_files = MaxOpenFiles();
+	using SortKey = std::tuple<uint64_t, uint64_t, uint64_t>;
+	struct SOpenEntry
+	{
+		SortKey key;
+		bool readable;
+		int fd;
+		size_t index;
+	};
+
+	std::vector<SOpenEntry> open_entries;
+	open_entries.reserve(batch.size());
+	size_t num_open_files = 0;
+	for (size_t i = 0; i < batch.size(); ++i)
+	{
+		SOpenEntry open_entry{SortKey{UINT64_MAX, 0, 0}, false, -1, i};
+		const std::string extension = fs::path(batch[i].path).extension().string();
+		open_entry.readable = FileTypeFromExtension(extension) != EFileType::OTHER;
+		if (open_entry.readable && m_order != EPrefetchOrder::FOUND)
+		{
+			open_entry.fd = open(batch[i].path.c_str(), O_RDONLY | O_CLOEXEC);
+			struct stat file_stat;
+			open_entry.readable = open_entry.fd >= 0 && fstat(open_entry.fd, &file_stat) == 0;
+			if (open_entry.readable)
+			{
+				const uint64_t extent_offset =
+				    m_order == EPrefetchOrder::EXTENT ? FirstExtentOffset(open_entry.fd) : 0;
+				open_entry.key = SortKey{(uint64_t)file_stat.st_dev, extent_offset,
+				                         (uint64_t)file_stat.st_ino};
+			}
+			if (open_entry.fd >= 0 && (!open_entry.readable || num_open_files >= max_open_files))
+			{
+				close(open_entry.fd);
+				open_entry.fd = -1;
+			}
+			num_open_files += open_entry.fd >= 0;
+		}
+		open_entries.push_back(open_entry);
+	}
+
+	if (m_order != EPrefetchOrder::FOUND)
+	{
+		std::stable_sort(open_entries.begin(), open_entries.end(),
+		                 [](const SOpenEntry& a, const SOpenEntry& b) { return a.key < b.key; });
+
+		std::vector<SEntry> sorted_batch;
+		sorted_batch.reserve(batch.size());
+		for (const SOpenEntry& open_entry : open_entries)
+		{
+			sorted_batch.push_back(std::move(batch[open_entry.index]));
+		}
+		batch = std::move(sorted_batch);
+	}
+
+	// Only starts the reads, doesn't wait for them
+	for (size_t i = 0; i < batch.size(); ++i)
+	{
+		if (!open_entries[i].readable)
+		{
+			continue;
+		}
+		const int fd = open_entries[i].fd >= 0
+		                   ? open_entries[i].fd
+		                   : open(batch[i].path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd >= 0)
+		{
+			posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+			close(fd);
+		}
+	}
+#else
+	(void)batch;
+#endif
+}
+
+void CPrefetcher::SubmitBatch(std::vector<SEntry>& batch)
+{
+	for (SEntry& entry : batch)
+	{
+		m_submit(std::move(entry.path), std::move(entry.output_path));
+	}
+	batch.clear();
+}
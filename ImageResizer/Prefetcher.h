@@ -0,0 +1,57 @@
+﻿// Prefetcher.h : Warms up the page cache for the inputs ahead of the workers.
+
+#pragma once
+
+#include "ImageResizer.h"
+
+#include <functional>
+#include <mutex>
+
+// Holds back the inputs on their way to the workers and asks the kernel to read them ahead
+// (--prefetch).
+//
+// Inputs are collected in batches of window files. Once a batch is full it is sorted by
+// where its files are on the disk (see EPrefetchOrder) and the kernel is told that each of
+// them will be needed, in that order. Only then does the previous batch go to the workers,
+// so they always find the next window to two windows of files being read in the background,
+// mostly sequentially instead of in the order they were listed.
+//
+// Once an input has been read, the read stage drops its pages from the page cache again
+// (see ReadInputFile), so that a large run doesn't push everything else out of it.
+class CPrefetcher
+{
+public:
+	using SubmitFn = std::function<void(std::string, std::string)>;
+
+	CPrefetcher(uint32_t window, EPrefetchOrder order, SubmitFn submit);
+
+	CPrefetcher(const CPrefetcher&) = delete;
+	CPrefetcher& operator=(const CPrefetcher&) = delete;
+
+	// Queues an input, hands over the previous batch if this one is full. Can be called
+	// from several threads, blocks while submit does.
+	void Submit(std::string path, std::string output_path);
+
+	// Hands over all the inputs that are still held back
+	void Flush();
+
+private:
+	struct SEntry
+	{
+		std::string path;
+		std::string output_path;
+	};
+
+	// Sorts batch into the order it is going to be read in and starts reading it
+	void AdviseBatch(std::vector<SEntry>& batch) const;
+	void SubmitBatch(std::vector<SEntry>& batch);
+
+	const size_t m_window;
+	const EPrefetchOrder m_order;
+	const SubmitFn m_submit;
+
+	std::mutex m_mutex;
+	// Inputs still being collected, and the previous batch that is being read ahead
+	std::vector<SEntry> m_pending;
+	std::vector<SEntry> m_advised;
+};
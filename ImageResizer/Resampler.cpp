@@ -0,0 +1,224 @@
+﻿#include "Resampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+
+namespace
+{
+int FilterTaps(int interpolation)
+{
+	switch (interpolation)
+	{
+	case cv::InterpolationFlags::INTER_LINEAR:
+		return 2;
+	case cv::InterpolationFlags::INTER_CUBIC:
+		return 4;
+	case cv::InterpolationFlags::INTER_LANCZOS4:
+		return 8;
+	default:
+		return 0;
+	}
+}
+
+// Same kernels as cv::resize, x is the fractional part of the source position
+void ComputeCoefficients(int interpolation, float x, float* coeffs)
+{
+	switch (interpolation)
+	{
+	case cv::InterpolationFlags::INTER_LINEAR:
+		coeffs[0] = 1.f - x;
+		coeffs[1] = x;
+		break;
+	case cv::InterpolationFlags::INTER_CUBIC:
+	{
+		const float a = -0.75f;
+		coeffs[0] = ((a * (x + 1) - 5 * a) * (x + 1) + 8 * a) * (x + 1) - 4 * a;
+		coeffs[1] = ((a + 2) * x - (a + 3)) * x * x + 1;
+		coeffs[2] = ((a + 2) * (1 - x) - (a + 3)) * (1 - x) * (1 - x) + 1;
+		coeffs[3] = 1.f - coeffs[0] - coeffs[1] - coeffs[2];
+		break;
+	}
+	case cv::InterpolationFlags::INTER_LANCZOS4:
+	{
+		const double pi = 3.14159265358979323846;
+		float sum = 0.f;
+		for (int i = 0; i < 8; ++i)
+		{
+			const double distance = std::abs(x + 3 - i);
+			double coeff = 1.0;
+			if (distance > 1e-6)
+			{
+				const double y = pi * distance;
+				coeff = 4.0 * std::sin(y) * std::sin(y / 4) / (y * y);
+			}
+			coeffs[i] = (float)coeff;
+			sum += coeffs[i];
+		}
+		for (int i = 0; i < 8; ++i)
+		{
+			coeffs[i] /= sum;
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+std::shared_ptr<const SResampleAxis> BuildAxis(int src_length, int dst_length, int interpolation)
+{
+	const int taps = FilterTaps(interpolation);
+	if (!taps || src_length < taps || dst_length <= 0)
+	{
+		return nullptr;
+	}
+
+	std::shared_ptr<SResampleAxis> axis = std::make_shared<SResampleAxis>();
+	axis->taps = taps;
+	axis->offsets.resize(dst_length);
+	axis->weights.assign((size_t)dst_length * taps, 0.f);
+
+	const double scale = (double)src_length / dst_length;
+	float coeffs[8];
+
+	for (int i = 0; i < dst_length; ++i)
+	{
+		// Pixel centers are aligned, same as cv::resize
+		const double position = (i + 0.5) * scale - 0.5;
+		const int floor_position = (int)std::floor(position);
+		ComputeCoefficients(interpolation, (float)(position - floor_position), coeffs);
+
+		// Shift the window inside the source and add the weights of the taps that fell
+		// outside onto the edge pixel they would have replicated
+		const int first = floor_position - (taps / 2 - 1);
+		const int start = std::clamp(first, 0, src_length - taps);
+		float* weights = &axis->weights[(size_t)i * taps];
+		for (int t = 0; t < taps; ++t)
+		{
+			const int index = std::clamp(first + t, 0, src_length - 1);
+			weights[index - start] += coeffs[t];
+		}
+		axis->offsets[i] = start;
+	}
+
+	return axis;
+}
+
+// Like BuildAxis, but also for the interpolations cv::resize doesn't implement as a
+// separable filter. Area downscaling averages the source pixels each destination pixel
+// covers, partially covered ones with their share, and upscales like linear.
+std::shared_ptr<const SResampleAxis> BuildStreamingAxis(int src_length, int dst_length,
+                                                        int interpolation)
+{
+	const double scale = (double)src_length / dst_length;
+
+	if (interpolation == cv::InterpolationFlags::INTER_NEAREST)
+	{
+		std::shared_ptr<SResampleAxis> axis = std::make_shared<SResampleAxis>();
+		axis->taps = 1;
+		axis->offsets.resize(dst_length);
+		axis->weights.assign(dst_length, 1.f);
+		for (int i = 0; i < dst_length; ++i)
+		{
+			axis->offsets[i] = std::min((int)std::floor(i * scale), src_length - 1);
+		}
+		return axis;
+	}
+
+	if (interpolation == cv::InterpolationFlags::INTER_AREA && scale > 1.0)
+	{
+		std::shared_ptr<SResampleAxis> axis = std::make_shared<SResampleAxis>();
+		axis->taps = std::min((int)std::ceil(scale) + 1, src_length);
+		axis->offsets.resize(dst_length);
+		axis->weights.assign((size_t)dst_length * axis->taps, 0.f);
+		for (int i = 0; i < dst_length; ++i)
+		{
+			const double begin = i * scale;
+			const double end = std::min((i + 1) * scale, (double)src_length);
+			const int first = (int)std::floor(begin);
+			const int start = std::min(first, src_length - axis->taps);
+			float* weights = &axis->weights[(size_t)i * axis->taps];
+			for (int index = first; index < end; ++index)
+			{
+				const double overlap = std::min(end, index + 1.0) - std::max(begin, (double)index);
+				weights[index - start] = (float)(overlap / scale);
+			}
+			axis->offsets[i] = start;
+		}
+		return axis;
+	}
+
+	if (interpolation == cv::InterpolationFlags::INTER_AREA)
+	{
+		interpolation = cv::InterpolationFlags::INTER_LINEAR;
+	}
+
+	std::shared_ptr<const SResampleAxis> axis = BuildAxis(src_length, dst_length, interpolation);
+	if (!axis && src_length >= 2)
+	{
+		// Sources smaller than the filter
+		axis = BuildAxis(src_length, dst_length, cv::InterpolationFlags::INTER_LINEAR);
+	}
+	return axis ? axis
+	            : BuildStreamingAxis(src_length, dst_length, cv::InterpolationFlags::INTER_NEAREST);
+}
+} // namespace
+
+CStreamingResampler::CStreamingResampler(int src_width, int src_height, cv::Mat dst,
+                                         int interpolation)
+    : m_horizontal(BuildStreamingAxis(src_width, dst.cols, interpolation)),
+      m_vertical(BuildStreamingAxis(src_height, dst.rows, interpolation)), m_dst(dst),
+      m_row_length(dst.cols * dst.channels())
+{
+	m_ring_buffer.resize((size_t)m_vertical->taps * m_row_length);
+}
+
+void CStreamingResampler::PushRow(const uchar* src_row)
+{
+	const int taps = m_vertical->taps;
+	const int channels = m_dst.channels();
+	const int src_row_index = m_next_src_row++;
+
+	// Rows before the window of the next destination row aren't needed by any,
+	// which for large reductions is most of them
+	if (Finished() || src_row_index < m_vertical->offsets[m_next_dst_row])
+	{
+		return;
+	}
+
+	float* filtered = &m_ring_buffer[(size_t)(src_row_index % taps) * m_row_length];
+	const int horizontal_taps = m_horizontal->taps;
+	for (int x = 0; x < m_dst.cols; ++x)
+	{
+		const uchar* src = src_row + m_horizontal->offsets[x] * channels;
+		const float* weights = &m_horizontal->weights[(size_t)x * horizontal_taps];
+		for (int c = 0; c < channels; ++c)
+		{
+			float sum = 0.f;
+			for (int t = 0; t < horizontal_taps; ++t)
+			{
+				sum += weights[t] * src[t * channels + c];
+			}
+			filtered[x * channels + c] = sum;
+		}
+	}
+
+	// Emit every destination row whose window ends with this row
+	while (!Finished() && m_vertical->offsets[m_next_dst_row] + taps - 1 <= src_row_index)
+	{
+		const int first = m_vertical->offsets[m_next_dst_row];
+		const float* weights = &m_vertical->weights[(size_t)m_next_dst_row * taps];
+		uchar* out = m_dst.ptr<uchar>(m_next_dst_row);
+		for (int x = 0; x < m_row_length; ++x)
+		{
+			float sum = 0.f;
+			for (int t = 0; t < taps; ++t)
+			{
+				sum += weights[t] * m_ring_buffer[(size_t)((first + t) % taps) * m_row_length + x];
+			}
+			out[x] = cv::saturate_cast<uchar>(sum);
+		}
+		m_next_dst_row++;
+	}
+}
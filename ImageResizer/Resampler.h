@@ -0,0 +1,44 @@
+﻿// Resampler.h : Separable resize of images that arrive a few rows at a time.
+
+#pragma once
+
+#include "ImageResizerTypes.h"
+
+// Interpolation weights along one axis. Destination index i is computed from source
+// indices offsets[i] ... offsets[i] + taps - 1 with weights[i * taps] ... Border handling
+// (replicating the edge pixels, same as cv::resize) is folded into the weights, so every
+// window lies entirely inside the source.
+struct SResampleAxis
+{
+	int taps{0};
+	std::vector<int> offsets;
+	std::vector<float> weights;
+};
+
+// Resizes an 8-bit image that arrives one row at a time, top to bottom, into dst. Only the
+// horizontally filtered source rows that the vertical filter still needs are kept, so the
+// memory used doesn't depend on the height of the source. Matches cv::resize up to rounding,
+// nearest neighbour and area are supported too, as separable weight tables. Images that are
+// decoded whole go through cv::resize instead, which is vectorized.
+class CStreamingResampler
+{
+public:
+	// dst has to be allocated already and can be a region of a larger image
+	CStreamingResampler(int src_width, int src_height, cv::Mat dst, int interpolation);
+
+	// Feeds the next source row, with dst.channels() bytes per pixel
+	void PushRow(const uchar* src_row);
+
+	// True once every row of dst has been written
+	bool Finished() const { return m_next_dst_row == m_dst.rows; }
+
+private:
+	std::shared_ptr<const SResampleAxis> m_horizontal;
+	std::shared_ptr<const SResampleAxis> m_vertical;
+	cv::Mat m_dst;
+	int m_row_length{0};
+	int m_next_src_row{0};
+	int m_next_dst_row{0};
+	// Filtered source row r lives in slot r % taps
+	std::vector<float> m_ring_buffer;
+};
@@ -0,0 +1,470 @@
+﻿#include "RunStats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+namespace
+{
+// Number of slowest files each thread remembers, and the report lists
+const size_t k_num_slowest_files = 10;
+
+std::mutex g_run_stats_mutex;
+std::vector<std::shared_ptr<CRunStats>> g_run_stats;
+
+// Keeps the records of different threads from interleaving
+std::mutex g_job_record_mutex;
+
+// Counters are only written by their own thread, a plain load and store is enough
+void AddRelaxed(std::atomic<uint64_t>& counter, uint64_t value)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+uint64_t LoadRelaxed(const std::atomic<uint64_t>& counter)
+{
+	return counter.load(std::memory_order_relaxed);
+}
+
+bool IsError(EReturnCode return_code)
+{
+	return return_code != EReturnCode::OK && return_code != EReturnCode::FILE_UNKNOWN_EXTENSION &&
+	       return_code != EReturnCode::FILE_UP_TO_DATE;
+}
+
+bool SlowerFile(const SSlowFile& a, const SSlowFile& b)
+{
+	return a.seconds > b.seconds;
+}
+} // namespace
+
+std::string EscapeJson(const std::string& str)
+{
+	std::string escaped;
+	escaped.reserve(str.size());
+	for (char c : str)
+	{
+		switch (c)
+		{
+		case '"':
+			escaped += "\\\"";
+			break;
+		case '\\':
+			escaped += "\\\\";
+			break;
+		case '\n':
+			escaped += "\\n";
+			break;
+		case '\r':
+			escaped += "\\r";
+			break;
+		case '\t':
+			escaped += "\\t";
+			break;
+		default:
+			if ((unsigned char)c < 0x20)
+			{
+				char code[8];
+				snprintf(code, sizeof(code), "\\u%04x", (unsigned)c);
+				escaped += code;
+			}
+			else
+			{
+				escaped += c;
+			}
+			break;
+		}
+	}
+	return escaped;
+}
+
+const char* RunStageName(ERunStage stage)
+{
+	switch (stage)
+	{
+	case ERunStage::READ:
+		return "read";
+	case ERunStage::DECODE:
+		return "decode";
+	case ERunStage::RESIZE:
+		return "resize";
+	case ERunStage::ENCODE:
+		return "encode";
+	case ERunStage::WRITE:
+		return "write";
+	case ERunStage::QUEUE_WAIT:
+		return "queue_wait";
+	default:
+		return "unknown";
+	}
+}
+
+const char* ReturnCodeName(EReturnCode return_code)
+{
+	switch (return_code)
+	{
+	case EReturnCode::OK:
+		return "OK";
+	case EReturnCode::FILE_UNKNOWN_EXTENSION:
+		return "FILE_UNKNOWN_EXTENSION";
+	case EReturnCode::FILE_UP_TO_DATE:
+		return "FILE_UP_TO_DATE";
+	case EReturnCode::FILE_READ_ERROR:
+		return "FILE_READ_ERROR";
+	case EReturnCode::FOLDER_READ_ERROR:
+		return "FOLDER_READ_ERROR";
+	case EReturnCode::FILE_WRITE_ERROR:
+		return "FILE_WRITE_ERROR";
+	case EReturnCode::UNKNOWN_ERROR:
+	default:
+		return "UNKNOWN_ERROR";
+	}
+}
+
+size_t CRunStats::SHistogram::BucketIndex(uint64_t us)
+{
+	if (us < 8)
+	{
+		return (size_t)us;
+	}
+
+	int exponent = 3;
+	while (exponent < 63 && (us >> (exponent + 1)))
+	{
+		++exponent;
+	}
+	const size_t sub_bucket = (size_t)(us >> (exponent - 3)) & 7;
+	return std::min<size_t>(8 + (exponent - 3) * 8 + sub_bucket, k_num_buckets - 1);
+}
+
+double CRunStats::SHistogram::BucketValue(size_t bucket)
+{
+	if (bucket < 8)
+	{
+		return (double)bucket;
+	}
+
+	const int shift = (int)(bucket - 8) / 8;
+	const uint64_t sub_bucket = (bucket - 8) % 8;
+	const double width = (double)(1ull << shift);
+	return (8 + sub_bucket) * width + width / 2;
+}
+
+CRunStats& CRunStats::ThreadLocal()
+{
+	thread_local std::shared_ptr<CRunStats> stats = []() {
+		std::shared_ptr<CRunStats> new_stats(new CRunStats());
+		std::lock_guard<std::mutex> lock(g_run_stats_mutex);
+		g_run_stats.push_back(new_stats);
+		return new_stats;
+	}();
+	return *stats;
+}
+
+SRunReport CRunStats::Collect(bool include_slowest_files)
+{
+	SRunReport report;
+	uint64_t buckets[k_num_run_stages][SHistogram::k_num_buckets]{};
+	uint64_t max_us[k_num_run_stages]{};
+
+	std::lock_guard<std::mutex> lock(g_run_stats_mutex);
+	for (const std::shared_ptr<CRunStats>& stats : g_run_stats)
+	{
+		report.num_files += LoadRelaxed(stats->m_num_files);
+		report.num_passed_through += LoadRelaxed(stats->m_num_passed_through);
+		report.bytes_read += LoadRelaxed(stats->m_bytes_read);
+		report.bytes_written += LoadRelaxed(stats->m_bytes_written);
+		for (size_t i = 0; i < k_num_return_codes; ++i)
+		{
+			report.return_codes[i] += LoadRelaxed(stats->m_return_codes[i]);
+		}
+
+		for (size_t stage = 0; stage < k_num_run_stages; ++stage)
+		{
+			const SHistogram& histogram = stats->m_stages[stage];
+			SLatencySummary& summary = report.stages[stage];
+			summary.count += LoadRelaxed(histogram.count);
+			summary.total_seconds += LoadRelaxed(histogram.total_us) * 1e-6;
+			max_us[stage] = std::max(max_us[stage], LoadRelaxed(histogram.max_us));
+			for (size_t bucket = 0; bucket < SHistogram::k_num_buckets; ++bucket)
+			{
+				buckets[stage][bucket] += LoadRelaxed(histogram.buckets[bucket]);
+			}
+		}
+
+		if (include_slowest_files)
+		{
+			report.slowest_files.insert(report.slowest_files.end(),
+			                            stats->m_slowest_files.begin(),
+			                            stats->m_slowest_files.end());
+		}
+	}
+
+	for (size_t stage = 0; stage < k_num_run_stages; ++stage)
+	{
+		SLatencySummary& summary = report.stages[stage];
+		summary.max_seconds = max_us[stage] * 1e-6;
+
+		// Counts are read one by one while workers may still be adding to them,
+		// so the buckets can add up to slightly more than the count read before
+		uint64_t total_count = 0;
+		for (uint64_t count : buckets[stage])
+		{
+			total_count += count;
+		}
+
+		const auto percentile = [&](double fraction) {
+			const uint64_t rank =
+			    std::max<uint64_t>((uint64_t)std::ceil(fraction * total_count), 1);
+			uint64_t seen = 0;
+			for (size_t bucket = 0; bucket < SHistogram::k_num_buckets; ++bucket)
+			{
+				seen += buckets[stage][bucket];
+				if (seen >= rank)
+				{
+					return std::min(SHistogram::BucketValue(bucket) * 1e-6, summary.max_seconds);
+				}
+			}
+			return summary.max_seconds;
+		};
+
+		if (total_count)
+		{
+			summary.p50_seconds = percentile(0.50);
+			summary.p99_seconds = percentile(0.99);
+		}
+	}
+
+	std::sort(report.slowest_files.begin(), report.slowest_files.end(), SlowerFile);
+	if (report.slowest_files.size() > k_num_slowest_files)
+	{
+		report.slowest_files.resize(k_num_slowest_files);
+	}
+
+	return report;
+}
+
+bool CRunStats::RunStage(ERunStage stage, StageFn stage_fn, SImageJob& job,
+                         const SProgramOptions& program_options)
+{
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	const bool stage_success = stage_fn(job, program_options);
+	const double seconds =
+	    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	RecordLatency(stage, seconds);
+	job.processing_seconds += seconds;
+
+	if (stage_success && stage == ERunStage::READ)
+	{
+		AddRelaxed(m_bytes_read, job.file_data.size);
+	}
+	else if (stage_success && stage == ERunStage::WRITE)
+	{
+		for (const SJobOutput& output : job.outputs)
+		{
+			AddRelaxed(m_bytes_written, output.encoded_bytes ? output.encoded_bytes->size() : 0);
+		}
+	}
+
+	return stage_success;
+}
+
+void CRunStats::RecordLatency(ERunStage stage, double seconds)
+{
+	const uint64_t us = (uint64_t)std::max(seconds * 1e6, 0.0);
+	SHistogram& histogram = m_stages[(size_t)stage];
+
+	AddRelaxed(histogram.buckets[SHistogram::BucketIndex(us)], 1);
+	AddRelaxed(histogram.count, 1);
+	AddRelaxed(histogram.total_us, us);
+	if (us > LoadRelaxed(histogram.max_us))
+	{
+		histogram.max_us.store(us, std::memory_order_relaxed);
+	}
+}
+
+void CRunStats::RecordJob(const SImageJob& job)
+{
+	AddRelaxed(m_num_files, 1);
+	RecordStatus(job.status.return_code);
+	if (job.passed_through)
+	{
+		AddRelaxed(m_num_passed_through, 1);
+	}
+
+	if (m_slowest_files.size() < k_num_slowest_files ||
+	    job.processing_seconds > m_slowest_files.front().seconds)
+	{
+		if (m_slowest_files.size() == k_num_slowest_files)
+		{
+			std::pop_heap(m_slowest_files.begin(), m_slowest_files.end(), SlowerFile);
+			m_slowest_files.pop_back();
+		}
+		m_slowest_files.push_back({job.processing_seconds, job.path});
+		std::push_heap(m_slowest_files.begin(), m_slowest_files.end(), SlowerFile);
+	}
+}
+
+void CRunStats::RecordStatus(EReturnCode return_code)
+{
+	AddRelaxed(m_return_codes[std::min((size_t)return_code, k_num_return_codes - 1)], 1);
+}
+
+void WriteRunReportJson(std::ostream& stream, const SRunReport& report, double wall_seconds)
+{
+	const double seconds = std::max(wall_seconds, 1e-9);
+
+	std::ostringstream json;
+	json << std::fixed << std::setprecision(3);
+	json << "{\n";
+	json << "  \"wall_seconds\": " << wall_seconds << ",\n";
+	json << "  \"files\": " << report.num_files << ",\n";
+	json << "  \"files_per_second\": " << report.num_files / seconds << ",\n";
+	json << "  \"passed_through\": " << report.num_passed_through << ",\n";
+	json << "  \"bytes_read\": " << report.bytes_read << ",\n";
+	json << "  \"bytes_written\": " << report.bytes_written << ",\n";
+	json << "  \"read_mb_per_second\": " << report.bytes_read / 1e6 / seconds << ",\n";
+	json << "  \"write_mb_per_second\": " << report.bytes_written / 1e6 / seconds << ",\n";
+
+	if (report.shard_count > 1)
+	{
+		json << "  \"shard\": {\"index\": " << report.shard_index
+		     << ", \"count\": " << report.shard_count
+		     << ", \"other_shards_files\": " << report.num_other_shards << "},\n";
+	}
+
+	json << "  \"status\": {";
+	for (size_t i = 0; i < k_num_return_codes; ++i)
+	{
+		json << (i ? ", " : "") << '"' << ReturnCodeName((EReturnCode)i)
+		     << "\": " << report.return_codes[i];
+	}
+	json << "},\n";
+
+	// Stage totals are summed over threads, comparing them shows where the time went
+	json << "  \"stages\": {\n";
+	for (size_t stage = 0; stage < k_num_run_stages; ++stage)
+	{
+		const SLatencySummary& summary = report.stages[stage];
+		json << "    \"" << RunStageName((ERunStage)stage) << "\": {\"count\": " << summary.count
+		     << ", \"total_seconds\": " << summary.total_seconds
+		     << ", \"p50_ms\": " << summary.p50_seconds * 1e3
+		     << ", \"p99_ms\": " << summary.p99_seconds * 1e3
+		     << ", \"max_ms\": " << summary.max_seconds * 1e3 << "}"
+		     << (stage + 1 < k_num_run_stages ? ",\n" : "\n");
+	}
+	json << "  },\n";
+
+	json << "  \"slowest_files\": [";
+	for (size_t i = 0; i < report.slowest_files.size(); ++i)
+	{
+		const SSlowFile& slow_file = report.slowest_files[i];
+		json << (i ? ",\n" : "\n") << "    {\"path\": \"" << EscapeJson(slow_file.path)
+		     << "\", \"seconds\": " << slow_file.seconds << "}";
+	}
+	json << (report.slowest_files.empty() ? "]\n" : "\n  ]\n");
+	json << "}\n";
+
+	stream << json.str();
+}
+
+void WriteJobRecordJson(std::ostream& stream, const SImageJob& job)
+{
+	std::ostringstream json;
+	json << std::fixed << std::setprecision(6);
+	json << "{\"input\": \"" << EscapeJson(job.path) << "\", \"status\": \""
+	     << ReturnCodeName(job.status.return_code) << '"';
+
+	switch (job.status.return_code)
+	{
+	case EReturnCode::FILE_UNKNOWN_EXTENSION:
+		json << ", \"extension\": \"" << EscapeJson(job.status.detail) << '"';
+		break;
+	case EReturnCode::FILE_WRITE_ERROR:
+		json << ", \"failed_output\": \"" << EscapeJson(job.status.detail) << '"';
+		break;
+	default:
+		break;
+	}
+
+	if (job.source_width)
+	{
+		json << ", \"width\": " << job.source_width << ", \"height\": " << job.source_height;
+	}
+
+	if (job.status.return_code == EReturnCode::OK)
+	{
+		json << ", \"outputs\": [";
+		for (size_t i = 0; i < job.outputs.size(); ++i)
+		{
+			const SJobOutput& output = job.outputs[i];
+			json << (i ? ", " : "") << "{\"path\": \"" << EscapeJson(output.output_path)
+			     << "\", \"width\": " << output.size.width
+			     << ", \"height\": " << output.size.height << '}';
+		}
+		json << ']';
+	}
+
+	if (!job.duplicate_of.empty())
+	{
+		json << ", \"duplicate_of\": \"" << EscapeJson(job.duplicate_of) << '"';
+	}
+
+	if (job.passed_through)
+	{
+		json << ", \"passed_through\": true";
+	}
+
+	json << ", \"seconds\": " << job.processing_seconds << "}\n";
+
+	// Flushed right away, the consumer may be waiting for this record
+	std::lock_guard<std::mutex> lock(g_job_record_mutex);
+	stream << json.str() << std::flush;
+}
+
+CProgressReporter::CProgressReporter(uint32_t interval_seconds, std::ostream& stream)
+    : m_interval(std::max(interval_seconds, 1u)), m_stream(stream),
+      m_start(std::chrono::steady_clock::now())
+{
+	m_thread = std::thread([this]() { Run(); });
+}
+
+CProgressReporter::~CProgressReporter()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_stop_condition.notify_all();
+	m_thread.join();
+}
+
+void CProgressReporter::Run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_stop_condition.wait_for(lock, m_interval, [this]() { return m_stop; }))
+	{
+		const SRunReport report = CRunStats::Collect(false);
+		const double elapsed_seconds =
+		    std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+
+		uint64_t num_errors = 0;
+		for (size_t i = 0; i < k_num_return_codes; ++i)
+		{
+			num_errors += IsError((EReturnCode)i) ? report.return_codes[i] : 0;
+		}
+
+		// One line per report so it can be picked out of the log
+		std::ostringstream line;
+		line << std::fixed << std::setprecision(1);
+		line << "{\"progress\": {\"elapsed_seconds\": " << elapsed_seconds
+		     << ", \"files\": " << report.num_files
+		     << ", \"files_per_second\": " << report.num_files / elapsed_seconds
+		     << ", \"bytes_read\": " << report.bytes_read
+		     << ", \"bytes_written\": " << report.bytes_written << ", \"errors\": " << num_errors
+		     << "}}\n";
+		m_stream << line.str() << std::flush;
+	}
+}
@@ -0,0 +1,150 @@
+﻿// RunStats.h : Per-thread timing and counters, and the run report built from them.
+
+#pragma once
+
+#include "ImageResizer.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+enum class ERunStage
+{
+	READ,
+	DECODE,
+	RESIZE,
+	ENCODE,
+	WRITE,
+	// Time a file spent waiting for a worker, in front of the first stage or between stages
+	QUEUE_WAIT,
+	COUNT
+};
+
+const size_t k_num_run_stages = (size_t)ERunStage::COUNT;
+const size_t k_num_return_codes = (size_t)EReturnCode::UNKNOWN_ERROR + 1;
+
+const char* RunStageName(ERunStage stage);
+const char* ReturnCodeName(EReturnCode return_code);
+
+struct SLatencySummary
+{
+	uint64_t count{0};
+	double total_seconds{0.0};
+	// Percentiles are within about 6% of the exact value, the histogram's resolution
+	double p50_seconds{0.0};
+	double p99_seconds{0.0};
+	double max_seconds{0.0};
+};
+
+struct SSlowFile
+{
+	double seconds{0.0};
+	std::string path;
+};
+
+// Totals over the stats of all threads
+struct SRunReport
+{
+	uint64_t num_files{0};
+	// Files copied as they are because they already matched the outputs
+	uint64_t num_passed_through{0};
+	uint64_t bytes_read{0};
+	uint64_t bytes_written{0};
+	uint64_t return_codes[k_num_return_codes]{};
+	SLatencySummary stages[k_num_run_stages];
+	// Slowest files by the time spent in the stages, slowest first
+	std::vector<SSlowFile> slowest_files;
+	// --shard of the run, and the number of inputs it left to the other shards
+	uint32_t shard_index{0};
+	uint32_t shard_count{1};
+	uint64_t num_other_shards{0};
+};
+
+// Statistics of one thread. Only the owning thread writes, so recording never takes a lock,
+// and every counter is an atomic that others can read at any time for progress reports.
+//
+// The stats outlive their thread, so the final report also covers pool and pipeline
+// workers that have already exited.
+class CRunStats
+{
+public:
+	using StageFn = bool (*)(SImageJob&, const SProgramOptions&);
+
+	// Stats of the calling thread
+	static CRunStats& ThreadLocal();
+
+	// Sums up the stats of all threads. The slowest files are only collected if
+	// include_slowest_files is set, which must only be done once all workers are done.
+	static SRunReport Collect(bool include_slowest_files);
+
+	// Runs stage_fn on job and records how long it took, as well as the bytes it read or wrote
+	bool RunStage(ERunStage stage, StageFn stage_fn, SImageJob& job,
+	              const SProgramOptions& program_options);
+
+	void RecordLatency(ERunStage stage, double seconds);
+	// A file that went through the stages, successfully or not
+	void RecordJob(const SImageJob& job);
+	// An entry that was never turned into a job, e.g. an up to date file
+	void RecordStatus(EReturnCode return_code);
+
+	CRunStats(const CRunStats&) = delete;
+	CRunStats& operator=(const CRunStats&) = delete;
+
+private:
+	CRunStats() = default;
+
+	// Log-linear buckets, 8 per power of two, of the latency in microseconds
+	struct SHistogram
+	{
+		static const size_t k_num_buckets = 256;
+
+		std::atomic<uint64_t> buckets[k_num_buckets]{};
+		std::atomic<uint64_t> count{0};
+		std::atomic<uint64_t> total_us{0};
+		std::atomic<uint64_t> max_us{0};
+
+		static size_t BucketIndex(uint64_t us);
+		// Middle of the range of values that land in bucket
+		static double BucketValue(size_t bucket);
+	};
+
+	SHistogram m_stages[k_num_run_stages];
+	std::atomic<uint64_t> m_num_files{0};
+	std::atomic<uint64_t> m_num_passed_through{0};
+	std::atomic<uint64_t> m_bytes_read{0};
+	std::atomic<uint64_t> m_bytes_written{0};
+	std::atomic<uint64_t> m_return_codes[k_num_return_codes]{};
+	// Min-heap on seconds, the fastest of the slowest files on top
+	std::vector<SSlowFile> m_slowest_files;
+};
+
+void WriteRunReportJson(std::ostream& stream, const SRunReport& report, double wall_seconds);
+
+// Writes the result of a single job as one line of JSON, safe to call from any thread
+void WriteJobRecordJson(std::ostream& stream, const SImageJob& job);
+
+std::string EscapeJson(const std::string& str);
+
+// Prints a single line JSON summary of the run every interval_seconds until destroyed
+class CProgressReporter
+{
+public:
+	CProgressReporter(uint32_t interval_seconds, std::ostream& stream);
+	~CProgressReporter();
+
+	CProgressReporter(const CProgressReporter&) = delete;
+	CProgressReporter& operator=(const CProgressReporter&) = delete;
+
+private:
+	void Run();
+
+	const std::chrono::seconds m_interval;
+	std::ostream& m_stream;
+	const std::chrono::steady_clock::time_point m_start;
+	bool m_stop{false};
+	std::mutex m_mutex;
+	std::condition_variable m_stop_condition;
+	std::thread m_thread;
+};
@@ -0,0 +1,302 @@
+﻿#include "StatusLog.h"
+#include "RunStats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <sstream>
+
+namespace
+{
+// Bytes of records each worker can have queued before it has to wait for the writer
+const size_t k_ring_size = 1 << 16;
+// File names and details are cut to this many bytes in a record
+const size_t k_max_text_length = 4096;
+// The writer writes what was recorded at least this often
+const std::chrono::milliseconds k_flush_interval(100);
+// Entries listed as examples for each return code in the error summary
+const size_t k_max_error_examples = 3;
+
+std::atomic<uint64_t> g_next_log_id{1};
+
+// Followed by name_length bytes of the file name and detail_length bytes of the detail
+struct SRecordHeader
+{
+	uint32_t folder_id;
+	uint16_t name_length;
+	uint16_t detail_length;
+	EReturnCode return_code;
+};
+
+// Same filter as LogReturnStatus
+bool IsLogged(EReturnCode return_code, uint32_t verbose)
+{
+	switch (return_code)
+	{
+	case EReturnCode::OK:
+	case EReturnCode::FILE_UNKNOWN_EXTENSION:
+	case EReturnCode::FILE_UP_TO_DATE:
+		return verbose > 1;
+	default:
+		return verbose > 0;
+	}
+}
+
+bool IsError(EReturnCode return_code)
+{
+	return return_code == EReturnCode::FILE_READ_ERROR ||
+	       return_code == EReturnCode::FOLDER_READ_ERROR ||
+	       return_code == EReturnCode::FILE_WRITE_ERROR ||
+	       return_code == EReturnCode::UNKNOWN_ERROR;
+}
+} // namespace
+
+// Records of one worker. Only the worker moves head and only the writer moves tail, both
+// count the bytes ever written, so the difference is what's queued.
+struct CStatusLog::SThreadRing
+{
+	char bytes[k_ring_size];
+	std::atomic<uint64_t> head{0};
+	std::atomic<uint64_t> tail{0};
+	// Consecutive files are usually in the same folder, which then isn't looked up again
+	std::string last_folder{""};
+	uint32_t last_folder_id{0};
+
+	void CopyIn(uint64_t position, const void* data, size_t size)
+	{
+		const size_t offset = (size_t)(position % k_ring_size);
+		const size_t first = std::min(size, k_ring_size - offset);
+		memcpy(bytes + offset, data, first);
+		memcpy(bytes, (const char*)data + first, size - first);
+	}
+
+	void CopyOut(uint64_t position, void* data, size_t size) const
+	{
+		const size_t offset = (size_t)(position % k_ring_size);
+		const size_t first = std::min(size, k_ring_size - offset);
+		memcpy(data, bytes + offset, first);
+		memcpy((char*)data + first, bytes, size - first);
+	}
+};
+
+CStatusLog::CStatusLog(uint32_t verbose, std::ostream& stream)
+    : m_verbose(verbose), m_stream(stream), m_log_id(g_next_log_id++)
+{
+	// Entries without a folder get id 0
+	m_folders.push_back("");
+	m_folder_ids.emplace("", 0);
+
+	m_writer = std::thread([this]() { WriterThread(); });
+}
+
+CStatusLog::~CStatusLog()
+{
+	Close();
+}
+
+void CStatusLog::Record(std::string_view entry, const SReturnStatus& status)
+{
+	if (!IsLogged(status.return_code, m_verbose))
+	{
+		return;
+	}
+
+	const size_t separator = entry.find_last_of("/\\");
+	const std::string_view folder =
+	    separator == std::string_view::npos ? std::string_view() : entry.substr(0, separator + 1);
+	const std::string_view name =
+	    separator == std::string_view::npos ? entry : entry.substr(separator + 1);
+
+	SThreadRing& ring = ThreadRing();
+	if (folder != ring.last_folder)
+	{
+		ring.last_folder = std::string(folder);
+		ring.last_folder_id = InternFolder(folder);
+	}
+
+	SRecordHeader header{};
+	header.folder_id = ring.last_folder_id;
+	header.name_length = (uint16_t)std::min(name.size(), k_max_text_length);
+	header.detail_length = (uint16_t)std::min(status.detail.size(), k_max_text_length);
+	header.return_code = status.return_code;
+	const size_t size = sizeof(header) + header.name_length + header.detail_length;
+
+	const uint64_t head = ring.head.load(std::memory_order_relaxed);
+	const auto fits = [&ring, head, size]() {
+		return head + size - ring.tail.load(std::memory_order_acquire) <= k_ring_size;
+	};
+	if (!fits())
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_wake.notify_one();
+		m_drained.wait(lock, fits);
+	}
+
+	ring.CopyIn(head, &header, sizeof(header));
+	ring.CopyIn(head + sizeof(header), name.data(), header.name_length);
+	ring.CopyIn(head + sizeof(header) + header.name_length, status.detail.data(),
+	            header.detail_length);
+	ring.head.store(head + size, std::memory_order_release);
+}
+
+void CStatusLog::Close()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_closed)
+		{
+			return;
+		}
+		m_closed = true;
+		m_stop = true;
+	}
+	m_wake.notify_one();
+	m_writer.join();
+
+	// Whatever was recorded after the writer's last pass
+	if (DrainRings())
+	{
+		m_stream << m_batch;
+		m_batch.clear();
+	}
+	WriteErrorSummary();
+	m_stream.flush();
+}
+
+CStatusLog::SThreadRing& CStatusLog::ThreadRing()
+{
+	thread_local uint64_t cached_log_id = 0;
+	thread_local SThreadRing* cached_ring = nullptr;
+
+	if (cached_log_id != m_log_id)
+	{
+		std::unique_ptr<SThreadRing> ring = std::make_unique<SThreadRing>();
+		cached_ring = ring.get();
+		cached_log_id = m_log_id;
+
+		std::lock_guard<std::mutex> lock(m_rings_mutex);
+		m_rings.push_back(std::move(ring));
+	}
+	return *cached_ring;
+}
+
+uint32_t CStatusLog::InternFolder(std::string_view folder)
+{
+	std::lock_guard<std::mutex> lock(m_folders_mutex);
+	const std::string key(folder);
+	const std::unordered_map<std::string, uint32_t>::iterator it = m_folder_ids.find(key);
+	if (it != m_folder_ids.end())
+	{
+		return it->second;
+	}
+
+	const uint32_t folder_id = (uint32_t)m_folders.size();
+	m_folders.push_back(key);
+	m_folder_ids.emplace(key, folder_id);
+	return folder_id;
+}
+
+void CStatusLog::WriterThread()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_stop)
+	{
+		m_wake.wait_for(lock, k_flush_interval);
+		lock.unlock();
+
+		if (DrainRings())
+		{
+			m_stream << m_batch;
+			m_stream.flush();
+			m_batch.clear();
+		}
+
+		// Workers waiting for room check again under the lock, so none misses this
+		lock.lock();
+		m_drained.notify_all();
+	}
+}
+
+bool CStatusLog::DrainRings()
+{
+	std::vector<SThreadRing*> rings;
+	{
+		std::lock_guard<std::mutex> lock(m_rings_mutex);
+		for (const std::unique_ptr<SThreadRing>& ring : m_rings)
+		{
+			rings.push_back(ring.get());
+		}
+	}
+
+	std::ostringstream batch;
+	bool drained = false;
+	std::string entry;
+	SReturnStatus status;
+
+	std::lock_guard<std::mutex> lock(m_folders_mutex);
+	for (SThreadRing* ring : rings)
+	{
+		uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+		const uint64_t head = ring->head.load(std::memory_order_acquire);
+		while (tail < head)
+		{
+			SRecordHeader header;
+			ring->CopyOut(tail, &header, sizeof(header));
+			tail += sizeof(header);
+
+			entry = m_folders[header.folder_id];
+			const size_t folder_length = entry.size();
+			entry.resize(folder_length + header.name_length);
+			ring->CopyOut(tail, &entry[folder_length], header.name_length);
+			tail += header.name_length;
+
+			status.return_code = header.return_code;
+			status.detail.resize(header.detail_length);
+			ring->CopyOut(tail, &status.detail[0], header.detail_length);
+			tail += header.detail_length;
+
+			LogReturnStatus(entry, status, m_verbose, batch);
+
+			if (IsError(header.return_code))
+			{
+				const size_t code = (size_t)header.return_code;
+				m_num_errors[code]++;
+				if (m_error_examples[code].size() < k_max_error_examples)
+				{
+					m_error_examples[code].push_back(entry);
+				}
+			}
+			drained = true;
+		}
+		ring->tail.store(tail, std::memory_order_release);
+	}
+
+	m_batch += batch.str();
+	return drained;
+}
+
+void CStatusLog::WriteErrorSummary()
+{
+	bool any_errors = false;
+	for (size_t code = 0; code < std::size(m_num_errors); ++code)
+	{
+		if (!m_num_errors[code])
+		{
+			continue;
+		}
+
+		if (!any_errors)
+		{
+			m_stream << "Errors by type:\n";
+			any_errors = true;
+		}
+
+		m_stream << "  " << ReturnCodeName((EReturnCode)code) << ": " << m_num_errors[code]
+		         << (m_num_errors[code] == 1 ? " entry" : " entries") << ", e.g.";
+		for (size_t i = 0; i < m_error_examples[code].size(); ++i)
+		{
+			m_stream << (i ? ", \"" : " \"") << m_error_examples[code][i] << '"';
+		}
+		m_stream << '\n';
+	}
+}
@@ -0,0 +1,76 @@
+﻿// StatusLog.h : Batched log of the per-file results, written by a single thread.
+
+#pragma once
+
+#include "ImageResizer.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+// Writes the log lines of all worker threads from one writer thread (--verbose).
+//
+// Workers append a compact record for each result to a ring buffer of their own: the return
+// code, the id of the entry's folder and the file name. Folders are interned once, so a
+// record doesn't repeat them. The writer drains every ring in batches, formats the records
+// and writes each batch with a single call, so lines never interleave and workers never
+// wait on the stream. A worker only blocks if its ring is full.
+//
+// The writer also counts the errors, Close() ends the log with a summary of them grouped
+// by return code.
+class CStatusLog
+{
+public:
+	CStatusLog(uint32_t verbose, std::ostream& stream);
+	~CStatusLog();
+
+	CStatusLog(const CStatusLog&) = delete;
+	CStatusLog& operator=(const CStatusLog&) = delete;
+
+	// Queues the result of an entry, results that verbose doesn't log are dropped right away
+	void Record(std::string_view entry, const SReturnStatus& status);
+
+	// Writes the queued records and the error summary, then stops the writer. Nothing may be
+	// recorded anymore once it is called.
+	void Close();
+
+private:
+	struct SThreadRing;
+
+	SThreadRing& ThreadRing();
+	uint32_t InternFolder(std::string_view folder);
+	void WriterThread();
+	// Formats the records of all rings into m_batch, returns false if there weren't any
+	bool DrainRings();
+	void WriteErrorSummary();
+
+	const uint32_t m_verbose;
+	std::ostream& m_stream;
+	// Tells apart the rings of this log from those of earlier ones in the threads' caches
+	const uint64_t m_log_id;
+
+	std::mutex m_rings_mutex;
+	std::vector<std::unique_ptr<SThreadRing>> m_rings;
+
+	// Folder names by id, a deque so the writer's references stay valid while workers add
+	std::mutex m_folders_mutex;
+	std::deque<std::string> m_folders;
+	std::unordered_map<std::string, uint32_t> m_folder_ids;
+
+	// Only touched by the writer thread
+	std::string m_batch;
+	uint64_t m_num_errors[(size_t)EReturnCode::UNKNOWN_ERROR + 1]{};
+	std::vector<std::string> m_error_examples[(size_t)EReturnCode::UNKNOWN_ERROR + 1];
+
+	// The writer sleeps on m_wake until a ring fills up, Close or the flush interval, workers
+	// with a full ring sleep on m_drained
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_drained;
+	bool m_stop{false};
+	bool m_closed{false};
+	std::thread m_writer;
+};
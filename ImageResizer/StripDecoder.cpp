@@ -0,0 +1,353 @@
+﻿#include "StripDecoder.h"
+#include "ImageResizerLib.h"
+
+#include <cstring>
+
+#if IMAGERESIZER_HAVE_LIBJPEG
+#include <csetjmp>
+#include <cstdio>
+#include <jpeglib.h>
+#endif
+
+#if IMAGERESIZER_HAVE_LIBPNG
+#include <png.h>
+#endif
+
+namespace
+{
+#if IMAGERESIZER_HAVE_LIBJPEG
+struct SJpegErrorManager
+{
+	jpeg_error_mgr base;
+	jmp_buf jump_buffer;
+};
+
+void JpegErrorExit(j_common_ptr cinfo)
+{
+	longjmp(((SJpegErrorManager*)cinfo->err)->jump_buffer, 1);
+}
+
+void JpegOutputMessage(j_common_ptr)
+{
+	// Warnings about corrupt data are reported through the return status instead
+}
+
+class CJpegStripDecoder : public CStripDecoder
+{
+public:
+	~CJpegStripDecoder() override
+	{
+		if (m_created)
+		{
+			jpeg_destroy_decompress(&m_cinfo);
+		}
+	}
+
+	bool Start(const SFileData& file_data, int reduction, bool native_layout)
+	{
+		m_cinfo.err = jpeg_std_error(&m_error.base);
+		m_error.base.error_exit = JpegErrorExit;
+		m_error.base.output_message = JpegOutputMessage;
+		if (setjmp(m_error.jump_buffer))
+		{
+			return false;
+		}
+
+		jpeg_create_decompress(&m_cinfo);
+		m_created = true;
+		jpeg_mem_src(&m_cinfo, (unsigned char*)file_data.data, (unsigned long)file_data.size);
+		jpeg_save_markers(&m_cinfo, JPEG_APP0 + 1, 0xffff);
+		jpeg_read_header(&m_cinfo, TRUE);
+
+		// libjpeg can't convert these to RGB, imdecode can
+		if (m_cinfo.jpeg_color_space == JCS_CMYK || m_cinfo.jpeg_color_space == JCS_YCCK)
+		{
+			return false;
+		}
+
+		for (jpeg_saved_marker_ptr marker = m_cinfo.marker_list; marker; marker = marker->next)
+		{
+			if (marker->marker == JPEG_APP0 + 1 && marker->data_length > 6 &&
+			    memcmp(marker->data, "Exif\0\0", 6) == 0)
+			{
+				m_orientation = ParseExifOrientation(marker->data + 6, marker->data_length - 6);
+			}
+		}
+
+		if (native_layout && m_cinfo.jpeg_color_space == JCS_GRAYSCALE)
+		{
+			m_cinfo.out_color_space = JCS_GRAYSCALE;
+			m_channels = 1;
+		}
+		else
+		{
+#ifdef JCS_EXTENSIONS
+			m_cinfo.out_color_space = JCS_EXT_BGR;
+#else
+			m_cinfo.out_color_space = JCS_RGB;
+			m_swap_red_blue = true;
+#endif
+		}
+		m_cinfo.scale_num = 1;
+		m_cinfo.scale_denom = (unsigned int)reduction;
+		jpeg_start_decompress(&m_cinfo);
+
+		m_width = (int)m_cinfo.output_width;
+		m_height = (int)m_cinfo.output_height;
+		return m_cinfo.output_components == m_channels;
+	}
+
+	int ReadRows(cv::Mat& strip) override
+	{
+		if (setjmp(m_error.jump_buffer))
+		{
+			m_failed = true;
+			return 0;
+		}
+
+		int num_rows = 0;
+		while (num_rows < strip.rows && m_cinfo.output_scanline < m_cinfo.output_height)
+		{
+			JSAMPROW row = strip.ptr<uchar>(num_rows);
+			if (jpeg_read_scanlines(&m_cinfo, &row, 1) != 1)
+			{
+				break;
+			}
+			if (m_swap_red_blue)
+			{
+				for (int x = 0; x < m_width; ++x)
+				{
+					std::swap(row[x * 3], row[x * 3 + 2]);
+				}
+			}
+			num_rows++;
+		}
+		return num_rows;
+	}
+
+private:
+	jpeg_decompress_struct m_cinfo{};
+	SJpegErrorManager m_error{};
+	bool m_created{false};
+	bool m_swap_red_blue{false};
+};
+#endif
+
+#if IMAGERESIZER_HAVE_LIBPNG
+void PngError(png_structp png, png_const_charp)
+{
+	longjmp(png_jmpbuf(png), 1);
+}
+
+void PngWarning(png_structp, png_const_charp)
+{
+}
+
+class CPngStripDecoder : public CStripDecoder
+{
+public:
+	~CPngStripDecoder() override
+	{
+		if (m_png)
+		{
+			png_destroy_read_struct(&m_png, m_info ? &m_info : nullptr, nullptr);
+		}
+	}
+
+	bool Start(const SFileData& file_data, bool native_layout)
+	{
+		m_cursor = file_data.data;
+		m_end = file_data.data + file_data.size;
+
+		m_png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, PngError, PngWarning);
+		m_info = m_png ? png_create_info_struct(m_png) : nullptr;
+		if (!m_info)
+		{
+			return false;
+		}
+		if (setjmp(png_jmpbuf(m_png)))
+		{
+			return false;
+		}
+
+		png_set_read_fn(m_png, this, ReadData);
+		png_read_info(m_png, m_info);
+
+		// Interlaced images only have their final rows after the last pass
+		if (png_get_interlace_type(m_png, m_info) != PNG_INTERLACE_NONE)
+		{
+			return false;
+		}
+
+		const int color_type = png_get_color_type(m_png, m_info);
+		png_set_strip_16(m_png);
+		if (native_layout)
+		{
+			// Same layouts as IMREAD_UNCHANGED: grayscale stays one channel, anything with
+			// alpha or a transparent color becomes BGRA
+			const bool has_alpha = (color_type & PNG_COLOR_MASK_ALPHA) ||
+			                       (color_type != PNG_COLOR_TYPE_GRAY &&
+			                        png_get_valid(m_png, m_info, PNG_INFO_tRNS));
+			if (color_type == PNG_COLOR_TYPE_PALETTE)
+			{
+				png_set_palette_to_rgb(m_png);
+			}
+			if (color_type == PNG_COLOR_TYPE_GRAY)
+			{
+				png_set_expand_gray_1_2_4_to_8(m_png);
+				m_channels = 1;
+			}
+			if (has_alpha)
+			{
+				png_set_tRNS_to_alpha(m_png);
+				if (color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+				{
+					png_set_gray_to_rgb(m_png);
+				}
+				m_channels = 4;
+			}
+		}
+		else
+		{
+			// Same conversions as IMREAD_COLOR: no alpha, gray expanded to BGR
+			png_set_expand(m_png);
+			png_set_strip_alpha(m_png);
+			if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+			{
+				png_set_gray_to_rgb(m_png);
+			}
+		}
+		png_set_bgr(m_png);
+		png_read_update_info(m_png, m_info);
+
+		m_width = (int)png_get_image_width(m_png, m_info);
+		m_height = (int)png_get_image_height(m_png, m_info);
+		return png_get_rowbytes(m_png, m_info) == (size_t)m_width * m_channels;
+	}
+
+	int ReadRows(cv::Mat& strip) override
+	{
+		if (setjmp(png_jmpbuf(m_png)))
+		{
+			m_failed = true;
+			return 0;
+		}
+
+		int num_rows = 0;
+		while (num_rows < strip.rows && m_next_row < m_height)
+		{
+			png_read_row(m_png, strip.ptr<uchar>(num_rows), nullptr);
+			m_next_row++;
+			num_rows++;
+		}
+		return num_rows;
+	}
+
+private:
+	static void ReadData(png_structp png, png_bytep out, png_size_t size)
+	{
+		CPngStripDecoder* decoder = (CPngStripDecoder*)png_get_io_ptr(png);
+		if ((size_t)(decoder->m_end - decoder->m_cursor) < size)
+		{
+			png_error(png, "truncated file");
+		}
+		memcpy(out, decoder->m_cursor, size);
+		decoder->m_cursor += size;
+	}
+
+	png_structp m_png{nullptr};
+	png_infop m_info{nullptr};
+	const unsigned char* m_cursor{nullptr};
+	const unsigned char* m_end{nullptr};
+	int m_next_row{0};
+};
+#endif
+} // namespace
+
+std::unique_ptr<CStripDecoder> CStripDecoder::Create(const SFileData& file_data,
+                                                     EFileType file_type, int reduction,
+                                                     bool native_layout)
+{
+	switch (file_type)
+	{
+#if IMAGERESIZER_HAVE_LIBJPEG
+	case EFileType::IMAGE_JPEG:
+	{
+		std::unique_ptr<CJpegStripDecoder> decoder = std::make_unique<CJpegStripDecoder>();
+		if (decoder->Start(file_data, reduction, native_layout))
+		{
+			return decoder;
+		}
+		return nullptr;
+	}
+#endif
+#if IMAGERESIZER_HAVE_LIBPNG
+	case EFileType::IMAGE_PNG:
+	{
+		std::unique_ptr<CPngStripDecoder> decoder = std::make_unique<CPngStripDecoder>();
+		if (decoder->Start(file_data, native_layout))
+		{
+			return decoder;
+		}
+		return nullptr;
+	}
+#endif
+	default:
+		(void)file_data;
+		(void)reduction;
+		(void)native_layout;
+		return nullptr;
+	}
+}
+
+bool CStripDecoder::IsAvailable(EFileType file_type)
+{
+	switch (file_type)
+	{
+#if IMAGERESIZER_HAVE_LIBJPEG
+	case EFileType::IMAGE_JPEG:
+		return true;
+#endif
+#if IMAGERESIZER_HAVE_LIBPNG
+	case EFileType::IMAGE_PNG:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+void ApplyExifOrientation(const cv::Mat& src, int orientation, cv::Mat& dst)
+{
+	// Same transforms as imdecode
+	switch (orientation)
+	{
+	case 2:
+		cv::flip(src, dst, 1);
+		break;
+	case 3:
+		cv::flip(src, dst, -1);
+		break;
+	case 4:
+		cv::flip(src, dst, 0);
+		break;
+	case 5:
+		cv::transpose(src, dst);
+		break;
+	case 6:
+		cv::transpose(src, dst);
+		cv::flip(dst, dst, 1);
+		break;
+	case 7:
+		cv::transpose(src, dst);
+		cv::flip(dst, dst, -1);
+		break;
+	case 8:
+		cv::transpose(src, dst);
+		cv::flip(dst, dst, 0);
+		break;
+	default:
+		src.copyTo(dst);
+		break;
+	}
+}
@@ -0,0 +1,51 @@
+﻿// StripDecoder.h : Decodes JPEG and PNG files a few rows at a time.
+
+#pragma once
+
+#include "ImageResizerTypes.h"
+
+// Decodes an image top to bottom in strips of rows, as 8-bit BGR like IMREAD_COLOR or in the
+// channel layout of the file, so images that don't fit in memory can still be resized (see
+// CStreamingResampler). 16 bit PNGs are reduced to 8 bit. Only available if the build found
+// libjpeg and libpng.
+class CStripDecoder
+{
+public:
+	virtual ~CStripDecoder() = default;
+
+	// Returns nullptr if the file can't be decoded in strips, e.g. a CMYK JPEG, an
+	// interlaced PNG or a build without the library. imdecode has to handle those.
+	// JPEGs are reduced by 1/reduction while decoding, see ChooseJpegReduction.
+	// native_layout keeps grayscale as one channel and alpha as BGRA, like imdecode does with
+	// the flags DecodeImage picks.
+	static std::unique_ptr<CStripDecoder> Create(const SFileData& file_data,
+	                                             EFileType file_type, int reduction,
+	                                             bool native_layout);
+
+	// True if this build has a strip decoder for file_type
+	static bool IsAvailable(EFileType file_type);
+
+	// Decodes the next rows into the top of strip, which has to be CV_8UC(Channels()) and
+	// Width() wide.
+	// Returns the number of rows decoded, 0 once all of them were or on errors.
+	virtual int ReadRows(cv::Mat& strip) = 0;
+
+	int Width() const { return m_width; }
+	int Height() const { return m_height; }
+	// 1 (grayscale), 3 (BGR) or 4 (BGRA)
+	int Channels() const { return m_channels; }
+	// EXIF orientation (1-8), imdecode applies it after decoding
+	int Orientation() const { return m_orientation; }
+	// True if decoding stopped because the file is corrupt or truncated
+	bool Failed() const { return m_failed; }
+
+protected:
+	int m_width{0};
+	int m_height{0};
+	int m_channels{3};
+	int m_orientation{1};
+	bool m_failed{false};
+};
+
+// Transforms src, which was decoded as stored, to how it has to be displayed
+void ApplyExifOrientation(const cv::Mat& src, int orientation, cv::Mat& dst);
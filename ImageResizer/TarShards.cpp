@@ -0,0 +1,281 @@
+﻿#include "TarShards.h"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+
+namespace
+{
+const size_t k_tar_block_size = 512;
+
+// Writes value as a zero padded octal number that fills field, NUL terminated
+void WriteOctal(char* field, size_t field_size, uint64_t value)
+{
+	snprintf(field, field_size, "%0*llo", (int)(field_size - 1), (unsigned long long)value);
+}
+
+// ustar header of a single member. name has to fit in 100 bytes and prefix in 155.
+void MakeTarHeader(char (&block)[k_tar_block_size], const std::string& name,
+                   const std::string& prefix, uint64_t size, int64_t mtime, char type_flag)
+{
+	memset(block, 0, sizeof(block));
+	memcpy(block, name.data(), name.size());
+	WriteOctal(block + 100, 8, 0644);
+	WriteOctal(block + 108, 8, 0);
+	WriteOctal(block + 116, 8, 0);
+	WriteOctal(block + 124, 12, size);
+	WriteOctal(block + 136, 12, (uint64_t)mtime);
+	block[156] = type_flag;
+	memcpy(block + 257, "ustar", 6);
+	memcpy(block + 263, "00", 2);
+	memcpy(block + 345, prefix.data(), prefix.size());
+
+	// The checksum is computed with its own field filled with spaces
+	memset(block + 148, ' ', 8);
+	uint32_t checksum = 0;
+	for (size_t i = 0; i < k_tar_block_size; ++i)
+	{
+		checksum += (unsigned char)block[i];
+	}
+	snprintf(block + 148, 7, "%06o", checksum);
+	block[155] = ' ';
+}
+
+// "<length> <key>=<value>\n", where length counts the whole record including itself
+std::string MakePaxRecord(const std::string& key, const std::string& value)
+{
+	const size_t payload_size = key.size() + value.size() + 3;
+	size_t record_size = payload_size + std::to_string(payload_size).size();
+	record_size = payload_size + std::to_string(record_size).size();
+	return std::to_string(record_size) + ' ' + key + '=' + value + '\n';
+}
+} // namespace
+
+// One archive, only ever written by one thread at a time
+class CTarShard
+{
+public:
+	explicit CTarShard(const std::string& base_path)
+	    : m_path(base_path + ".tar"), m_index_path(base_path + ".idx")
+	{
+	}
+
+	bool Open()
+	{
+		m_stream.open(m_path, std::ios::binary | std::ios::trunc);
+		return (bool)m_stream;
+	}
+
+	bool Append(const std::string& name, const ByteBuffer& bytes, int64_t mtime)
+	{
+		char block[k_tar_block_size];
+		std::string prefix;
+		std::string header_name = name;
+
+		if (name.size() > 100)
+		{
+			// Split at a '/' into the ustar prefix and name fields if possible,
+			// otherwise put the whole name in a pax extended header
+			const size_t split = name.find('/', name.size() - 101);
+			if (split != std::string::npos && split <= 155)
+			{
+				prefix = name.substr(0, split);
+				header_name = name.substr(split + 1);
+			}
+			else
+			{
+				const std::string pax_record = MakePaxRecord("path", name);
+				MakeTarHeader(block, "././@PaxHeader", "", pax_record.size(), mtime, 'x');
+				Write(block, sizeof(block));
+				Write(pax_record.data(), pax_record.size());
+				Pad();
+				header_name = name.substr(name.size() - 100);
+			}
+		}
+
+		MakeTarHeader(block, header_name, prefix, bytes.size(), mtime, '0');
+		Write(block, sizeof(block));
+
+		m_index += name + '\t' + std::to_string(m_size) + '\t' + std::to_string(bytes.size()) +
+		           '\n';
+		Write(bytes.data(), bytes.size());
+		Pad();
+
+		return (bool)m_stream;
+	}
+
+	// Ends the archive and writes the index next to it
+	bool Finish()
+	{
+		const char end_blocks[2 * k_tar_block_size]{};
+		Write(end_blocks, sizeof(end_blocks));
+		m_stream.close();
+
+		std::ofstream index_stream(m_index_path, std::ios::binary | std::ios::trunc);
+		index_stream.write(m_index.data(), m_index.size());
+		index_stream.close();
+
+		return m_stream && index_stream;
+	}
+
+	const std::string& Path() const { return m_path; }
+	uint64_t Size() const { return m_size; }
+
+	uint32_t num_images{0};
+
+private:
+	void Write(const void* data, size_t size)
+	{
+		m_stream.write((const char*)data, size);
+		m_size += size;
+	}
+
+	// Members start at block boundaries
+	void Pad()
+	{
+		const char zeros[k_tar_block_size]{};
+		const size_t remainder = (size_t)(m_size % k_tar_block_size);
+		if (remainder)
+		{
+			Write(zeros, k_tar_block_size - remainder);
+		}
+	}
+
+	const std::string m_path;
+	const std::string m_index_path;
+	std::ofstream m_stream;
+	// Bytes written so far, i.e. the offset of whatever comes next
+	uint64_t m_size{0};
+	std::string m_index;
+};
+
+CTarShardSet::CTarShardSet(std::string output_folder, std::string name_suffix,
+                           uint32_t max_images, uint64_t max_bytes)
+    : m_output_folder(std::move(output_folder)), m_name_suffix(std::move(name_suffix)),
+      m_max_images(std::max(max_images, 1u)), m_max_bytes(max_bytes),
+      m_mtime((int64_t)time(nullptr))
+{
+}
+
+CTarShardSet::~CTarShardSet()
+{
+	Close();
+}
+
+bool CTarShardSet::Append(const std::vector<SJobOutput>& outputs, std::string& shard_path)
+{
+	std::unique_ptr<CTarShard> shard;
+	uint32_t shard_index = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_idle_shards.empty())
+		{
+			shard = std::move(m_idle_shards.back());
+			m_idle_shards.pop_back();
+		}
+		else
+		{
+			shard_index = m_next_shard_index++;
+			m_stats.num_shards++;
+		}
+	}
+
+	if (!shard)
+	{
+		char shard_name[32];
+		snprintf(shard_name, sizeof(shard_name), "shard-%06u", shard_index);
+		shard = std::make_unique<CTarShard>(
+		    (fs::path(m_output_folder) / (shard_name + m_name_suffix)).string());
+		if (!shard->Open())
+		{
+			shard_path = shard->Path();
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_failed = true;
+			return false;
+		}
+	}
+
+	shard_path = shard->Path();
+
+	bool success = true;
+	uint64_t num_bytes = 0;
+	for (const SJobOutput& output : outputs)
+	{
+		success = success && shard->Append(output.output_path, *output.encoded_bytes, m_mtime);
+		num_bytes += output.encoded_bytes->size();
+	}
+	shard->num_images++;
+
+	// A shard that failed is finished right away, so at least what's in it can be read
+	const bool full =
+	    !success || shard->num_images >= m_max_images || shard->Size() >= m_max_bytes;
+	if (full)
+	{
+		success = shard->Finish() && success;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (success)
+	{
+		m_stats.num_images++;
+		m_stats.num_members += outputs.size();
+		m_stats.num_bytes += num_bytes;
+	}
+	else
+	{
+		m_failed = true;
+	}
+
+	if (!full)
+	{
+		m_idle_shards.push_back(std::move(shard));
+	}
+
+	return success;
+}
+
+bool CTarShardSet::Close()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (std::unique_ptr<CTarShard>& shard : m_idle_shards)
+	{
+		if (!shard->Finish())
+		{
+			m_failed = true;
+		}
+	}
+	m_idle_shards.clear();
+
+	return !m_failed;
+}
+
+STarShardStats CTarShardSet::Stats() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_stats;
+}
+
+std::string MakeArchiveMemberName(const std::string_view path, uint32_t number_of_input_entries)
+{
+	// Archives can't hold absolute paths or ones going up, keep the rest
+	std::vector<std::string> parts;
+	for (const fs::path& part : fs::path(path).lexically_normal().relative_path())
+	{
+		const std::string part_str = part.string();
+		if (!part_str.empty() && part_str != "." && part_str != "..")
+		{
+			parts.push_back(part_str);
+		}
+	}
+
+	// If there's only one argument, the first folder is common to all the inputs
+	const size_t first_part = (number_of_input_entries == 1 && parts.size() > 1) ? 1 : 0;
+
+	std::string member_name;
+	for (size_t i = first_part; i < parts.size(); ++i)
+	{
+		member_name += (i > first_part ? "/" : "") + parts[i];
+	}
+	return member_name;
+}
@@ -0,0 +1,65 @@
+﻿// TarShards.h : Size-bounded tar archives as an output format (--output-format=tar).
+
+#pragma once
+
+#include "ImageResizer.h"
+
+#include <mutex>
+
+class CTarShard;
+
+struct STarShardStats
+{
+	uint32_t num_shards{0};
+	uint64_t num_images{0};
+	uint64_t num_members{0};
+	uint64_t num_bytes{0};
+};
+
+// Writes the outputs into tar archives named shard-000000.tar, shard-000001.tar... in the
+// output folder, WebDataset-style, with name_suffix after the number (see ShardSuffix). A
+// shard is closed once it holds max_images images or max_bytes bytes, and an index listing
+// the offset and size of each member is written next to it (shard-000000.idx, one
+// "name<tab>offset<tab>size" line per member).
+//
+// Each writer takes a shard nobody else is writing to and gives it back when it's done,
+// so shards are written sequentially without any locking and there are only as many
+// shards open as there are threads writing at once.
+class CTarShardSet
+{
+public:
+	CTarShardSet(std::string output_folder, std::string name_suffix, uint32_t max_images,
+	             uint64_t max_bytes);
+	~CTarShardSet();
+
+	CTarShardSet(const CTarShardSet&) = delete;
+	CTarShardSet& operator=(const CTarShardSet&) = delete;
+
+	// Appends the encoded outputs of one image, named by their output_path, as consecutive
+	// members of the same shard. shard_path is the shard they went to. Thread-safe.
+	bool Append(const std::vector<SJobOutput>& outputs, std::string& shard_path);
+
+	// Finishes all the shards that are still open
+	bool Close();
+
+	STarShardStats Stats() const;
+
+private:
+	const std::string m_output_folder;
+	const std::string m_name_suffix;
+	const uint32_t m_max_images;
+	const uint64_t m_max_bytes;
+	// Modification time of all the members
+	const int64_t m_mtime;
+
+	mutable std::mutex m_mutex;
+	// Open shards that nobody is writing to at the moment
+	std::vector<std::unique_ptr<CTarShard>> m_idle_shards;
+	uint32_t m_next_shard_index{0};
+	STarShardStats m_stats;
+	bool m_failed{false};
+};
+
+// Name of an input's output inside the archives, its path relative to the input
+// arguments like --output-format=mirror would put it in the output folder
+std::string MakeArchiveMemberName(const std::string_view path, uint32_t number_of_input_entries);
@@ -0,0 +1,350 @@
+﻿#include "TensorOutput.h"
+#include "FileIO.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#if IMAGERESIZER_HAVE_POSIX_IO
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+// Room for the magic, version, header length and the header dict, keeps the
+// rows 64-byte aligned as the format asks for
+const size_t k_npy_header_size = 128;
+
+// Rows the arrays are first preallocated for, each time they fill up the room is doubled
+const uint64_t k_min_preallocated_rows = 256;
+
+std::string MakeNpyHeader(uint64_t num_rows, int height, int width)
+{
+	std::string header("\x93NUMPY\x01\x00", 8);
+	std::string dict = "{'descr': '|u1', 'fortran_order': False, 'shape': (" +
+	                   std::to_string(num_rows) + ", " + std::to_string(height) + ", " +
+	                   std::to_string(width) + ", 3), }";
+
+	// The dict is padded with spaces and ends with a newline
+	const size_t dict_size = k_npy_header_size - header.size() - 2;
+	dict.resize(dict_size - 1, ' ');
+	dict += '\n';
+
+	header += (char)(dict_size & 0xff);
+	header += (char)(dict_size >> 8);
+	return header + dict;
+}
+} // namespace
+
+// A single .npy array that rows are written into at fixed offsets
+class CTensorFile
+{
+public:
+	CTensorFile(std::string path, const SOutputSpec& output_spec)
+	    : m_path(std::move(path)), m_width((int)output_spec.target_width),
+	      m_height((int)output_spec.target_height),
+	      m_row_size((uint64_t)output_spec.target_width * output_spec.target_height * 3)
+	{
+	}
+
+	~CTensorFile() { CloseFile(); }
+
+	bool Open()
+	{
+#if IMAGERESIZER_HAVE_POSIX_IO
+		m_fd = open(m_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		return m_fd >= 0 && WriteAt(0, MakeNpyHeader(0, m_height, m_width).data(),
+		                            k_npy_header_size);
+#else
+		m_stream.open(m_path, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+		return m_stream && WriteAt(0, MakeNpyHeader(0, m_height, m_width).data(),
+		                           k_npy_header_size);
+#endif
+	}
+
+	bool WriteRow(uint64_t row, const cv::Mat& rgb)
+	{
+		return rgb.cols == m_width && rgb.rows == m_height && rgb.type() == CV_8UC3 &&
+		       rgb.isContinuous() &&
+		       WriteAt(k_npy_header_size + row * m_row_size, rgb.data, (size_t)m_row_size);
+	}
+
+	// Makes room for num_rows rows, so that writing them neither extends the file nor
+	// scatters it over the disk
+	bool Preallocate(uint64_t num_rows)
+	{
+		const uint64_t size = k_npy_header_size + num_rows * m_row_size;
+#if IMAGERESIZER_HAVE_POSIX_IO && defined(__linux__)
+		return posix_fallocate(m_fd, 0, (off_t)size) == 0;
+#elif IMAGERESIZER_HAVE_POSIX_IO
+		return ftruncate(m_fd, (off_t)size) == 0;
+#else
+		// Streams grow as they are written
+		(void)size;
+		return true;
+#endif
+	}
+
+	// Copies row from over row to
+	bool MoveRow(uint64_t from, uint64_t to)
+	{
+		thread_local std::vector<unsigned char> row;
+		row.resize((size_t)m_row_size);
+		return ReadAt(k_npy_header_size + from * m_row_size, row.data(), row.size()) &&
+		       WriteAt(k_npy_header_size + to * m_row_size, row.data(), row.size());
+	}
+
+	// Writes the final shape and trims whatever is past the last row
+	bool Close(uint64_t num_rows)
+	{
+		const bool success =
+		    WriteAt(0, MakeNpyHeader(num_rows, m_height, m_width).data(), k_npy_header_size);
+		if (!CloseFile() || !success)
+		{
+			return false;
+		}
+
+		std::error_code ec;
+		fs::resize_file(m_path, k_npy_header_size + num_rows * m_row_size, ec);
+		return !ec;
+	}
+
+	const std::string& Path() const { return m_path; }
+
+private:
+	bool WriteAt(uint64_t offset, const void* data, size_t size)
+	{
+#if IMAGERESIZER_HAVE_POSIX_IO
+		const char* cursor = (const char*)data;
+		while (size > 0)
+		{
+			const ssize_t written = pwrite(m_fd, cursor, size, (off_t)offset);
+			if (written <= 0)
+			{
+				return false;
+			}
+			cursor += written;
+			offset += (uint64_t)written;
+			size -= (size_t)written;
+		}
+		return true;
+#else
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stream.seekp((std::streamoff)offset);
+		m_stream.write((const char*)data, (std::streamsize)size);
+		return (bool)m_stream;
+#endif
+	}
+
+	bool ReadAt(uint64_t offset, void* data, size_t size)
+	{
+#if IMAGERESIZER_HAVE_POSIX_IO
+		char* cursor = (char*)data;
+		while (size > 0)
+		{
+			const ssize_t read_size = pread(m_fd, cursor, size, (off_t)offset);
+			if (read_size <= 0)
+			{
+				return false;
+			}
+			cursor += read_size;
+			offset += (uint64_t)read_size;
+			size -= (size_t)read_size;
+		}
+		return true;
+#else
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stream.seekg((std::streamoff)offset);
+		m_stream.read((char*)data, (std::streamsize)size);
+		return (bool)m_stream;
+#endif
+	}
+
+	bool CloseFile()
+	{
+#if IMAGERESIZER_HAVE_POSIX_IO
+		const bool success = m_fd < 0 || close(m_fd) == 0;
+		m_fd = -1;
+		return success;
+#else
+		if (m_stream.is_open())
+		{
+			m_stream.close();
+		}
+		return (bool)m_stream;
+#endif
+	}
+
+	const std::string m_path;
+	const int m_width;
+	const int m_height;
+	const uint64_t m_row_size;
+#if IMAGERESIZER_HAVE_POSIX_IO
+	int m_fd{-1};
+#else
+	std::mutex m_mutex;
+	std::fstream m_stream;
+#endif
+};
+
+CTensorOutputSet::CTensorOutputSet(const SProgramOptions& program_options)
+{
+	for (const SOutputSpec& output_spec : program_options.outputs)
+	{
+		const std::string& output_folder = output_spec.output_folder.empty()
+		                                       ? program_options.output_folder
+		                                       : output_spec.output_folder;
+		const fs::path path = fs::path(output_folder) / ("images" + output_spec.suffix +
+		                                                 ShardSuffix(program_options) + ".npy");
+		m_files.push_back(std::make_unique<CTensorFile>(path.string(), output_spec));
+	}
+}
+
+CTensorOutputSet::~CTensorOutputSet()
+{
+	Close();
+}
+
+bool CTensorOutputSet::Open(std::string& failed_path)
+{
+	for (std::unique_ptr<CTensorFile>& file : m_files)
+	{
+		if (!file->Open())
+		{
+			failed_path = file->Path();
+			return false;
+		}
+	}
+
+	m_open = true;
+	return true;
+}
+
+uint64_t CTensorOutputSet::AcquireRow()
+{
+	const uint64_t row = m_num_rows.fetch_add(1, std::memory_order_relaxed);
+	if (row < m_preallocated_rows.load(std::memory_order_acquire))
+	{
+		return row;
+	}
+
+	std::lock_guard<std::mutex> lock(m_preallocate_mutex);
+	const uint64_t preallocated_rows = m_preallocated_rows.load(std::memory_order_relaxed);
+	if (row >= preallocated_rows)
+	{
+		// Failing is fine, the writes extend the files as they go
+		const uint64_t num_rows =
+		    std::max({2 * preallocated_rows, row + 1, k_min_preallocated_rows});
+		for (std::unique_ptr<CTensorFile>& file : m_files)
+		{
+			file->Preallocate(num_rows);
+		}
+		m_preallocated_rows.store(num_rows, std::memory_order_release);
+	}
+	return row;
+}
+
+void CTensorOutputSet::ReleaseRow(uint64_t row)
+{
+	std::lock_guard<std::mutex> lock(m_index_mutex);
+	m_failed_rows.push_back(row);
+}
+
+uint64_t CTensorOutputSet::CompactRows()
+{
+	uint64_t num_rows = m_num_rows.load();
+	m_row_paths.resize(num_rows);
+
+	std::sort(m_failed_rows.begin(), m_failed_rows.end());
+	m_failed_rows.erase(std::unique(m_failed_rows.begin(), m_failed_rows.end()),
+	                    m_failed_rows.end());
+
+	// Failed rows at the end are just dropped, the others get the last good row
+	std::vector<uint64_t>::const_iterator last_failed = m_failed_rows.end();
+	for (uint64_t hole : m_failed_rows)
+	{
+		while (num_rows > 0 && last_failed != m_failed_rows.begin() &&
+		       *(last_failed - 1) == num_rows - 1)
+		{
+			--last_failed;
+			--num_rows;
+		}
+		if (hole >= num_rows)
+		{
+			break;
+		}
+
+		const uint64_t last_row = num_rows - 1;
+		for (std::unique_ptr<CTensorFile>& file : m_files)
+		{
+			file->MoveRow(last_row, hole);
+		}
+		m_row_paths[hole] = std::move(m_row_paths[last_row]);
+		--num_rows;
+	}
+
+	m_row_paths.resize(num_rows);
+	return num_rows;
+}
+
+bool CTensorOutputSet::Write(size_t output_index, uint64_t row, const std::string& input_path,
+                             const cv::Mat& image)
+{
+	// OpenCV decodes to BGR, loaders expect RGB
+	thread_local cv::Mat rgb;
+	cv::cvtColor(image, rgb, cv::COLOR_BGR2RGB);
+
+	if (!m_files[output_index]->WriteRow(row, rgb))
+	{
+		return false;
+	}
+
+	if (output_index == 0)
+	{
+		std::lock_guard<std::mutex> lock(m_index_mutex);
+		if (m_row_paths.size() <= row)
+		{
+			m_row_paths.resize(row + 1);
+		}
+		m_row_paths[row] = input_path;
+	}
+	return true;
+}
+
+bool CTensorOutputSet::Close()
+{
+	if (!m_open)
+	{
+		return true;
+	}
+	m_open = false;
+
+	const uint64_t num_rows = CompactRows();
+	m_num_rows = num_rows;
+
+	std::string index;
+	for (const std::string& row_path : m_row_paths)
+	{
+		index += row_path + '\n';
+	}
+
+	bool success = true;
+	for (std::unique_ptr<CTensorFile>& file : m_files)
+	{
+		success = file->Close(num_rows) && success;
+
+		std::ofstream index_stream(fs::path(file->Path()).replace_extension(".txt"),
+		                           std::ios::binary | std::ios::trunc);
+		index_stream.write(index.data(), index.size());
+		index_stream.close();
+		success = success && index_stream;
+	}
+
+	return success;
+}
+
+const std::string& CTensorOutputSet::Path(size_t output_index) const
+{
+	return m_files[output_index]->Path();
+}
@@ -0,0 +1,65 @@
+﻿// TensorOutput.h : Raw NHWC uint8 arrays as an output format (--output-format=npy).
+
+#pragma once
+
+#include "ImageResizer.h"
+
+#include <atomic>
+#include <mutex>
+
+class CTensorFile;
+
+// Writes the resized pixels of every input, without encoding them, as one row of a
+// (N, H, W, 3) uint8 .npy array in RGB order for each output size. Next to each array
+// (images<suffix>.npy in the output folder, with ShardSuffix before the extension) is
+// images<suffix>.txt, whose line i is the input path of row i.
+//
+// Rows are handed out as inputs finish and each writer fills its row at its own offset,
+// without any locking. The files are preallocated ahead of the rows in growing chunks. The
+// shape in the .npy header is only known at the end, Close() patches it in and trims the
+// rest, so loaders can memory map the array as soon as the run is over. Rows whose write
+// failed are filled with the last rows at Close(), so the arrays never have blank samples;
+// the row numbers reported for the moved inputs are then out of date, the .txt index is not.
+class CTensorOutputSet
+{
+public:
+	explicit CTensorOutputSet(const SProgramOptions& program_options);
+	~CTensorOutputSet();
+
+	CTensorOutputSet(const CTensorOutputSet&) = delete;
+	CTensorOutputSet& operator=(const CTensorOutputSet&) = delete;
+
+	// Creates the arrays, failed_path is the one that couldn't be created
+	bool Open(std::string& failed_path);
+
+	// Reserves the next row in all the arrays for one input. Thread-safe.
+	uint64_t AcquireRow();
+	// Gives back a row some output couldn't be written to. Thread-safe.
+	void ReleaseRow(uint64_t row);
+
+	// Writes image, which has to be the size of the output, to its row. Thread-safe.
+	bool Write(size_t output_index, uint64_t row, const std::string& input_path,
+	           const cv::Mat& image);
+
+	// Fills in the final shapes and writes the path indexes
+	bool Close();
+
+	const std::string& Path(size_t output_index) const;
+	uint64_t NumberOfRows() const { return m_num_rows; }
+
+private:
+	// Fills the failed rows with the last ones and drops them, returns the final row count
+	uint64_t CompactRows();
+
+	std::vector<std::unique_ptr<CTensorFile>> m_files;
+	std::atomic<uint64_t> m_num_rows{0};
+	// Rows the files have room for
+	std::atomic<uint64_t> m_preallocated_rows{0};
+	std::mutex m_preallocate_mutex;
+
+	std::mutex m_index_mutex;
+	// Input path of each row
+	std::vector<std::string> m_row_paths;
+	std::vector<uint64_t> m_failed_rows;
+	bool m_open{false};
+};
@@ -0,0 +1,434 @@
+﻿// Tests.cpp : Behavior tests for the parts of ImageResizer that work without real images.
+//
+// Covers parsing --output, the pass-through check, naming and writing tar shards and the
+// --incremental manifest. Every test runs in a fresh temporary folder, failed checks are
+// printed and the exit code is the number of failed tests (see add_test in CMakeLists.txt).
+
+#include "ImageResizer.h"
+#include "ImageResizerLib.h"
+#include "Manifest.h"
+#include "TarShards.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+// Number of failed checks in the test that is running
+uint32_t g_num_failed_checks = 0;
+
+#define CHECK(condition)                                                                       \
+	do                                                                                         \
+	{                                                                                          \
+		if (!(condition))                                                                      \
+		{                                                                                      \
+			std::cout << "  " << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ")\n";     \
+			g_num_failed_checks++;                                                             \
+		}                                                                                      \
+	} while (0)
+
+std::string ReadWholeFile(const fs::path& path)
+{
+	std::ifstream stream(path, std::ios::binary);
+	return std::string(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+}
+
+void WriteWholeFile(const fs::path& path, const std::string& contents)
+{
+	std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+	stream.write(contents.data(), contents.size());
+}
+
+// Value of a NUL or space terminated octal field of a tar header
+uint64_t ReadOctal(const char* field, size_t field_size)
+{
+	uint64_t value = 0;
+	for (size_t i = 0; i < field_size && field[i] >= '0' && field[i] <= '7'; ++i)
+	{
+		value = value * 8 + (uint64_t)(field[i] - '0');
+	}
+	return value;
+}
+
+std::string ReadTarString(const char* field, size_t field_size)
+{
+	return std::string(field, strnlen(field, field_size));
+}
+
+bool HasValidTarChecksum(const char* block)
+{
+	uint32_t checksum = 0;
+	for (size_t i = 0; i < 512; ++i)
+	{
+		checksum += (i >= 148 && i < 156) ? (unsigned char)' ' : (unsigned char)block[i];
+	}
+	return ReadOctal(block + 148, 8) == checksum;
+}
+
+struct STarMember
+{
+	// Where the contents start in the archive
+	uint64_t offset{0};
+	uint64_t size{0};
+};
+
+// Lists the regular files in a ustar archive by their full name, taken from the pax
+// extended header, or from the prefix and name fields. False if the archive is malformed.
+bool ReadTarMembers(const std::string& archive, std::map<std::string, STarMember>& members)
+{
+	std::string pax_path;
+	size_t offset = 0;
+	while (offset + 512 <= archive.size())
+	{
+		const char* header = archive.data() + offset;
+		if (std::all_of(header, header + 512, [](char c) { return c == '\0'; }))
+		{
+			// Two zero blocks end the archive, nothing may follow them
+			return archive.size() == offset + 1024 &&
+			       archive.find_first_not_of('\0', offset) == std::string::npos;
+		}
+		if (!HasValidTarChecksum(header) || memcmp(header + 257, "ustar", 6) != 0)
+		{
+			return false;
+		}
+
+		const uint64_t size = ReadOctal(header + 124, 12);
+		const uint64_t contents_offset = offset + 512;
+		offset = contents_offset + (size + 511) / 512 * 512;
+		if (offset > archive.size())
+		{
+			return false;
+		}
+
+		if (header[156] == 'x')
+		{
+			// "<length> path=<name>\n", where length counts the whole record
+			const std::string record = archive.substr(contents_offset, size);
+			const size_t key_pos = record.find(" path=");
+			if (key_pos == std::string::npos || std::stoull(record) != record.size() ||
+			    record.back() != '\n')
+			{
+				return false;
+			}
+			pax_path = record.substr(key_pos + 6, record.size() - key_pos - 7);
+			continue;
+		}
+		if (header[156] != '0')
+		{
+			return false;
+		}
+
+		const std::string prefix = ReadTarString(header + 345, 155);
+		std::string name = ReadTarString(header, 100);
+		name = !pax_path.empty() ? pax_path : prefix.empty() ? name : prefix + '/' + name;
+		members[name] = STarMember{contents_offset, size};
+		pax_path.clear();
+	}
+	return false;
+}
+
+void TestParseOutputSpec(const fs::path&)
+{
+	SOutputSpec output_spec;
+	CHECK(ParseOutputSpec("320x240", output_spec));
+	CHECK(output_spec.target_width == 320 && output_spec.target_height == 240);
+	CHECK(output_spec.suffix.empty() && output_spec.output_folder.empty());
+
+	output_spec = SOutputSpec{};
+	CHECK(ParseOutputSpec("64x48:_thumb@thumbs", output_spec));
+	CHECK(output_spec.target_width == 64 && output_spec.target_height == 48);
+	CHECK(output_spec.suffix == "_thumb");
+	CHECK(output_spec.output_folder == "thumbs");
+
+	// The largest size that is accepted, and just above it
+	output_spec = SOutputSpec{};
+	CHECK(ParseOutputSpec("1048576x1048576", output_spec));
+	CHECK(output_spec.target_width == 1048576 && output_spec.target_height == 1048576);
+	CHECK(!ParseOutputSpec("1048577x16", output_spec));
+	CHECK(!ParseOutputSpec("16x1048577", output_spec));
+
+	// Too large for stoul, or for uint32_t once parsed
+	CHECK(!ParseOutputSpec("99999999999999999999999x16", output_spec));
+	CHECK(!ParseOutputSpec("16x4294967297", output_spec));
+
+	for (const char* invalid : {"", "x", "320", "x240", "320x", "320x240x16", "-320x240",
+	                            "320 x 240", "0x10y", "320x240:", "320x240@", "320x240:@a"})
+	{
+		output_spec = SOutputSpec{};
+		if (ParseOutputSpec(invalid, output_spec))
+		{
+			std::cout << "  accepted \"" << invalid << "\"\n";
+			g_num_failed_checks++;
+		}
+	}
+}
+
+void TestIsPassThrough(const fs::path&)
+{
+	SImageHeader header;
+	header.width = 640;
+	header.height = 480;
+	header.channels = 3;
+	header.bit_depth = 8;
+
+	SResizeOptions resize_options;
+	resize_options.native_layout = 1;
+	resize_options.outputs = {SOutputSpec{640, 480, "", ""}};
+	CHECK(IsPassThrough(header, resize_options));
+
+	// Every output has to match, whatever its suffix or folder
+	resize_options.outputs.push_back(SOutputSpec{640, 480, "_copy", "copies"});
+	CHECK(IsPassThrough(header, resize_options));
+	resize_options.outputs.push_back(SOutputSpec{320, 240, "_small", ""});
+	CHECK(!IsPassThrough(header, resize_options));
+
+	// Same area, swapped sides
+	resize_options.outputs = {SOutputSpec{480, 640, "", ""}};
+	CHECK(!IsPassThrough(header, resize_options));
+
+	// Padding for a kept aspect ratio only happens when the size differs
+	resize_options.outputs = {SOutputSpec{640, 480, "", ""}};
+	resize_options.keep_aspect_ratio = 1;
+	CHECK(IsPassThrough(header, resize_options));
+
+	// The decoded image would be rotated, or converted to 8-bit BGR
+	header.orientation = 6;
+	CHECK(!IsPassThrough(header, resize_options));
+	header.orientation = 1;
+	resize_options.native_layout = 0;
+	CHECK(!IsPassThrough(header, resize_options));
+
+	resize_options.native_layout = 1;
+	resize_options.outputs.clear();
+	CHECK(!IsPassThrough(header, resize_options));
+}
+
+void TestMakeArchiveMemberName(const fs::path&)
+{
+	// A single argument folder is common to all inputs and left out
+	CHECK(MakeArchiveMemberName("photos/2020/a.jpg", 1) == "2020/a.jpg");
+	CHECK(MakeArchiveMemberName("photos/2020/a.jpg", 2) == "photos/2020/a.jpg");
+	CHECK(MakeArchiveMemberName("a.jpg", 1) == "a.jpg");
+
+	// Nothing may point outside the archive
+	CHECK(MakeArchiveMemberName("/photos/a.jpg", 2) == "photos/a.jpg");
+	CHECK(MakeArchiveMemberName("../photos/a.jpg", 2) == "photos/a.jpg");
+	CHECK(MakeArchiveMemberName("photos/../../a.jpg", 2) == "a.jpg");
+	CHECK(MakeArchiveMemberName("./photos/./a.jpg", 2) == "photos/a.jpg");
+}
+
+void TestTarShards(const fs::path& folder)
+{
+	const std::string short_name = "folder/a.jpg";
+	// Fits once split at the '/' into the ustar prefix and name fields
+	const std::string split_name = std::string(120, 'p') + "/b.jpg";
+	// Can't be split, goes into a pax extended header
+	const std::string pax_name = std::string(200, 'c') + ".jpg";
+
+	std::vector<std::vector<SJobOutput>> images;
+	for (const std::string& name : {short_name, split_name, pax_name})
+	{
+		SJobOutput output;
+		output.output_path = name;
+		output.encoded_bytes = std::make_shared<ByteBuffer>(700 + name.size(), (uint8_t)name[0]);
+		images.push_back({output});
+	}
+
+	{
+		CTarShardSet tar_shards(folder.string(), "-1of2", 2, 1ull << 30);
+		for (const std::vector<SJobOutput>& outputs : images)
+		{
+			std::string shard_path;
+			CHECK(tar_shards.Append(outputs, shard_path));
+		}
+		CHECK(tar_shards.Close());
+
+		const STarShardStats stats = tar_shards.Stats();
+		CHECK(stats.num_shards == 2);
+		CHECK(stats.num_images == 3 && stats.num_members == 3);
+	}
+
+	// At most 2 images per shard, a single thread fills them in order
+	const std::string shards[] = {ReadWholeFile(folder / "shard-000000-1of2.tar"),
+	                              ReadWholeFile(folder / "shard-000001-1of2.tar")};
+	const std::string indexes[] = {ReadWholeFile(folder / "shard-000000-1of2.idx"),
+	                               ReadWholeFile(folder / "shard-000001-1of2.idx")};
+
+	std::map<std::string, STarMember> members[2];
+	for (size_t i = 0; i < 2; ++i)
+	{
+		CHECK(ReadTarMembers(shards[i], members[i]));
+
+		// The index lists the offset and size of each member's contents, in archive order
+		std::string expected_index;
+		std::vector<std::pair<uint64_t, std::string>> ordered;
+		for (const auto& [name, member] : members[i])
+		{
+			ordered.emplace_back(member.offset, name + '\t' + std::to_string(member.offset) +
+			                                        '\t' + std::to_string(member.size) + '\n');
+		}
+		std::sort(ordered.begin(), ordered.end());
+		for (const auto& line : ordered)
+		{
+			expected_index += line.second;
+		}
+		CHECK(indexes[i] == expected_index);
+	}
+	CHECK(members[0].size() == 2 && members[1].size() == 1);
+	CHECK(members[0].count(short_name) && members[0].count(split_name));
+	CHECK(members[1].count(pax_name));
+
+	for (const std::vector<SJobOutput>& outputs : images)
+	{
+		const std::string& name = outputs[0].output_path;
+		const size_t shard = name == pax_name ? 1 : 0;
+		if (members[shard].count(name) == 0)
+		{
+			continue;
+		}
+
+		const STarMember& member = members[shard][name];
+		const ByteBuffer& bytes = *outputs[0].encoded_bytes;
+		CHECK(member.size == bytes.size());
+		CHECK(shards[shard].compare(member.offset, bytes.size(), (const char*)bytes.data(),
+		                            bytes.size()) == 0);
+	}
+
+	// The long name that has a '/' in the right place needs no pax header
+	if (members[0].count(split_name))
+	{
+		const char* header = shards[0].data() + members[0][split_name].offset - 512;
+		CHECK(ReadTarString(header + 345, 155) == std::string(120, 'p'));
+		CHECK(ReadTarString(header, 100) == "b.jpg");
+	}
+}
+
+void TestManifestRoundTrip(const fs::path& folder)
+{
+	const std::string manifest_path = (folder / "manifest").string();
+	const fs::path input_path = folder / "in.jpg";
+	const fs::path output_path = folder / "out.jpg";
+	WriteWholeFile(input_path, "input contents");
+	WriteWholeFile(output_path, "output contents");
+
+	const uint64_t options_hash = 0x1234;
+	SProgramOptions program_options;
+	program_options.output_format = EOutputFormat::RECREATE_FOLDER_STRUCTURE;
+
+	SImageJob job;
+	job.path = input_path.string();
+	job.input_size = fs::file_size(input_path);
+	job.input_mtime = fs::last_write_time(input_path).time_since_epoch().count();
+	job.outputs.resize(1);
+	job.outputs[0].output_path = output_path.string();
+
+	{
+		CManifest manifest(manifest_path, options_hash);
+		CHECK(manifest.Open());
+		CHECK(manifest.NumberOfLoadedEntries() == 0);
+		// Recorded twice, compacted into one record on Close()
+		manifest.Record(job, program_options);
+		manifest.Record(job, program_options);
+		CHECK(manifest.Close());
+	}
+	CHECK(!fs::exists(manifest_path + ".tmp"));
+	const uintmax_t compacted_size = fs::file_size(manifest_path);
+
+	{
+		CManifest manifest(manifest_path, options_hash);
+		CHECK(manifest.Open());
+		CHECK(manifest.NumberOfLoadedEntries() == 1);
+		CHECK(manifest.IsUpToDate(fs::directory_entry(input_path)));
+		CHECK(manifest.Close());
+	}
+	CHECK(fs::file_size(manifest_path) == compacted_size);
+
+	// Other options make every entry stale
+	{
+		CManifest manifest(manifest_path, options_hash + 1);
+		CHECK(manifest.Open());
+		CHECK(!manifest.IsUpToDate(fs::directory_entry(input_path)));
+	}
+
+	// A record torn off by a crash is dropped, the ones before it are kept
+	{
+		std::ofstream stream(manifest_path, std::ios::binary | std::ios::app);
+		stream.write("\x40\x00\x00\x00torn", 8);
+	}
+	{
+		CManifest manifest(manifest_path, options_hash);
+		CHECK(manifest.Open());
+		CHECK(manifest.NumberOfLoadedEntries() == 1);
+		CHECK(manifest.IsUpToDate(fs::directory_entry(input_path)));
+		CHECK(manifest.Close());
+	}
+	CHECK(fs::file_size(manifest_path) == compacted_size);
+
+	// Outputs that were deleted since, or a changed input, have to be redone
+	{
+		CManifest manifest(manifest_path, options_hash);
+		CHECK(manifest.Open());
+		fs::remove(output_path);
+		CHECK(!manifest.IsUpToDate(fs::directory_entry(input_path)));
+		WriteWholeFile(output_path, "output contents");
+		CHECK(manifest.IsUpToDate(fs::directory_entry(input_path)));
+		WriteWholeFile(input_path, "changed input contents");
+		CHECK(!manifest.IsUpToDate(fs::directory_entry(input_path)));
+	}
+
+	// Files that aren't manifests are left alone
+	WriteWholeFile(manifest_path, "not a manifest");
+	{
+		CManifest manifest(manifest_path, options_hash);
+		CHECK(!manifest.Open());
+		CHECK(!manifest.Error().empty());
+	}
+	CHECK(ReadWholeFile(manifest_path) == "not a manifest");
+}
+
+struct STest
+{
+	const char* name;
+	void (*run)(const fs::path& folder);
+};
+
+const STest k_tests[] = {
+    {"ParseOutputSpec", TestParseOutputSpec},
+    {"IsPassThrough", TestIsPassThrough},
+    {"MakeArchiveMemberName", TestMakeArchiveMemberName},
+    {"TarShards", TestTarShards},
+    {"ManifestRoundTrip", TestManifestRoundTrip},
+};
+} // namespace
+
+int main()
+{
+	const fs::path root_folder =
+	    fs::temp_directory_path() /
+	    ("ImageResizerTests-" +
+	     std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+
+	int num_failed_tests = 0;
+	for (const STest& test : k_tests)
+	{
+		const fs::path folder = root_folder / test.name;
+		fs::create_directories(folder);
+
+		g_num_failed_checks = 0;
+		test.run(folder);
+		std::cout << (g_num_failed_checks ? "FAILED " : "passed ") << test.name << "\n";
+		num_failed_tests += g_num_failed_checks ? 1 : 0;
+	}
+
+	std::error_code ec;
+	fs::remove_all(root_folder, ec);
+	return num_failed_tests;
+}
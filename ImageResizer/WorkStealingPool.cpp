@@ -0,0 +1,227 @@
+﻿#include "WorkStealingPool.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace
+{
+// Orders the task heaps, the most expensive and then the earliest submitted task on top
+template <typename TTask>
+bool RunsLater(const TTask& a, const TTask& b)
+{
+	return a.cost != b.cost ? a.cost < b.cost : a.sequence > b.sequence;
+}
+
+// Bands per participating thread, so threads that get to their bands late or run on a
+// busy core don't hold up the others much
+const int k_bands_per_thread = 4;
+
+// Shared by the threads working on one ParallelFor call. Helpers that only get to run
+// once all bands have been claimed must not touch body anymore, the call may have returned.
+struct SParallelBands
+{
+	const std::function<void(int, int)>* body{nullptr};
+	int count{0};
+	int num_bands{0};
+	std::atomic<int> next_band{0};
+	std::atomic<int> num_done{0};
+	std::mutex mutex;
+	std::condition_variable all_done;
+};
+
+void RunBands(SParallelBands& bands)
+{
+	for (int band = bands.next_band++; band < bands.num_bands; band = bands.next_band++)
+	{
+		const int begin = (int)((int64_t)bands.count * band / bands.num_bands);
+		const int end = (int)((int64_t)bands.count * (band + 1) / bands.num_bands);
+		(*bands.body)(begin, end);
+
+		if (++bands.num_done == bands.num_bands)
+		{
+			std::lock_guard<std::mutex> lock(bands.mutex);
+			bands.all_done.notify_all();
+		}
+	}
+}
+} // namespace
+
+CWorkStealingPool::CWorkStealingPool(uint32_t num_workers)
+{
+	num_workers = std::max(num_workers, 1u);
+
+	for (uint32_t i = 0; i < num_workers; ++i)
+	{
+		m_queues.push_back(std::make_unique<SWorkerQueue>());
+	}
+	for (uint32_t i = 0; i < num_workers; ++i)
+	{
+		m_workers.emplace_back([this, i]() { Worker(i); });
+	}
+}
+
+CWorkStealingPool::~CWorkStealingPool()
+{
+	Finish();
+}
+
+void CWorkStealingPool::Submit(uint64_t cost, Task task)
+{
+	// Spread the tasks over the workers, stealing evens out whatever imbalance is left
+	SWorkerQueue& queue = *m_queues[m_next_queue++ % m_queues.size()];
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_num_queued++;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.tasks.push_back(STask{cost, m_next_sequence++, std::move(task)});
+		std::push_heap(queue.tasks.begin(), queue.tasks.end(), RunsLater<STask>);
+		queue.top_cost = queue.tasks.front().cost;
+		queue.size = queue.tasks.size();
+	}
+	m_work_available.notify_one();
+}
+
+void CWorkStealingPool::ParallelFor(int count, int min_band_size,
+                                    const std::function<void(int, int)>& body)
+{
+	const int max_bands = std::max(count / std::max(min_band_size, 1), 1);
+	const int num_helpers = std::min((int)m_num_idle.load(), max_bands - 1);
+	if (num_helpers <= 0)
+	{
+		body(0, count);
+		return;
+	}
+
+	std::shared_ptr<SParallelBands> bands = std::make_shared<SParallelBands>();
+	bands->body = &body;
+	bands->count = count;
+	bands->num_bands = std::min(max_bands, (num_helpers + 1) * k_bands_per_thread);
+	m_num_splits++;
+
+	// Helpers go in front of every queued file, the image they help with is already
+	// decoded and holding memory
+	for (int i = 0; i < num_helpers; ++i)
+	{
+		Submit(std::numeric_limits<uint64_t>::max(), [bands]() { RunBands(*bands); });
+	}
+
+	// The calling thread takes part, so this finishes even if no helper ever starts
+	RunBands(*bands);
+
+	std::unique_lock<std::mutex> lock(bands->mutex);
+	bands->all_done.wait(lock, [&bands]() { return bands->num_done == bands->num_bands; });
+}
+
+void CWorkStealingPool::Finish()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_finishing)
+		{
+			return;
+		}
+		m_finishing = true;
+	}
+	m_work_available.notify_all();
+
+	for (std::thread& worker : m_workers)
+	{
+		worker.join();
+	}
+	m_tail_end = std::chrono::steady_clock::now();
+}
+
+double CWorkStealingPool::TailSeconds() const
+{
+	return m_tail_started ? std::chrono::duration<double>(m_tail_end - m_tail_start).count()
+	                      : 0.0;
+}
+
+bool CWorkStealingPool::PopFrom(SWorkerQueue& queue, STask& task)
+{
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tasks.empty())
+		{
+			return false;
+		}
+
+		std::pop_heap(queue.tasks.begin(), queue.tasks.end(), RunsLater<STask>);
+		task = std::move(queue.tasks.back());
+		queue.tasks.pop_back();
+		queue.top_cost = queue.tasks.empty() ? 0 : queue.tasks.front().cost;
+		queue.size = queue.tasks.size();
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_num_queued--;
+	return true;
+}
+
+bool CWorkStealingPool::TryPop(uint32_t worker_index, STask& task)
+{
+	if (PopFrom(*m_queues[worker_index], task))
+	{
+		return true;
+	}
+
+	// The own queue is empty, steal the most expensive top task of the others
+	const uint32_t num_queues = (uint32_t)m_queues.size();
+	for (;;)
+	{
+		uint32_t best_offset = 0;
+		uint64_t best_cost = 0;
+		for (uint32_t i = 1; i < num_queues; ++i)
+		{
+			const SWorkerQueue& queue = *m_queues[(worker_index + i) % num_queues];
+			if (queue.size.load() > 0 && (best_offset == 0 || queue.top_cost.load() > best_cost))
+			{
+				best_offset = i;
+				best_cost = queue.top_cost.load();
+			}
+		}
+		if (best_offset == 0)
+		{
+			return false;
+		}
+
+		// Another worker may have emptied it in the meantime, then look again
+		if (PopFrom(*m_queues[(worker_index + best_offset) % num_queues], task))
+		{
+			m_num_steals++;
+			return true;
+		}
+	}
+}
+
+void CWorkStealingPool::Worker(uint32_t worker_index)
+{
+	STask task;
+	for (;;)
+	{
+		if (TryPop(worker_index, task))
+		{
+			task.run();
+			task.run = nullptr;
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_num_idle++;
+		m_work_available.wait(lock, [this]() { return m_finishing || m_num_queued > 0; });
+		m_num_idle--;
+		if (m_finishing && m_num_queued == 0)
+		{
+			// Nothing will be submitted anymore, whatever still runs is the tail
+			if (!m_tail_started)
+			{
+				m_tail_started = true;
+				m_tail_start = std::chrono::steady_clock::now();
+			}
+			return;
+		}
+	}
+}
@@ -0,0 +1,100 @@
+﻿// WorkStealingPool.h : Worker threads with a task heap each, ordered by estimated cost.
+
+#pragma once
+
+#include "ImageResizer.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs tasks on a fixed set of worker threads. Every worker has its own heap of tasks,
+// ordered by their estimated cost, and the submitted tasks are spread over the heaps. A
+// worker runs the tasks of its own heap, most expensive first. Only once its heap is empty
+// it steals from the others, taking the most expensive of their top tasks.
+//
+// Since the tasks are dealt out round robin, every heap holds a similar mix of costs, so
+// running each one largest first keeps a few large files from ending up alone at the end of
+// the run while every other worker is idle. Unlike a single shared queue, a worker only
+// touches the other workers' locks when it runs out of work.
+class CWorkStealingPool
+{
+public:
+	using Task = std::function<void()>;
+
+	explicit CWorkStealingPool(uint32_t num_workers);
+	~CWorkStealingPool();
+
+	CWorkStealingPool(const CWorkStealingPool&) = delete;
+	CWorkStealingPool& operator=(const CWorkStealingPool&) = delete;
+
+	// Queues a task. cost can be in any unit, e.g. the file size, tasks of equal cost
+	// are started in the order they were submitted.
+	void Submit(uint64_t cost, Task task);
+
+	// Splits [0, count) into bands of at least min_band_size items and runs body(begin, end)
+	// on each of them, on the calling thread and on the workers that are idle right now.
+	// Returns once every band is done. Without idle workers, e.g. while plenty of files are
+	// queued, body just runs on the whole range. Meant to be called from within tasks.
+	void ParallelFor(int count, int min_band_size, const std::function<void(int, int)>& body);
+
+	// Waits for all submitted tasks to finish, then stops the workers
+	void Finish();
+
+	uint32_t NumberOfWorkers() const { return (uint32_t)m_workers.size(); }
+	// Number of tasks that were run by another worker than the one they were queued on
+	uint64_t NumberOfSteals() const { return m_num_steals.load(); }
+	// Number of ParallelFor calls that idle workers helped with
+	uint64_t NumberOfSplits() const { return m_num_splits.load(); }
+	// Seconds from the first worker running out of work after Finish was called to the
+	// last task finishing, i.e. how long the run was held up by stragglers
+	double TailSeconds() const;
+
+private:
+	struct STask
+	{
+		uint64_t cost{0};
+		// Submission order, breaks ties between tasks of equal cost
+		uint64_t sequence{0};
+		Task run;
+	};
+
+	struct SWorkerQueue
+	{
+		std::mutex mutex;
+		// Binary heap, the most expensive task on top
+		std::vector<STask> tasks;
+		// Cost of the top task and number of tasks, read without the lock to pick a queue
+		// to steal from
+		std::atomic<uint64_t> top_cost{0};
+		std::atomic<size_t> size{0};
+	};
+
+	bool PopFrom(SWorkerQueue& queue, STask& task);
+	bool TryPop(uint32_t worker_index, STask& task);
+	void Worker(uint32_t worker_index);
+
+	std::vector<std::unique_ptr<SWorkerQueue>> m_queues;
+	std::vector<std::thread> m_workers;
+	std::atomic<uint32_t> m_next_queue{0};
+	std::atomic<uint64_t> m_next_sequence{0};
+	std::atomic<uint64_t> m_num_steals{0};
+	std::atomic<uint64_t> m_num_splits{0};
+
+	// Idle workers sleep on m_work_available until a task is queued or the pool finishes.
+	// m_num_queued is guarded by m_mutex. It is raised before a task is pushed and lowered
+	// after it was popped, so it may briefly count too many tasks but never too few.
+	std::mutex m_mutex;
+	std::condition_variable m_work_available;
+	uint64_t m_num_queued{0};
+	// Workers waiting on m_work_available, ParallelFor hands bands to that many
+	std::atomic<uint32_t> m_num_idle{0};
+	bool m_finishing{false};
+	bool m_tail_started{false};
+	std::chrono::steady_clock::time_point m_tail_start;
+	std::chrono::steady_clock::time_point m_tail_end;
+};